@@ -0,0 +1,255 @@
+// -*- JavaScript -*-
+
+// Loopback SIP load test.  A UAS child process answers every call, the
+// UAC places calls at the requested rate through callMakeCallBatch()
+// and hangs them up after the hold time.  Both sides use this addon
+// and talk over 127.0.0.1.  The result is printed as JSON.  If not
+// every call has ended by the deadline (by default the time needed to
+// place all calls plus the hold time and 30 seconds), for example
+// because events were dropped, what was measured so far is reported
+// with timed_out set.
+//
+// usage: node bench/load.js [--calls N] [--cps N] [--hold ms]
+//                           [--max-in-flight N] [--mode sync|queue|batch]
+//                           [--uac-port N] [--uas-port N] [--timeout ms]
+
+var child_process = require('child_process');
+var pjsip = require('../pjsip');
+
+var options = {
+    calls: 1000,
+    cps: 50,
+    hold: 1000,
+    'max-in-flight': 0,
+    mode: 'queue',
+    'uac-port': 5072,
+    'uas-port': 5074,
+    timeout: 0
+};
+
+for (var i = 2; i < process.argv.length; i++) {
+    var match = process.argv[i].match(/^--(.*)/);
+    if (match && match[1] == 'uas') {
+        options.uas = true;
+    } else if (match) {
+        var value = process.argv[++i];
+        options[match[1]] = isNaN(value) ? value : Number(value);
+    }
+}
+
+function now()
+{
+    if (process.hrtime) {
+        var time = process.hrtime();
+        return time[0] * 1000 + time[1] / 1e6;
+    } else {
+        return Date.now();
+    }
+}
+
+function percentiles(values)
+{
+    values.sort(function (a, b) { return a - b; });
+    function at(fraction) {
+        return values.length ? values[Math.min(values.length - 1, Math.floor(fraction * values.length))] : 0;
+    }
+    return { count: values.length, p50: at(0.5), p90: at(0.9), p99: at(0.99), max: at(1) };
+}
+
+function startOptions(port)
+{
+    var startOptions = { port: port, max_calls: 512 };
+    if (options.mode == 'queue') {
+        startOptions.event_queue = true;
+    } else if (options.mode == 'batch') {
+        startOptions.batch = true;
+        startOptions.max_batch_latency = 1;
+    }
+    return startOptions;
+}
+
+// Invoke handler(name, args) for every event, whether it was delivered
+// alone or in a batch
+function eventHandler(handler)
+{
+    return function (name) {
+        if (name == 'events') {
+            var events = arguments[1];
+            for (var i = 0; i < events.length; i++) {
+                handler(events[i][0], events[i].slice(1));
+            }
+        } else {
+            handler(name, Array.prototype.slice.call(arguments, 1));
+        }
+    };
+}
+
+// Measure how late timers fire, in milliseconds
+function loopLagMonitor()
+{
+    var lags = [];
+    var interval = 10;
+    var expected = now() + interval;
+    var timer = setInterval(function () {
+        var time = now();
+        lags.push(Math.max(0, time - expected));
+        expected = time + interval;
+    }, interval);
+    return {
+        stop: function () {
+            clearInterval(timer);
+            return percentiles(lags);
+        }
+    };
+}
+
+function runUas()
+{
+    var answered = 0;
+    pjsip.start(eventHandler(function (name, args) {
+        if (name == 'incoming_call') {
+            pjsip.callAnswer(args[1].id, pjsip.SC_OK);
+            answered++;
+        }
+    }), startOptions(options['uas-port']));
+    pjsip.addLocalAccount();
+
+    process.on('message', function (message) {
+        if (message == 'stop') {
+            var stats = pjsip.getStats();
+            process.send({ answered: answered,
+                           delivery_latency: stats.delivery_latency,
+                           dropped_events: stats.event_queue.dropped,
+                           transports: stats.transports });
+            process.exit(0);
+        }
+    });
+    process.send('ready');
+}
+
+function runUac(uas)
+{
+    var CONFIRMED = pjsip.CALL_STATE.CONFIRMED;
+    var DISCONNECTED = pjsip.CALL_STATE.DISCONNCTD;
+
+    var madeAt = {};
+    var setupLatencies = [];
+    var confirmed = 0;
+    var completed = 0;
+    var failed = 0;
+    var firstMade, lastConfirmed;
+    var lag;
+    var deadline;
+    var reported = false;
+    var timedOut = false;
+
+    function finished()
+    {
+        return completed + failed == options.calls;
+    }
+
+    // Events keep arriving after the last call has ended, report once
+    function report()
+    {
+        if (reported) {
+            return;
+        }
+        reported = true;
+        clearTimeout(deadline);
+        var loopLag = lag.stop();
+        var stats = pjsip.getStats();
+        uas.send('stop');
+        uas.on('message', function (uasStats) {
+            var duration = (lastConfirmed - firstMade) / 1000;
+            console.log(JSON.stringify({
+                mode: options.mode,
+                calls: options.calls,
+                hold_ms: options.hold,
+                timed_out: timedOut,
+                cps_target: options.cps,
+                cps_sustained: duration > 0 ? (confirmed - 1) / duration : 0,
+                confirmed: confirmed,
+                completed: completed,
+                failed: failed,
+                setup_latency_ms: percentiles(setupLatencies),
+                delivery_latency_us: stats.delivery_latency,
+                loop_lag_ms: loopLag,
+                uac_event_queue: stats.event_queue,
+                dropped_events: stats.event_queue.dropped,
+                uas: uasStats
+            }));
+            process.exit(0);
+        });
+    }
+
+    pjsip.start(eventHandler(function (name, args) {
+        var call = args[0];
+        switch (name) {
+        case 'call_made':
+            madeAt[call.id] = now();
+            if (firstMade === undefined) {
+                firstMade = madeAt[call.id];
+            }
+            break;
+        case 'call_failed':
+            failed++;
+            break;
+        case 'call_state':
+            if (call.state == CONFIRMED && madeAt[call.id] !== undefined) {
+                lastConfirmed = now();
+                setupLatencies.push(lastConfirmed - madeAt[call.id]);
+                confirmed++;
+                (function (callId) {
+                    setTimeout(function () {
+                        try {
+                            pjsip.callHangup(callId);
+                        } catch (e) {
+                            // already disconnected
+                        }
+                    }, options.hold);
+                })(call.id);
+            } else if (call.state == DISCONNECTED && madeAt[call.id] !== undefined) {
+                delete madeAt[call.id];
+                completed++;
+            }
+            break;
+        }
+        if (finished()) {
+            report();
+        }
+    }), startOptions(options['uac-port']));
+
+    var accId = pjsip.addLocalAccount();
+
+    var list = [];
+    for (var i = 0; i < options.calls; i++) {
+        list.push({ acc_id: accId,
+                    dest_uri: 'sip:load@127.0.0.1:' + options['uas-port'],
+                    id: String(i) });
+    }
+
+    var placing = options.cps > 0 ? options.calls / options.cps * 1000 : 0;
+    var timeout = options.timeout || (placing + options.hold + 30000);
+    deadline = setTimeout(function () {
+        timedOut = true;
+        report();
+    }, timeout);
+
+    lag = loopLagMonitor();
+    pjsip.callMakeCallBatch(list, { cps: options.cps, max_in_flight: options['max-in-flight'] });
+}
+
+if (options.uas) {
+    runUas();
+} else {
+    var args = [ '--uas' ];
+    for (var key in options) {
+        args.push('--' + key, String(options[key]));
+    }
+    var uas = child_process.fork(__filename, args);
+    uas.on('message', function (message) {
+        if (message == 'ready') {
+            runUac(uas);
+        }
+    });
+}
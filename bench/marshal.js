@@ -0,0 +1,20 @@
+// -*- JavaScript -*-
+
+// Per-event marshaling cost of a call info object, before (legacy)
+// and after (shaped) interned keys and object templates.
+//
+// Needs the benchmark addon: node-waf configure --benchmark build
+//
+// usage: node bench/marshal.js [iterations]
+
+var pjsip = require('../build/default/pjsip_bench.node');
+
+var iterations = parseInt(process.argv[2] || '200000', 10);
+
+// Warm up so that both variants run optimized
+pjsip.benchmarkMarshaling(10000);
+
+var result = pjsip.benchmarkMarshaling(iterations);
+result.speedup = result.legacy / result.shaped;
+
+console.log(JSON.stringify(result));
@@ -0,0 +1,21 @@
+// -*- JavaScript -*-
+
+// Microbenchmarks of the per-event conversion helpers: setKey, call
+// and account info capture and conversion, enum lookups and callback
+// argument packing.  Reports ns/op and V8 heap bytes/op as JSON.
+//
+// Needs the benchmark addon: node-waf configure --benchmark build
+//
+// usage: node bench/micro.js [iterations]
+
+var pjsip = require('../build/default/pjsip_bench.node');
+
+var iterations = parseInt(process.argv[2] || '200000', 10);
+
+function callback(event, call) {
+}
+
+// Warm up so that everything runs optimized
+pjsip.runBenchmarks(10000, callback);
+
+console.log(JSON.stringify(pjsip.runBenchmarks(iterations, callback)));
@@ -0,0 +1,125 @@
+// -*- C++ -*-
+
+// Bounded lock-free multi-producer queue, after Dmitry Vyukov's
+// bounded MPMC queue.  Producers never block: push() fails when the
+// queue is full and the caller decides what to do with the element.
+
+#ifndef _eventqueue_h
+#define _eventqueue_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <class T>
+class BoundedQueue
+{
+public:
+  BoundedQueue()
+    : _cells(0),
+      _mask(0),
+      _enqueuePos(0),
+      _dequeuePos(0)
+  {}
+  ~BoundedQueue()
+  {
+    delete[] _cells;
+  }
+
+  // Must be called before the queue is used by any producer.  The
+  // requested size is rounded up to the next power of two.
+  void allocate(size_t size)
+  {
+    size_t capacity = 2;
+    while (capacity < size) {
+      capacity <<= 1;
+    }
+    delete[] _cells;
+    _cells = new Cell[capacity];
+    for (size_t i = 0; i < capacity; i++) {
+      _cells[i].sequence = i;
+    }
+    _mask = capacity - 1;
+    _enqueuePos = 0;
+    _dequeuePos = 0;
+  }
+
+  bool allocated() const { return _cells != 0; }
+  size_t capacity() const { return _mask + 1; }
+
+  // Approximate number of elements in the queue
+  size_t size() const
+  {
+    size_t enqueuePos = _enqueuePos;
+    size_t dequeuePos = _dequeuePos;
+    return (enqueuePos > dequeuePos) ? (enqueuePos - dequeuePos) : 0;
+  }
+
+  bool push(const T& value)
+  {
+    Cell* cell;
+    size_t pos = _enqueuePos;
+    for (;;) {
+      cell = &_cells[pos & _mask];
+      size_t sequence = cell->sequence;
+      __sync_synchronize();
+      intptr_t difference = (intptr_t) sequence - (intptr_t) pos;
+      if (difference == 0) {
+        if (__sync_bool_compare_and_swap(&_enqueuePos, pos, pos + 1)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;                                       // full
+      }
+      pos = _enqueuePos;
+    }
+    cell->data = value;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    return true;
+  }
+
+  bool pop(T& value)
+  {
+    Cell* cell;
+    size_t pos = _dequeuePos;
+    for (;;) {
+      cell = &_cells[pos & _mask];
+      size_t sequence = cell->sequence;
+      __sync_synchronize();
+      intptr_t difference = (intptr_t) sequence - (intptr_t) (pos + 1);
+      if (difference == 0) {
+        if (__sync_bool_compare_and_swap(&_dequeuePos, pos, pos + 1)) {
+          break;
+        }
+      } else if (difference < 0) {
+        return false;                                       // empty
+      }
+      pos = _dequeuePos;
+    }
+    value = cell->data;
+    __sync_synchronize();
+    cell->sequence = pos + _mask + 1;
+    return true;
+  }
+
+private:
+  BoundedQueue(const BoundedQueue&);
+  BoundedQueue& operator=(const BoundedQueue&);
+
+  struct Cell
+  {
+    volatile size_t sequence;
+    T data;
+  };
+
+  // Producer and consumer positions live on separate cache lines
+  Cell* _cells;
+  size_t _mask;
+  char _pad0[64];
+  volatile size_t _enqueuePos;
+  char _pad1[64];
+  volatile size_t _dequeuePos;
+  char _pad2[64];
+};
+
+#endif
@@ -0,0 +1,111 @@
+// -*- C++ -*-
+
+// Log-linear latency histogram after HdrHistogram.  Every power of two
+// range of values is divided into 16 linear sub-buckets, so recorded
+// values are reported with a relative error below 1/16.  Recording
+// is lock-free and may happen from any thread.  Values are
+// nanoseconds and are clamped to 2^40 (about 18 minutes).
+
+#ifndef _histogram_h
+#define _histogram_h
+
+#include <stdint.h>
+
+class Histogram
+{
+public:
+  Histogram()
+    : _count(0),
+      _sum(0),
+      _min(~(uint64_t) 0),
+      _max(0)
+  {
+    for (unsigned i = 0; i < bucketCount; i++) {
+      _buckets[i] = 0;
+    }
+  }
+
+  void record(uint64_t value)
+  {
+    if (value > maxValue) {
+      value = maxValue;
+    }
+    __sync_fetch_and_add(&_buckets[bucketIndex(value)], 1);
+    __sync_fetch_and_add(&_count, 1);
+    __sync_fetch_and_add(&_sum, value);
+
+    uint64_t current = _min;
+    while (value < current && !__sync_bool_compare_and_swap(&_min, current, value)) {
+      current = _min;
+    }
+    current = _max;
+    while (value > current && !__sync_bool_compare_and_swap(&_max, current, value)) {
+      current = _max;
+    }
+  }
+
+  uint64_t count() const { return _count; }
+  uint64_t min() const { return _count ? _min : 0; }
+  uint64_t max() const { return _max; }
+  double mean() const { return _count ? (double) _sum / (double) _count : 0.0; }
+
+  // Value below which the given fraction of the recorded values lie
+  uint64_t percentile(double fraction) const
+  {
+    uint64_t count = _count;
+    if (!count) {
+      return 0;
+    }
+    uint64_t target = (uint64_t) (fraction * count + 0.5);
+    if (target < 1) {
+      target = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucketCount; i++) {
+      seen += _buckets[i];
+      if (seen >= target) {
+        uint64_t value = bucketValue(i);
+        return (value < _max) ? value : _max;
+      }
+    }
+    return _max;
+  }
+
+private:
+  Histogram(const Histogram&);
+  Histogram& operator=(const Histogram&);
+
+  static const unsigned subBucketBits = 4;
+  static const unsigned subBucketCount = 1 << subBucketBits;
+  static const unsigned maxValueBits = 40;
+  static const uint64_t maxValue = (1ULL << maxValueBits) - 1;
+  static const unsigned bucketCount = (maxValueBits - subBucketBits + 1) * subBucketCount;
+
+  static unsigned bucketIndex(uint64_t value)
+  {
+    if (value < subBucketCount) {
+      return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - subBucketBits;
+    return (shift + 1) * subBucketCount + ((value >> shift) & (subBucketCount - 1));
+  }
+
+  // Highest value that falls into the bucket
+  static uint64_t bucketValue(unsigned index)
+  {
+    if (index < subBucketCount) {
+      return index;
+    }
+    unsigned shift = index / subBucketCount - 1;
+    uint64_t lowest = (uint64_t) (subBucketCount + index % subBucketCount) << shift;
+    return lowest + (1ULL << shift) - 1;
+  }
+
+  volatile uint64_t _buckets[bucketCount];
+  volatile uint64_t _count;
+  volatile uint64_t _sum;
+  volatile uint64_t _min;
+  volatile uint64_t _max;
+};
+
+#endif
@@ -32,10 +32,7 @@ foreach (@defs) {
     my ($event, $args) = split(/ +/, $_, 2);
     print "static void on_$event(", join(",\n", split(', ', $args)), ")
 {
-    cout << \"$event\" << endl;
-    unique_lock<mutex> lock(_eventQueueLock);
-    _eventQueue.push(new PJSUA", join('', map(ucfirst, split(/_/, $event))), "Event(", join(', ', (map { s/.* \*?//; $_ } split(/, */, $args))), "));
-    _eventQueueFull.notify_one();
+    dispatch(new PJSUA", join('', map(ucfirst, split(/_/, $event))), "Event(", join(', ', (map { s/.* \*?//; $_ } split(/, */, $args))), "));
 }
 
 ";
@@ -47,19 +44,50 @@ print "      cfg.cb.on_$event = on_$event;
 ";
 }
 
+# Event classes copy their arguments and convert them in arguments().
+# Scalars become integers and "const pj_str_t *" strings; any other
+# pointer cannot be copied generically, so the generated class
+# contains an #error until the argument has been converted or dropped
+# by hand.
 foreach (@defs) {
     my ($event, $args) = split(/ +/, $_, 2);
     my $className = "PJSUA" . join('', map(ucfirst, split(/_/, $event))) . "Event";
+    my (@members, @inits, @converts);
+    my $index = 0;
+    foreach my $arg (split(/, */, $args)) {
+        my ($type, $name) = ($arg =~ /^(.*?)\s*(\w+)$/);
+        $type =~ s/\s+$//;
+        if ($type eq 'const pj_str_t *') {
+            push @members, "  const string _$name;";
+            push @inits, "_$name($name->ptr, $name->slen)";
+            push @converts, "    argv[$index] = String::New(_$name.c_str(), _$name.length());";
+        } elsif ($type !~ /\*/) {
+            push @members, "  $type _$name;";
+            push @inits, "_$name($name)";
+            push @converts, "    argv[$index] = Integer::New((int) _$name);";
+        } else {
+            push @converts, "#error \"$className: convert or drop argument $name ($type)\"";
+        }
+        $index++;
+    }
+    if ($index > 6) {
+        push @converts, "#error \"$className: more than PJSUAEvent::maxArguments arguments\"";
+    }
     print "
 class $className
   : public PJSUAEvent
 {
 public:
-  $className(", join(",\n", split(', ', $args)), ")
+  $className(", join(",\n", split(', ', $args)), ")",
+    (@inits ? "\n    : " . join(",\n      ", @inits) : ""), "
   {}
-  virtual const string eventName() const { return \"$event\"; }
-};
+  virtual const char* eventName() const { return \"$event\"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+", join("\n", @converts), "
+    return $index;
+  }
+", (@members ? "\nprivate:\n" . join("\n", @members) . "\n" : ""), "};
 
 ";
 }
-
@@ -23,12 +23,31 @@
 #include <iostream>
 #include <map>
 #include <vector>
-#include <typeinfo>
+#include <deque>
+#include <algorithm>
 
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <regex.h>
+#include <sys/socket.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <v8.h>
 #include <node.h>
+#include <node_buffer.h>
 
 // prevent name clash between pjsua.h and node.h
 #define pjsip_module pjsip_module_
@@ -37,6 +56,8 @@
 #undef pjsip_module
 
 #include "mutex.h"                                          // needed?
+#include "eventqueue.h"
+#include "histogram.h"
 
 using namespace std;
 using namespace v8;
@@ -93,1146 +114,9028 @@ public:
   {}
 };
 
+// Names of the values of a PJ enumeration numbered from 0.  The name
+// lists are constant data, idToName() and idToSymbol() are array
+// lookups and the V8 strings for the names are interned once by
+// initialize(), so converting an enum value costs no allocation.
+// nameToId() uses an open addressing hash table built when the table
+// is constructed.
+
 template <class EnumType>
-class EnumMap
+class EnumTable
 {
 public:
-  EnumMap(const char* symbols[])
+  template <size_t count>
+  EnumTable(const char* tableName, const char* const (&names)[count])
+    : _tableName(tableName),
+      _names(names),
+      _count(count),
+      _symbols(new Persistent<String>[count]),
+      _hashMask(3)
+  {
+    while (_hashMask + 1 < 2 * count) {
+      _hashMask = (_hashMask << 1) | 1;
+    }
+    _slots = new int[_hashMask + 1];
+    for (unsigned i = 0; i <= _hashMask; i++) {
+      _slots[i] = -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+      unsigned slot = hash(names[i]) & _hashMask;
+      while (_slots[slot] != -1) {
+        slot = (slot + 1) & _hashMask;
+      }
+      _slots[slot] = i;
+    }
+  }
+
+  // Intern the names, must be called from Node's thread
+  void initialize()
   {
-    for (int i = 0; symbols[i]; i++) {
-      _nameToIdMap[symbols[i]] = (EnumType) i;
-      _idToNameMap.push_back(symbols[i]);
+    for (unsigned i = 0; i < _count; i++) {
+      _symbols[i] = Persistent<String>::New(String::NewSymbol(_names[i]));
     }
   }
 
   const char* idToName(EnumType id) const
   {
     unsigned i = (unsigned) id;
-    if (i > _idToNameMap.size()) {
-      return "UNKNOWN-ID-OUT-OF-RANGE";
-    } else {
-      return _idToNameMap[i];
-    }
+    return (i < _count) ? _names[i] : "UNKNOWN-ID-OUT-OF-RANGE";
   }
 
-  const EnumType nameToId(const char* name) const
+  Handle<String> idToSymbol(EnumType id) const
   {
-    typename map<const string, EnumType>::const_iterator i = _nameToIdMap.find(name);
-    if (i == _nameToIdMap.end()) {
-      throw UnknownEnumerationKey(name, typeid(*this).name());
-    } else {
-      return i->second;
+    unsigned i = (unsigned) id;
+    return (i < _count) ? Handle<String>(_symbols[i]) : String::New(idToName(id));
+  }
+
+  EnumType nameToId(const char* name) const
+  {
+    for (unsigned slot = hash(name) & _hashMask; _slots[slot] != -1; slot = (slot + 1) & _hashMask) {
+      if (!strcmp(_names[_slots[slot]], name)) {
+        return (EnumType) _slots[slot];
+      }
     }
+    throw UnknownEnumerationKey(name, _tableName);
   }
 
-  const EnumType nameToId(Handle<String> name) const
+  EnumType nameToId(Handle<Value> name) const
   {
-    return nameToId(*String::Utf8Value(name));
+    char buffer[64];
+    Local<String> nameString = name->ToString();
+    if (nameString->Length() >= (int) sizeof buffer) {
+      throw UnknownEnumerationKey(*String::Utf8Value(nameString), _tableName);
+    }
+    nameString->WriteAscii(buffer, 0, sizeof buffer);
+    return nameToId(buffer);
   }
 
-  const EnumType nameToId(Handle<Value> name) const
+  const char* tableName() const { return _tableName; }
+
+  // All names as an array indexed by value
+  Handle<Array> names() const
   {
-    return nameToId(*String::Utf8Value(name->ToString()));
+    Local<Array> names = Array::New(_count);
+    for (unsigned i = 0; i < _count; i++) {
+      names->Set(i, _symbols[i]);
+    }
+    return names;
   }
 
 private:
-  map<const string, EnumType> _nameToIdMap;
-  vector<const char*> _idToNameMap;
+  EnumTable(const EnumTable&);
+  EnumTable& operator=(const EnumTable&);
+
+  // FNV-1a
+  static unsigned hash(const char* name)
+  {
+    unsigned hash = 2166136261u;
+    while (*name) {
+      hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash;
+  }
+
+  const char* _tableName;
+  const char* const* _names;
+  const unsigned _count;
+  Persistent<String>* _symbols;
+  unsigned _hashMask;
+  int* _slots;
 };
 
 // //////////////////////////////////////////////////////////////////////
 
-EnumMap<pjsua_call_media_status> mediaStatusNames((const char*[]) {
-    "MEDIA_NONE",
-      "MEDIA_ACTIVE",
-      "MEDIA_LOCAL_HOLD",
-      "MEDIA_REMOTE_HOLD",
-      "MEDIA_ERROR",
-      0});
-
-EnumMap<pj_stun_nat_type> natTypeNames((const char*[]) {
-    "UNKNOWN",
-      "ERR_UNKNOWN",
-      "OPEN",
-      "BLOCKED",
-      "SYMMETRIC_UDP",
-      "FULL_CONE",
-      "SYMMETRIC",
-      "RESTRICTED",
-      "PORT_RESTRICTED",
-      0});
+static const char* const mediaStatusNameList[] = {
+  "MEDIA_NONE", "MEDIA_ACTIVE", "MEDIA_LOCAL_HOLD", "MEDIA_REMOTE_HOLD", "MEDIA_ERROR"
+};
+static EnumTable<pjsua_call_media_status> mediaStatusNames("media_status", mediaStatusNameList);
+
+static const char* const natTypeNameList[] = {
+  "UNKNOWN", "ERR_UNKNOWN", "OPEN", "BLOCKED", "SYMMETRIC_UDP", "FULL_CONE", "SYMMETRIC", "RESTRICTED",
+  "PORT_RESTRICTED"
+};
+static EnumTable<pj_stun_nat_type> natTypeNames("nat_type", natTypeNameList);
+
+// The same names as pjsip_inv_state_name(), which PJSUA uses for the
+// state_text of a call
+static const char* const callStateNameList[] = {
+  "NULL", "CALLING", "INCOMING", "EARLY", "CONNECTING", "CONFIRMED", "DISCONNCTD", "TERMINATED"
+};
+static EnumTable<pjsip_inv_state> callStateNames("call_state", callStateNameList);
+
+static const char* const roleNameList[] = { "UAC", "UAS" };
+static EnumTable<pjsip_role_e> roleNames("role", roleNameList);
+
+static const char* const mediaDirNameList[] = { "NONE", "ENCODING", "DECODING", "ENCODING_DECODING" };
+static EnumTable<pjmedia_dir> mediaDirNames("media_dir", mediaDirNameList);
+
+static const char* const transportStateNameList[] = { "CONNECTED", "DISCONNECTED" };
+static EnumTable<pjsip_transport_state> transportStateNames("transport_state", transportStateNameList);
+
+static const char* const evsubStateNameList[] = {
+  "NULL", "SENT", "ACCEPTED", "PENDING", "ACTIVE", "TERMINATED", "UNKNOWN"
+};
+static EnumTable<pjsip_evsub_state> evsubStateNames("evsub_state", evsubStateNameList);
 
 // //////////////////////////////////////////////////////////////////////
 
+// Per-event objects use interned keys, see ObjectShape below.  The
+// overloads taking a C string key are meant for objects that are
+// created rarely.
+
 static inline void
-setKey(Handle<Object> object, const char* key, const char* value, int length = -1)
+setKey(Handle<Object> object, Handle<String> key, const char* value, int length = -1)
 {
-  object->Set(String::NewSymbol(key), String::New(value, length));
+  object->Set(key, String::New(value, length));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, int value)
+setKey(Handle<Object> object, Handle<String> key, int value)
 {
-  object->Set(String::NewSymbol(key), Integer::New(value));
+  object->Set(key, Integer::New(value));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, unsigned value)
+setKey(Handle<Object> object, Handle<String> key, unsigned value)
 {
-  object->Set(String::NewSymbol(key), Integer::New(value));
+  object->Set(key, Integer::New(value));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, bool value)
+setKey(Handle<Object> object, Handle<String> key, bool value)
 {
-  object->Set(String::NewSymbol(key), Boolean::New(value));
+  object->Set(key, Boolean::New(value));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, Handle<Object> value)
+setKey(Handle<Object> object, Handle<String> key, Handle<Value> value)
 {
-  object->Set(String::NewSymbol(key), value);
+  object->Set(key, value);
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, double value)
+setKey(Handle<Object> object, Handle<String> key, double value)
 {
-  object->Set(String::NewSymbol(key), Number::New(value));
+  object->Set(key, Number::New(value));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, const pj_str_t* value)
+setKey(Handle<Object> object, Handle<String> key, const pj_str_t* value)
 {
-  object->Set(String::NewSymbol(key), String::New(value->ptr, value->slen));
+  object->Set(key, String::New(value->ptr, value->slen));
 }
 
 static inline void
-setKey(Handle<Object> object, const char* key, const pj_str_t& value)
+setKey(Handle<Object> object, Handle<String> key, const pj_str_t& value)
 {
-  object->Set(String::NewSymbol(key), String::New(value.ptr, value.slen));
+  object->Set(key, String::New(value.ptr, value.slen));
 }
 
-#define PJ_TIME_VAL_TO_DOUBLE(pjtv) ((double) pjtv.sec + ((double) pjtv.msec * 0.001))
+template <class T>
+static inline void
+setKey(Handle<Object> object, const char* key, T value)
+{
+  setKey(object, String::NewSymbol(key), value);
+}
+
+static inline void
+setKey(Handle<Object> object, const char* key, const char* value, int length)
+{
+  setKey(object, String::NewSymbol(key), value, length);
+}
 
 // //////////////////////////////////////////////////////////////////////
 
-// The callback functions invoked by PJSIP from a separate thread need
-// to access V8 in order to invoke the JavaScript callback functions.
-// V8 itself is not thread safe, i.e. only one thread may access it at
-// any time.  Thus, Node's thread needs to be suspended while the
-// PJSIP callbacks are processed.  This is facilitated by a ev_async
-// event to signal Node's thread that a PJSIP callback wants to access
-// V8, a condition variable to signal the callback thread that Node's
-// thread has suspended, and another condition variable to signal
-// Node's that that the callback has finished processing.
-  
-class NodeMutex
+// An ObjectShape holds the interned keys of a kind of object and an
+// ObjectTemplate that has all of them set, so that objects created
+// from it start out with their final hidden class and need no map
+// transitions when the fields are assigned.  Shapes are created once
+// from Node's thread by PJSUA::Initialize.
+
+class ObjectShape
 {
 public:
-  class Lock
-    : unique_lock<mutex>
-  {
-  public:
-    Lock(const string& name, NodeMutex& mutex);
-    ~Lock();
-
-  private:
-    const string _name;
-    NodeMutex& _mutex;
-    Locker* _locker;
-    Context::Scope* _scope;
-    bool _hasSuspendedNode;
-  };
+  ObjectShape(const char** names, int count)
+    : _names(names),
+      _count(count),
+      _keys(0)
+  {}
 
-  class Unlock
+  void initialize()
   {
-  public:
-    Unlock(const string& name, NodeMutex& mutex);
-    ~Unlock();
+    HandleScope scope;
+    _keys = new Persistent<String>[_count];
+    Local<ObjectTemplate> objectTemplate = ObjectTemplate::New();
+    for (int i = 0; i < _count; i++) {
+      _keys[i] = Persistent<String>::New(String::NewSymbol(_names[i]));
+      objectTemplate->Set(_keys[i], Undefined());
+    }
+    _template = Persistent<ObjectTemplate>::New(objectTemplate);
+  }
 
-  private:
-    const string _name;
-    NodeMutex& _mutex;
-  };
+  int count() const { return _count; }
+  const char* name(int i) const { return _names[i]; }
+  Handle<String> key(int i) const { return _keys[i]; }
+  Local<Object> newObject() const { return _template->NewInstance(); }
 
-  friend class Unlock;
-  friend class Lock;
+private:
+  const char** _names;
+  int _count;
+  Persistent<String>* _keys;
+  Persistent<ObjectTemplate> _template;
+};
 
-  // Note:  NodeMutex instances must be created from within Node's thread.
-  NodeMutex();
-  ~NodeMutex();
+enum RegInfoField { REG_STATUS, REG_CODE, REG_REASON, REG_EXPIRATION, REG_STATUS_CLASS, REG_NEXT_REFRESH,
+                    REG_FIELD_COUNT };
+static const char* regInfoFieldNames[REG_FIELD_COUNT] = {
+  "status", "code", "reason", "expiration", "status_class", "next_refresh"
+};
+static ObjectShape regInfoShape(regInfoFieldNames, REG_FIELD_COUNT);
 
-  void setCallback(Local<Function> callback);
-  Local<Value> invokeCallback(const char* eventName, int argc, ...);
+enum RpidField { RPID_TYPE, RPID_ID, RPID_ACTIVITY, RPID_NOTE, RPID_FIELD_COUNT };
+static const char* rpidFieldNames[RPID_FIELD_COUNT] = { "type", "id", "activity", "note" };
+static ObjectShape rpidShape(rpidFieldNames, RPID_FIELD_COUNT);
 
-private:
-  // Methods to suspend and resume Node's thread
-  void suspendNodeThread();
-  void resumeNodeThread();
-  
-  static void eventCallback(EV_P_ ev_async* w, int revents);
+enum DeviceInfoField { DEVICE_NAME, DEVICE_INPUT_COUNT, DEVICE_OUTPUT_COUNT, DEVICE_DEFAULT_SAMPLES_PER_SEC,
+                       DEVICE_FIELD_COUNT };
+static const char* deviceInfoFieldNames[DEVICE_FIELD_COUNT] = {
+  "name", "input_count", "output_count", "default_samples_per_sec"
+};
+static ObjectShape deviceInfoShape(deviceInfoFieldNames, DEVICE_FIELD_COUNT);
 
-  void suspend();               // suspend the current (Node) thread, giving way to the other thread
+enum CallSummaryField { SUMMARY_ID, SUMMARY_ACC_ID, SUMMARY_ROLE, SUMMARY_STATE, SUMMARY_REMOTE_INFO,
+                        SUMMARY_CONNECT_DURATION, SUMMARY_TOTAL_DURATION, SUMMARY_FIELD_COUNT };
+static const char* callSummaryFieldNames[SUMMARY_FIELD_COUNT] = {
+  "id", "acc_id", "role", "state", "remote_info", "connect_duration", "total_duration"
+};
+static ObjectShape callSummaryShape(callSummaryFieldNames, SUMMARY_FIELD_COUNT);
 
-  pthread_t _nodeThreadId;      // thread ID of node's thread
+enum ConfPortField { CONF_PORT_SLOT, CONF_PORT_NAME, CONF_PORT_CLOCK_RATE, CONF_PORT_CHANNEL_COUNT,
+                     CONF_PORT_SAMPLES_PER_FRAME, CONF_PORT_LISTENERS, CONF_PORT_FIELD_COUNT };
+static const char* confPortFieldNames[CONF_PORT_FIELD_COUNT] = {
+  "slot", "name", "clock_rate", "channel_count", "samples_per_frame", "listeners"
+};
+static ObjectShape confPortShape(confPortFieldNames, CONF_PORT_FIELD_COUNT);
 
-  Persistent<Function> _callback;                           // JavaScript callback function
+// Event names are converted once and cached by name pointer
+static Handle<String>
+eventSymbol(const char* eventName)
+{
+  static map<const char*, Persistent<String> > symbols;
+  map<const char*, Persistent<String> >::iterator i = symbols.find(eventName);
+  if (i == symbols.end()) {
+    i = symbols.insert(make_pair(eventName, Persistent<String>::New(String::NewSymbol(eventName)))).first;
+  }
+  return i->second;
+}
 
-  // The Mutex holds a reference to the callback context that the
-  // Javascript callback should be called within in the
-  // _callbackContext member variable.  It is set from the
-  // Lock::Lock() constructor when the C++ callback is received from
-  // within Node's thread, or from NodeMutex::suspend() when the C++
-  // callback is received from within another thread.
-  Persistent<Context> _callbackContext;                     // Global context to run callback in
+#define PJ_TIME_VAL_TO_DOUBLE(pjtv) ((double) pjtv.sec + ((double) pjtv.msec * 0.001))
 
-  ev_async _watcher;            // signalled by the other thread to suspend Node's thread
-  condition_variable _proceed;  // signaled by the ev_async callback when the other thread may access V8
-  mutex _proceedMutex;          // protects the _proceed condition
-  condition_variable _complete; // signaled by the other thread when it has completed processing
-  mutex _completeMutex;         // protects the _complete condition
+static inline uint64_t
+monotonicNanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-  static mutex _globalMutex;    // Locked whenever a callback is executed
-  static bool _nodeSuspended;   // Set when node has been suspended
+// //////////////////////////////////////////////////////////////////////
+
+// Native snapshots of PJ info structures
+//
+// pjsua_call_info and pjsua_acc_info contain pointers into PJ owned
+// memory and into themselves, so they cannot be kept around.  Call
+// and account snapshots copy the fields into a compact, relocatable
+// structure that can be captured by the PJSIP thread that receives a
+// callback and converted to JavaScript later.  Strings are stored in
+// a buffer at the end of the snapshot; only its used part is copied
+// when a snapshot is moved into a SnapshotArena.
+
+struct SnapshotString
+{
+  uint16_t offset;
+  uint16_t length;
 };
 
-mutex NodeMutex::_globalMutex;
-bool NodeMutex::_nodeSuspended;
+template <size_t Capacity>
+struct SnapshotStrings
+{
+  uint16_t length;
+  char data[Capacity];
 
-// //////////////////////////////////////////////////////////////////////
+  void clear() { length = 0; }
 
-// Class PJSUA encapsulates the connection between Node and PJ
+  SnapshotString add(const char* s, size_t n)
+  {
+    SnapshotString string;
+    n = min(n, Capacity - length);
+    memcpy(data + length, s, n);
+    string.offset = length;
+    string.length = n;
+    length += n;
+    return string;
+  }
+  SnapshotString add(const pj_str_t& s) { return add(s.ptr, s.slen > 0 ? s.slen : 0); }
 
-class PJSUA
+  Handle<Value> get(const SnapshotString& string) const { return String::New(data + string.offset, string.length); }
+};
+
+struct CallSnapshot
 {
-  static Persistent<Function> _callback;
-  static NodeMutex _nodeMutex;
+  typedef SnapshotStrings<1024> Strings;
+  typedef pjsua_call_info Info;
+
+  enum Field {
+    ID, ROLE, ACC_ID, LOCAL_INFO, LOCAL_CONTACT, REMOTE_INFO, REMOTE_CONTACT, CALL_ID,
+    STATE, STATE_TEXT, LAST_STATUS, LAST_STATUS_TEXT, MEDIA_STATUS, MEDIA_DIR, CONF_SLOT,
+    CONNECT_DURATION, TOTAL_DURATION,
+    FIELD_COUNT
+  };
+  static const char* fieldNames[FIELD_COUNT];
+  static ObjectShape shape;
+
+  pjsua_call_id id;
+  pjsip_role_e role;
+  pjsua_acc_id acc_id;
+  pjsip_inv_state state;
+  pjsip_status_code last_status;
+  pjsua_call_media_status media_status;
+  pjmedia_dir media_dir;
+  pjsua_conf_port_id conf_slot;
+  pj_time_val connect_duration;
+  pj_time_val total_duration;
+  SnapshotString local_info;
+  SnapshotString local_contact;
+  SnapshotString remote_info;
+  SnapshotString remote_contact;
+  SnapshotString call_id;
+  SnapshotString last_status_text;
+  Strings strings;                                          // must be last
+
+  void capture(pjsua_call_id callId);
+  void capture(const pjsua_call_info& callInfoBinary);
+  // Byte size of the used part of the snapshot
+  size_t size() const { return offsetof(CallSnapshot, strings) + offsetof(Strings, data) + strings.length; }
+  Handle<Value> get(int field) const;
+  Handle<Object> toObject() const;
+  bool fieldEquals(const CallSnapshot& other, int field) const;
+};
 
-  // All PJSIP configuration is owned by the PJSUA class
-  static pjsua_config _pjsuaConfig;
-  static pjsua_logging_config _loggingConfig;
-  static pjsua_transport_config _transportConfig;
-  static pjsua_acc_config _accConfig;
+const char* CallSnapshot::fieldNames[CallSnapshot::FIELD_COUNT] = {
+  "id", "role", "acc_id", "local_info", "local_contact", "remote_info", "remote_contact", "call_id",
+  "state", "state_text", "last_status", "last_status_text", "media_status", "media_dir", "conf_slot",
+  "connect_duration", "total_duration"
+};
+ObjectShape CallSnapshot::shape(CallSnapshot::fieldNames, CallSnapshot::FIELD_COUNT);
 
-  // //////////////////////////////////////////////////////////////////////
-  //
-  // Callback functions to be called by PJ
+void
+CallSnapshot::capture(pjsua_call_id callId)
+{
+  pjsua_call_info callInfoBinary;
+  pjsua_call_get_info(callId, &callInfoBinary);
+  capture(callInfoBinary);
+}
 
-  static Handle<Object>
-  getCallInfo(pjsua_call_id call_id)
-  {
-    pjsua_call_info callInfoBinary;
-    pjsua_call_get_info(call_id, &callInfoBinary);
+void
+CallSnapshot::capture(const pjsua_call_info& callInfoBinary)
+{
+  id = callInfoBinary.id;
+  role = callInfoBinary.role;
+  acc_id = callInfoBinary.acc_id;
+  state = callInfoBinary.state;
+  last_status = callInfoBinary.last_status;
+  media_status = callInfoBinary.media_status;
+  media_dir = callInfoBinary.media_dir;
+  conf_slot = callInfoBinary.conf_slot;
+  connect_duration = callInfoBinary.connect_duration;
+  total_duration = callInfoBinary.total_duration;
+
+  strings.clear();
+  local_info = strings.add(callInfoBinary.local_info);
+  local_contact = strings.add(callInfoBinary.local_contact);
+  remote_info = strings.add(callInfoBinary.remote_info);
+  remote_contact = strings.add(callInfoBinary.remote_contact);
+  call_id = strings.add(callInfoBinary.call_id);
+  last_status_text = strings.add(callInfoBinary.last_status_text);
+}
 
-    Local<Object> callInfo = Object::New();
-    setKey(callInfo, "id", callInfoBinary.id);
-    setKey(callInfo, "role", (callInfoBinary.role == PJSIP_ROLE_UAC) ? "UAC" : "UAS");
-    setKey(callInfo, "acc_id", callInfoBinary.acc_id);
-    setKey(callInfo, "local_info", callInfoBinary.local_info);
-    setKey(callInfo, "local_contact", callInfoBinary.local_contact);
-    setKey(callInfo, "remote_info", callInfoBinary.remote_info);
-    setKey(callInfo, "remote_contact", callInfoBinary.remote_contact);
-    setKey(callInfo, "call_id", callInfoBinary.call_id);
-    setKey(callInfo, "state", (int) callInfoBinary.state);
-    setKey(callInfo, "state_text", callInfoBinary.state_text);
-    setKey(callInfo, "last_status", (int) callInfoBinary.last_status);
-    setKey(callInfo, "last_status_text", callInfoBinary.last_status_text);
-    setKey(callInfo, "media_status", mediaStatusNames.idToName(callInfoBinary.media_status));
-    setKey(callInfo, "media_dir", (int) callInfoBinary.media_dir);
-    setKey(callInfo, "conf_slot", (int) callInfoBinary.conf_slot);
-    setKey(callInfo, "connect_duration", PJ_TIME_VAL_TO_DOUBLE(callInfoBinary.connect_duration));
-    setKey(callInfo, "total_duration", PJ_TIME_VAL_TO_DOUBLE(callInfoBinary.total_duration));
-
-    return callInfo;
+Handle<Value>
+CallSnapshot::get(int field) const
+{
+  switch (field) {
+  case ID: return Integer::New(id);
+  case ROLE: return roleNames.idToSymbol(role);
+  case ACC_ID: return Integer::New(acc_id);
+  case LOCAL_INFO: return strings.get(local_info);
+  case LOCAL_CONTACT: return strings.get(local_contact);
+  case REMOTE_INFO: return strings.get(remote_info);
+  case REMOTE_CONTACT: return strings.get(remote_contact);
+  case CALL_ID: return strings.get(call_id);
+  case STATE: return Integer::New((int) state);
+  case STATE_TEXT: return callStateNames.idToSymbol(state);
+  case LAST_STATUS: return Integer::New((int) last_status);
+  case LAST_STATUS_TEXT: return strings.get(last_status_text);
+  case MEDIA_STATUS: return mediaStatusNames.idToSymbol(media_status);
+  case MEDIA_DIR: return Integer::New((int) media_dir);
+  case CONF_SLOT: return Integer::New((int) conf_slot);
+  case CONNECT_DURATION: return Number::New(PJ_TIME_VAL_TO_DOUBLE(connect_duration));
+  case TOTAL_DURATION: return Number::New(PJ_TIME_VAL_TO_DOUBLE(total_duration));
+  default: return Undefined();
   }
+}
 
-  static Handle<Object>
-  getAccInfo(pjsua_acc_id accId)
-  {
-    pjsua_acc_info accInfoBinary;
-    pjsua_acc_get_info(accId, &accInfoBinary);
+bool
+CallSnapshot::fieldEquals(const CallSnapshot& other, int field) const
+{
+#define STRING_EQUALS(name) (name.length == other.name.length \
+                             && !memcmp(strings.data + name.offset, other.strings.data + other.name.offset, name.length))
+#define TIME_VAL_EQUALS(name) (name.sec == other.name.sec && name.msec == other.name.msec)
+  switch (field) {
+  case ID: return id == other.id;
+  case ROLE: return role == other.role;
+  case ACC_ID: return acc_id == other.acc_id;
+  case LOCAL_INFO: return STRING_EQUALS(local_info);
+  case LOCAL_CONTACT: return STRING_EQUALS(local_contact);
+  case REMOTE_INFO: return STRING_EQUALS(remote_info);
+  case REMOTE_CONTACT: return STRING_EQUALS(remote_contact);
+  case CALL_ID: return STRING_EQUALS(call_id);
+  case STATE: return state == other.state;
+  case STATE_TEXT: return state == other.state;
+  case LAST_STATUS: return last_status == other.last_status;
+  case LAST_STATUS_TEXT: return STRING_EQUALS(last_status_text);
+  case MEDIA_STATUS: return media_status == other.media_status;
+  case MEDIA_DIR: return media_dir == other.media_dir;
+  case CONF_SLOT: return conf_slot == other.conf_slot;
+  case CONNECT_DURATION: return TIME_VAL_EQUALS(connect_duration);
+  case TOTAL_DURATION: return TIME_VAL_EQUALS(total_duration);
+  default: return true;
+  }
+#undef STRING_EQUALS
+#undef TIME_VAL_EQUALS
+}
 
-    Local<Object> accInfo = Object::New();
-    setKey(accInfo, "id", accInfoBinary.id);
-    setKey(accInfo, "is_default", (bool) accInfoBinary.is_default);
-    setKey(accInfo, "acc_uri", accInfoBinary.acc_uri);
-    setKey(accInfo, "has_registration", (bool) accInfoBinary.has_registration);
-    setKey(accInfo, "expires", accInfoBinary.expires);
-    setKey(accInfo, "status", accInfoBinary.status);
-    setKey(accInfo, "reg_last_err", accInfoBinary.reg_last_err);
-    setKey(accInfo, "status_text", accInfoBinary.status_text);
-    setKey(accInfo, "online_status", (bool) accInfoBinary.online_status);
-    setKey(accInfo, "online_status_text", accInfoBinary.online_status_text);
+struct AccSnapshot
+{
+  typedef SnapshotStrings<1024> Strings;
+  typedef pjsua_acc_info Info;
 
-    Local<Object> rpid = Object::New();
-    setKey(rpid, "type", accInfoBinary.rpid.type);
-    setKey(rpid, "id", accInfoBinary.rpid.id);
-    setKey(rpid, "activity", accInfoBinary.rpid.activity);
-    setKey(rpid, "note", accInfoBinary.rpid.note);
-    setKey(accInfo, "rpid", rpid);
+  enum Field {
+    ID, IS_DEFAULT, ACC_URI, HAS_REGISTRATION, EXPIRES, STATUS, REG_LAST_ERR, STATUS_TEXT,
+    ONLINE_STATUS, ONLINE_STATUS_TEXT, RPID,
+    FIELD_COUNT
+  };
+  static const char* fieldNames[FIELD_COUNT];
+  static ObjectShape shape;
+
+  pjsua_acc_id id;
+  bool is_default;
+  bool has_registration;
+  bool online_status;
+  int expires;
+  pjsip_status_code status;
+  pj_status_t reg_last_err;
+  pjrpid_element_type rpid_type;
+  pjrpid_activity rpid_activity;
+  SnapshotString acc_uri;
+  SnapshotString status_text;
+  SnapshotString online_status_text;
+  SnapshotString rpid_id;
+  SnapshotString rpid_note;
+  Strings strings;                                          // must be last
+
+  void capture(pjsua_acc_id accId);
+  void capture(const pjsua_acc_info& accInfoBinary);
+  // Byte size of the used part of the snapshot
+  size_t size() const { return offsetof(AccSnapshot, strings) + offsetof(Strings, data) + strings.length; }
+  Handle<Value> get(int field) const;
+  Handle<Object> toObject() const;
+};
 
-    return accInfo;
-  }
+const char* AccSnapshot::fieldNames[AccSnapshot::FIELD_COUNT] = {
+  "id", "is_default", "acc_uri", "has_registration", "expires", "status", "reg_last_err", "status_text",
+  "online_status", "online_status_text", "rpid"
+};
+ObjectShape AccSnapshot::shape(AccSnapshot::fieldNames, AccSnapshot::FIELD_COUNT);
 
-  static void
-  on_call_state(pjsua_call_id call_id,
-                pjsip_event *e)
-  {
-    NodeMutex::Lock lock("on_call_state", _nodeMutex);
-    HandleScope handleScope;
+void
+AccSnapshot::capture(pjsua_acc_id accId)
+{
+  pjsua_acc_info accInfoBinary;
+  pjsua_acc_get_info(accId, &accInfoBinary);
+  capture(accInfoBinary);
+}
 
-    _nodeMutex.invokeCallback("call_state", 1, getCallInfo(call_id));
-  }
+void
+AccSnapshot::capture(const pjsua_acc_info& accInfoBinary)
+{
+  id = accInfoBinary.id;
+  is_default = accInfoBinary.is_default;
+  has_registration = accInfoBinary.has_registration;
+  online_status = accInfoBinary.online_status;
+  expires = accInfoBinary.expires;
+  status = accInfoBinary.status;
+  reg_last_err = accInfoBinary.reg_last_err;
+  rpid_type = accInfoBinary.rpid.type;
+  rpid_activity = accInfoBinary.rpid.activity;
+
+  strings.clear();
+  acc_uri = strings.add(accInfoBinary.acc_uri);
+  status_text = strings.add(accInfoBinary.status_text);
+  online_status_text = strings.add(accInfoBinary.online_status_text);
+  rpid_id = strings.add(accInfoBinary.rpid.id);
+  rpid_note = strings.add(accInfoBinary.rpid.note);
+}
 
-  static void
-  on_incoming_call(pjsua_acc_id acc_id,
-                   pjsua_call_id call_id,
-                   pjsip_rx_data *rdata)
-  {
-    NodeMutex::Lock lock("on_incoming_call", _nodeMutex);
-    HandleScope handleScope;
+Handle<Value>
+AccSnapshot::get(int field) const
+{
+  switch (field) {
+  case ID: return Integer::New(id);
+  case IS_DEFAULT: return Boolean::New(is_default);
+  case ACC_URI: return strings.get(acc_uri);
+  case HAS_REGISTRATION: return Boolean::New(has_registration);
+  case EXPIRES: return Integer::New(expires);
+  case STATUS: return Integer::New(status);
+  case REG_LAST_ERR: return Integer::New(reg_last_err);
+  case STATUS_TEXT: return strings.get(status_text);
+  case ONLINE_STATUS: return Boolean::New(online_status);
+  case ONLINE_STATUS_TEXT: return strings.get(online_status_text);
+  case RPID:
+    {
+      Local<Object> rpid = rpidShape.newObject();
+      setKey(rpid, rpidShape.key(RPID_TYPE), rpid_type);
+      setKey(rpid, rpidShape.key(RPID_ID), strings.get(rpid_id));
+      setKey(rpid, rpidShape.key(RPID_ACTIVITY), rpid_activity);
+      setKey(rpid, rpidShape.key(RPID_NOTE), strings.get(rpid_note));
+      return rpid;
+    }
+  default: return Undefined();
+  }
+}
 
-    _nodeMutex.invokeCallback("incoming_call", 3, getAccInfo(acc_id), getCallInfo(call_id), Undefined());                   
+template <class Snapshot>
+static Handle<Object>
+snapshotToObject(const Snapshot& snapshot)
+{
+  Local<Object> object = Snapshot::shape.newObject();
+  for (int i = 0; i < Snapshot::FIELD_COUNT; i++) {
+    object->Set(Snapshot::shape.key(i), snapshot.get(i));
   }
+  return object;
+}
 
-  static void
-  on_call_tsx_state(pjsua_call_id call_id,
-                    pjsip_transaction *tsx,
-                    pjsip_event *e)
-  {
-    NodeMutex::Lock lock("on_call_tsx_state", _nodeMutex);
-    HandleScope handleScope;
+Handle<Object>
+CallSnapshot::toObject() const
+{
+  return snapshotToObject(*this);
+}
 
-    _nodeMutex.invokeCallback("call_tsx_state", 3, getCallInfo(call_id), Undefined(), Undefined());
-  }
+Handle<Object>
+AccSnapshot::toObject() const
+{
+  return snapshotToObject(*this);
+}
 
-  static void
-  on_call_media_state(pjsua_call_id call_id)
-  {
-    NodeMutex::Lock lock("on_call_media_state", _nodeMutex);
-    HandleScope handleScope;
+// //////////////////////////////////////////////////////////////////////
 
-    _nodeMutex.invokeCallback("call_media_state", 1, getCallInfo(call_id));
-  }
+// A SnapshotArena holds the snapshots of one batch of events while
+// they are accessible from JavaScript.  Snapshots are exposed through
+// objects with one accessor per field, so a field is only converted
+// to a V8 value when JavaScript reads it.  Each object holds a
+// reference to a holder object of the arena, and only the holder has
+// a weak handle, so the garbage collector processes one weak handle
+// per batch instead of one per object; the arena is freed when the
+// holder has been collected after the last object.  Arenas are only
+// used by the thread that owns V8, so no locking is needed.
+
+class SnapshotArena
+{
+public:
+  SnapshotArena()
+    : _references(1),
+      _chunkUsed(chunkSize)
+  {}
 
-  static void
-  on_stream_created(pjsua_call_id call_id,
-                    pjmedia_session *sess,
-                    unsigned stream_idx,
-                    pjmedia_port **p_port)
-  {
-    NodeMutex::Lock lock("on_stream_created", _nodeMutex);
-    HandleScope handleScope;
+  // Create the object templates, must be called from Node's thread
+  static void initialize();
 
-    _nodeMutex.invokeCallback("stream_created", 4, getCallInfo(call_id), Undefined(), Integer::New(stream_idx), Undefined());
-  }
+  template <class Snapshot>
+  Handle<Object> wrap(const Snapshot& snapshot);
 
-  static void
-  on_stream_destroyed(pjsua_call_id call_id,
-                      pjmedia_session *sess,
-                      unsigned stream_idx)
+  void release()
   {
-    NodeMutex::Lock lock("on_stream_destroyed", _nodeMutex);
-    HandleScope handleScope;
-
-    _nodeMutex.invokeCallback("stream_destroyed", 3, getCallInfo(call_id), Undefined(), Integer::New(stream_idx));
+    if (!--_references) {
+      delete this;
+    }
   }
 
-  static void
-  on_dtmf_digit(pjsua_call_id call_id,
-                int digit)
+private:
+  static const size_t chunkSize = 16384;
+
+  ~SnapshotArena()
   {
-    NodeMutex::Lock lock("on_dtmf_digit", _nodeMutex);
-    HandleScope handleScope;
+    for (vector<char*>::iterator i = _chunks.begin(); i != _chunks.end(); i++) {
+      delete[] *i;
+    }
+  }
 
-    _nodeMutex.invokeCallback("dtmf_digit", 2, getCallInfo(call_id), Integer::New(digit));
+  void* allocate(size_t size)
+  {
+    size = (size + 7) & ~7;
+    if (_chunkUsed + size > chunkSize) {
+      _chunks.push_back(new char[max(size, chunkSize)]);
+      _chunkUsed = 0;
+    }
+    void* memory = _chunks.back() + _chunkUsed;
+    _chunkUsed += size;
+    return memory;
   }
 
-  static void
-  on_call_transfer_request(pjsua_call_id call_id,
-                           const pj_str_t *dst,
-                           pjsip_status_code *code)
+  template <class Snapshot>
+  static Handle<Value> getter(Local<String> property, const AccessorInfo& info)
   {
-    NodeMutex::Lock lock("on_call_transfer_request", _nodeMutex);
-    HandleScope handleScope;
+    const Snapshot* snapshot = static_cast<const Snapshot*>(info.Holder()->GetPointerFromInternalField(0));
+    return snapshot->get(info.Data()->Int32Value());
+  }
 
-    Local<Value> result = _nodeMutex.invokeCallback("call_transfer_request", 3, getCallInfo(call_id), Undefined(), Undefined());
-    *code = (pjsip_status_code) result->ToInteger()->Value();
+  template <class Snapshot>
+  static Persistent<ObjectTemplate> makeTemplate()
+  {
+    HandleScope scope;
+    Local<ObjectTemplate> objectTemplate = ObjectTemplate::New();
+    objectTemplate->SetInternalFieldCount(2);            // snapshot, holder
+    for (int i = 0; i < Snapshot::FIELD_COUNT; i++) {
+      objectTemplate->SetAccessor(Snapshot::shape.key(i), getter<Snapshot>, 0, Integer::New(i),
+                                  DEFAULT, ReadOnly);
+    }
+    return Persistent<ObjectTemplate>::New(objectTemplate);
   }
 
-  static void
-  on_call_transfer_status(pjsua_call_id call_id,
-                          int st_code,
-                          const pj_str_t *st_text,
-                          pj_bool_t final,
-                          pj_bool_t *p_cont)
+  static Handle<ObjectTemplate> objectTemplate(const CallSnapshot&) { return _callTemplate; }
+  static Handle<ObjectTemplate> objectTemplate(const AccSnapshot&) { return _accTemplate; }
+
+  static void weakCallback(Persistent<Value> object, void* parameter)
   {
-    NodeMutex::Lock lock("on_call_transfer_status", _nodeMutex);
-    HandleScope handleScope;
-
-    Local<Value> result = _nodeMutex.invokeCallback("call_transfer_status", 4, getCallInfo(call_id), Integer::New(st_code),
-                                                    String::New(st_text->ptr, st_text->slen), Boolean::New(final));
-    *p_cont = result->ToBoolean()->Value();
+    static_cast<SnapshotArena*>(parameter)->release();
+    object.Dispose();
+    object.Clear();
   }
 
-  static void
-  on_call_replace_request(pjsua_call_id call_id,
-                          pjsip_rx_data *rdata,
-                          int *st_code,
-                          pj_str_t *st_text)
-  {
-    NodeMutex::Lock lock("on_call_replace_request", _nodeMutex);
-    HandleScope handleScope;
+  int _references;
+  vector<char*> _chunks;
+  size_t _chunkUsed;
+  Persistent<Object> _holder;                               // referenced by all objects of the arena
 
-    Local<Value> result = _nodeMutex.invokeCallback("call_replace_request", 2, getCallInfo(call_id), Undefined());
-    *st_code = result->ToInteger()->Value();
-    // FIXME: st_text not supported
-  }
+  static Persistent<ObjectTemplate> _callTemplate;
+  static Persistent<ObjectTemplate> _accTemplate;
+};
 
-  static void
-  on_call_replaced(pjsua_call_id old_call_id,
-                   pjsua_call_id new_call_id)
-  {
-    NodeMutex::Lock lock("on_call_replaced", _nodeMutex);
-    HandleScope handleScope;
+Persistent<ObjectTemplate> SnapshotArena::_callTemplate;
+Persistent<ObjectTemplate> SnapshotArena::_accTemplate;
 
-    _nodeMutex.invokeCallback("call_replaced", 2, getCallInfo(old_call_id), getCallInfo(new_call_id));
-  }
+void
+SnapshotArena::initialize()
+{
+  _callTemplate = makeTemplate<CallSnapshot>();
+  _accTemplate = makeTemplate<AccSnapshot>();
+}
 
-  static void
-  on_reg_state2(pjsua_acc_id acc_id,
-                pjsua_reg_info* info)
-  {
-    NodeMutex::Lock lock("on_reg_state2", _nodeMutex);
-    HandleScope handleScope;
+template <class Snapshot>
+Handle<Object>
+SnapshotArena::wrap(const Snapshot& snapshot)
+{
+  size_t size = snapshot.size();
+  void* copy = allocate(size);
+  memcpy(copy, &snapshot, size);
+
+  if (_holder.IsEmpty()) {
+    _holder = Persistent<Object>::New(Object::New());
+    _holder.MakeWeak(this, weakCallback);
+    _references++;
+  }
 
-    Local<Object> regInfo = Object::New();
-    setKey(regInfo, "status", info->cbparam->status);
-    setKey(regInfo, "code", info->cbparam->code);
-    setKey(regInfo, "reason", info->cbparam->reason);
-    setKey(regInfo, "expiration", info->cbparam->expiration);
-    // fixme, several fields missing
+  Local<Object> object = objectTemplate(snapshot)->NewInstance();
+  object->SetPointerInInternalField(0, copy);
+  object->SetInternalField(1, _holder);
 
-    _nodeMutex.invokeCallback("reg_state2", 2, getAccInfo(acc_id), regInfo);
-  }
+  return object;
+}
 
-  static void
-  on_incoming_subscribe(pjsua_acc_id acc_id,
-                        pjsua_srv_pres *srv_pres,
-                        pjsua_buddy_id buddy_id,
-                        const pj_str_t *from,
-                        pjsip_rx_data *rdata,
-                        pjsip_status_code *code,
-                        pj_str_t *reason,
-                        pjsua_msg_data *msg_data)
-  {
-    NodeMutex::Lock lock("on_incoming_subscribe", _nodeMutex);
-    HandleScope handleScope;
+// Convert a snapshot to JavaScript, lazily if an arena is given
+template <class Snapshot>
+static Handle<Object>
+snapshotValue(const Snapshot& snapshot, SnapshotArena* arena)
+{
+  return arena ? arena->wrap(snapshot) : snapshot.toObject();
+}
 
-    Local<Value> result = _nodeMutex.invokeCallback("incoming_subscribe", 5, getAccInfo(acc_id), Undefined(), Undefined(),
-                                                    String::New(from->ptr, from->slen), Undefined());
-    *code = (pjsip_status_code) result->ToInteger()->Value();
-    // FIXME: reason, msg_data not supported
-  }
+// //////////////////////////////////////////////////////////////////////
 
-  static void
-  on_srv_subscribe_state(pjsua_acc_id acc_id,
-                         pjsua_srv_pres *srv_pres,
-                         const pj_str_t *remote_uri,
-                         pjsip_evsub_state state,
-                         pjsip_event *event)
-  {
-    NodeMutex::Lock lock("on_srv_subscribe_state", _nodeMutex);
-    HandleScope handleScope;
+// In delta mode, the CallStateCache holds the last call snapshot that
+// has been delivered to JavaScript for every call ID.  call_state and
+// call_media_state events then only carry the id, a per-call sequence
+// number and the fields that have changed since the previous event
+// for the call.  The first event of a call (detected by a changed SIP
+// Call-ID) carries all fields.  The cache is only accessed by the
+// thread that owns V8.
 
-    _nodeMutex.invokeCallback("srv_subscribe_state", 5, getAccInfo(acc_id), Undefined(),
-                              String::New(remote_uri->ptr, remote_uri->slen), Undefined(), Undefined());
-  }
+class CallStateCache
+{
+public:
+  CallStateCache()
+    : _entries(0)
+  {}
 
-  static void
-  on_buddy_state(pjsua_buddy_id buddy_id)
+  void enable()
   {
-    // FIXME: NYI
+    if (!_entries) {
+      _entries = new Entry[PJSUA_MAX_CALLS];
+      for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+        _entries[i].valid = false;
+      }
+    }
   }
 
-  static void
-  on_buddy_evsub_state(pjsua_buddy_id buddy_id,
-                       pjsip_evsub *sub,
-                       pjsip_event *event)
-  {
-    // FIXME: NYI
-  }
+  bool enabled() const { return _entries != 0; }
 
-  static void
-  on_pager(pjsua_call_id call_id,
-           const pj_str_t *from,
-           const pj_str_t *to,
-           const pj_str_t *contact,
-           const pj_str_t *mime_type,
-           const pj_str_t *body)
-  {
-    // FIXME: NYI
-  }
+  Handle<Object> delta(const CallSnapshot& snapshot);
 
-  static void
-  on_pager2(pjsua_call_id call_id,
-            const pj_str_t *from,
-            const pj_str_t *to,
-            const pj_str_t *contact,
-            const pj_str_t *mime_type,
-            const pj_str_t *body,
-            pjsip_rx_data *rdata,
-            pjsua_acc_id acc_id)
-  {
-    // FIXME: NYI
-  }
+  // Return the last delivered state of the call, or an empty handle
+  Handle<Object> get(pjsua_call_id callId) const;
 
-  static void
-  on_pager_status(pjsua_call_id call_id,
-                  const pj_str_t *to,
-                  const pj_str_t *body,
-                  void *user_data,
-                  pjsip_status_code status,
-                  const pj_str_t *reason)
+private:
+  struct Entry
   {
-    // FIXME: NYI
-  }
+    bool valid;
+    uint32_t seq;
+    CallSnapshot snapshot;
+  };
 
-  static void
-  on_pager_status2(pjsua_call_id call_id,
-                   const pj_str_t *to,
-                   const pj_str_t *body,
-                   void *user_data,
-                   pjsip_status_code status,
-                   const pj_str_t *reason,
-                   pjsip_tx_data *tdata,
-                   pjsip_rx_data *rdata,
-                   pjsua_acc_id acc_id)
-  {
-    // FIXME: NYI
-  }
+  Entry* _entries;
+};
 
-  static void
-  on_typing(pjsua_call_id call_id,
-            const pj_str_t *from,
-            const pj_str_t *to,
-            const pj_str_t *contact,
-            pj_bool_t is_typing)
-  {
-    // FIXME: NYI
-  }
+static Persistent<String> seqSymbol;
 
-  static void
-  on_typing2(pjsua_call_id call_id,
-             const pj_str_t *from,
-             const pj_str_t *to,
-             const pj_str_t *contact,
-             pj_bool_t is_typing,
-             pjsip_rx_data *rdata,
-             pjsua_acc_id acc_id)
-  {
-    // FIXME: NYI
+Handle<Object>
+CallStateCache::delta(const CallSnapshot& snapshot)
+{
+  if (snapshot.id < 0 || snapshot.id >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    return snapshot.toObject();
   }
 
-  static void
-  on_nat_detect(const pj_stun_nat_detect_result *res)
-  {
-    NodeMutex::Lock lock("on_nat_detect", _nodeMutex);
-    HandleScope handleScope;
+  Entry& entry = _entries[snapshot.id];
+  bool full = !entry.valid || !entry.snapshot.fieldEquals(snapshot, CallSnapshot::CALL_ID);
 
-    _nodeMutex.invokeCallback("nat_detect", 2,
-                              (res->status == PJ_SUCCESS) ? Undefined() : String::New(res->status_text),
-                              String::New(natTypeNames.idToName(res->nat_type)));
-    // FIXME: NYI
+  Local<Object> delta = Object::New();
+  for (int i = 0; i < CallSnapshot::FIELD_COUNT; i++) {
+    if (full || i == CallSnapshot::ID || !entry.snapshot.fieldEquals(snapshot, i)) {
+      delta->Set(CallSnapshot::shape.key(i), snapshot.get(i));
+    }
   }
 
-  static void
-  on_mwi_info(pjsua_acc_id acc_id,
-              pjsua_mwi_info *mwi_info)
-  {
-    // FIXME: NYI
-  }
+  entry.seq = full ? 0 : entry.seq + 1;
+  entry.valid = true;
+  memcpy(&entry.snapshot, &snapshot, snapshot.size());
 
-  static void
-  on_transport_state(pjsip_transport *tp,
-                     pjsip_transport_state state,
-                     const pjsip_transport_state_info *info)
-  {
-    // FIXME: NYI
-  }
+  setKey(delta, seqSymbol, entry.seq);
+  return delta;
+}
 
-  static void
-  on_ice_transport_error(int index,
-                         pj_ice_strans_op op,
-                         pj_status_t status,
-                         void *param)
-  {
-    // FIXME: NYI
+Handle<Object>
+CallStateCache::get(pjsua_call_id callId) const
+{
+  if (!_entries || callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS || !_entries[callId].valid) {
+    return Handle<Object>();
   }
 
-public:
-  static void Initialize(Handle<Object> target);
+  const Entry& entry = _entries[callId];
+  Handle<Object> callInfo = entry.snapshot.toObject();
+  setKey(callInfo, seqSymbol, entry.seq);
+  return callInfo;
+}
 
-private:
-  static Handle<Value> start(const Arguments& args);
-  static Handle<Value> addAccount(const Arguments& args);
-  static Handle<Value> getAudioDevices(const Arguments& args);
-  static Handle<Value> setAudioDeviceIndex(const Arguments& args);
-  static Handle<Value> confConnect(const Arguments& args);
-  static Handle<Value> callAnswer(const Arguments& args);
-  static Handle<Value> callMakeCall(const Arguments& args);
-  static Handle<Value> callHangup(const Arguments& args);
-  static Handle<Value> stop(const Arguments& args);
-};
+static CallStateCache callStateCache;
 
 // //////////////////////////////////////////////////////////////////////
 
-// Static member allocation
+// The CallTable mirrors the state of every call slot in external
+// memory that JavaScript reads through pjsip.callTable without
+// calling into the addon.  The table is stored as one column of
+// int32 values per field, indexed by call ID, and one column of
+// doubles per timestamp.  PJSIP threads update a row under a per-row
+// sequence lock: the sequence number is odd while the row is written,
+// so a reader copies the fields between two reads of an even,
+// unchanged sequence number and retries otherwise
+// (pjsip.readCallTable() does this).
+//
+// JavaScript cannot issue memory fences, so reading the columns
+// directly is only correct where loads are not reordered (x86).
+// pjsip.callTable.ordered tells whether that is the case; elsewhere
+// pjsip.readCallTable() copies the row with readCallTableRow(), which
+// fences natively.
+//
+// Rows are only updated by call events, so the table stores when the
+// call started, connected and ended (milliseconds since the epoch, 0
+// if it has not happened yet) and readers compute the durations.
+
+class CallTable
+{
+public:
+  enum Field {
+    STATE,
+    MEDIA_STATUS,
+    CONF_SLOT,
+    ACC_ID,
+    LAST_STATUS,
+    FIELD_COUNT
+  };
 
-NodeMutex PJSUA::_nodeMutex;
-pjsua_config PJSUA::_pjsuaConfig;
-pjsua_logging_config PJSUA::_loggingConfig;
-pjsua_transport_config PJSUA::_transportConfig;
-pjsua_acc_config PJSUA::_accConfig;
+  enum Time {
+    START_TIME,
+    CONNECT_TIME,
+    END_TIME,
+    TIME_COUNT
+  };
 
-// //////////////////////////////////////////////////////////////////////
+  CallTable();
 
-// PJSIP-Node-Thread synchronization
+  // Read the current state of the call from PJSUA and store it in the
+  // call's row.  Called from the PJSUA callbacks of the call.
+  void update(pjsua_call_id callId);
 
-// //////////////////////////////////////////////////////////////////////
+  // Copy the row of the call into the properties of row, with memory
+  // fences.  Returns false if a writer held the row for too long.
+  bool readRow(pjsua_call_id callId, Handle<Object> row) const;
 
-// NodeMutex::Lock is a scoped lock that locks out Node's thread,
-// i.e. when the instance has been constructed: Node's thread is
-// suspended during the life time of a NodeMutex::Lock instances.  In
-// addition to suspending Node's thread by the way of libev and
-// condition variables, the Lock instance also locks V8 using
-// v8::Locker and enters the context of the callback.
+  // Create the JavaScript object that exposes the columns
+  Handle<Object> toObject();
 
-NodeMutex::Lock::Lock(const string& name, NodeMutex& m)
-  : unique_lock<mutex>(_globalMutex),
-    _name(name),
-    _mutex(m),
-    _locker(0),
-    _scope(0),
-    _hasSuspendedNode(false)
+private:
+  static const char* const fieldNames[FIELD_COUNT];
+  static const char* const timeNames[TIME_COUNT];
+
+  int32_t _columns[FIELD_COUNT][PJSUA_MAX_CALLS];
+  double _times[TIME_COUNT][PJSUA_MAX_CALLS];
+  volatile uint32_t _seq[PJSUA_MAX_CALLS];
+};
+
+const char* const CallTable::fieldNames[FIELD_COUNT] = {
+  "state", "media_status", "conf_slot", "acc_id", "last_status"
+};
+
+const char* const CallTable::timeNames[TIME_COUNT] = {
+  "start_time", "connect_time", "end_time"
+};
+
+CallTable::CallTable()
 {
-#ifdef DEBUG_LOCKS
-  cout << "Lock::Lock(): " << _name << endl;
-#endif // DEBUG_LOCKS
+  for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+    _columns[STATE][i] = PJSIP_INV_STATE_NULL;
+    _columns[MEDIA_STATUS][i] = PJSUA_CALL_MEDIA_NONE;
+    _columns[CONF_SLOT][i] = PJSUA_INVALID_ID;
+    _columns[ACC_ID][i] = PJSUA_INVALID_ID;
+    _columns[LAST_STATUS][i] = 0;
+    for (int j = 0; j < TIME_COUNT; j++) {
+      _times[j][i] = 0;
+    }
+    _seq[i] = 0;
+  }
+}
 
-  bool inNodeThread = pthread_equal(_mutex._nodeThreadId, pthread_self());
+void
+CallTable::update(pjsua_call_id callId)
+{
+  if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    return;
+  }
 
-  if (!_nodeSuspended && !inNodeThread) {
-    // suspendNodeThread() sets _mutex._callbackContext as a side effect
-    _mutex.suspendNodeThread();
-    _hasSuspendedNode = true;
-    _nodeSuspended = true;
-  } else {
-    _mutex._callbackContext = Persistent<Context>::New(Context::GetCurrent());
+  pjsua_call_info info;
+  if (pjsua_call_get_info(callId, &info) != PJ_SUCCESS) {
+    return;
   }
 
-  if (!inNodeThread) {
-    _locker = new Locker();
+  pj_time_val now;
+  pj_gettimeofday(&now);
+  const double nowMs = now.sec * 1000.0 + now.msec;
+  const bool connected = info.state == PJSIP_INV_STATE_CONFIRMED || PJ_TIME_VAL_MSEC(info.connect_duration);
+  const bool ended = info.state == PJSIP_INV_STATE_DISCONNECTED;
+
+  // Callbacks of one call are serialized by its dialog lock, but
+  // claim the row anyway so that concurrent writers cannot leave it
+  // inconsistent
+  uint32_t seq;
+  do {
+    seq = _seq[callId] & ~1U;
+  } while (!__sync_bool_compare_and_swap(&_seq[callId], seq, seq + 1));
+  __sync_synchronize();
+
+  // PJSUA stops the durations when the call is disconnected, keep the
+  // end time of later updates so that the start time does not move
+  double base = nowMs;
+  if (ended && _columns[STATE][callId] == PJSIP_INV_STATE_DISCONNECTED && _times[END_TIME][callId]) {
+    base = _times[END_TIME][callId];
   }
-  _scope = new Context::Scope(_mutex._callbackContext);
 
-#ifdef DEBUG_LOCKS
-  cout << "Lock::Lock locked: " << _name << endl;
-#endif // DEBUG_LOCKS
+  _columns[STATE][callId] = info.state;
+  _columns[MEDIA_STATUS][callId] = info.media_status;
+  _columns[CONF_SLOT][callId] = info.conf_slot;
+  _columns[ACC_ID][callId] = info.acc_id;
+  _columns[LAST_STATUS][callId] = info.last_status;
+  _times[START_TIME][callId] = base - PJ_TIME_VAL_MSEC(info.total_duration);
+  _times[CONNECT_TIME][callId] = connected ? base - PJ_TIME_VAL_MSEC(info.connect_duration) : 0;
+  _times[END_TIME][callId] = ended ? base : 0;
+
+  __sync_synchronize();
+  _seq[callId] = seq + 2;
 }
 
-NodeMutex::Lock::~Lock()
+bool
+CallTable::readRow(pjsua_call_id callId, Handle<Object> row) const
 {
-#ifdef DEBUG_LOCKS
-  cout << "Lock::~Lock(): " << _name << endl;
-#endif // DEBUG_LOCKS
+  int32_t columns[FIELD_COUNT];
+  double times[TIME_COUNT];
+  for (int retry = 0; retry < 1000; retry++) {
+    uint32_t seq = _seq[callId];
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+    for (int i = 0; i < FIELD_COUNT; i++) {
+      columns[i] = _columns[i][callId];
+    }
+    for (int i = 0; i < TIME_COUNT; i++) {
+      times[i] = _times[i][callId];
+    }
+    __sync_synchronize();
+    if (_seq[callId] == seq) {
+      for (int i = 0; i < FIELD_COUNT; i++) {
+        setKey(row, fieldNames[i], columns[i]);
+      }
+      for (int i = 0; i < TIME_COUNT; i++) {
+        setKey(row, timeNames[i], times[i]);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+Handle<Object>
+CallTable::toObject()
+{
+  HandleScope scope;
+  Local<Object> table = Object::New();
+
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    Local<Object> column = Object::New();
+    column->SetIndexedPropertiesToExternalArrayData(_columns[i], kExternalIntArray, PJSUA_MAX_CALLS);
+    setKey(column, "length", PJSUA_MAX_CALLS);
+    setKey(table, fieldNames[i], column);
+  }
+  for (int i = 0; i < TIME_COUNT; i++) {
+    Local<Object> column = Object::New();
+    column->SetIndexedPropertiesToExternalArrayData(_times[i], kExternalDoubleArray, PJSUA_MAX_CALLS);
+    setKey(column, "length", PJSUA_MAX_CALLS);
+    setKey(table, timeNames[i], column);
+  }
+
+  Local<Object> seq = Object::New();
+  seq->SetIndexedPropertiesToExternalArrayData((void*) _seq, kExternalUnsignedIntArray, PJSUA_MAX_CALLS);
+  setKey(seq, "length", PJSUA_MAX_CALLS);
+  setKey(table, "seq", seq);
+#if defined(__i386__) || defined(__x86_64__)
+  setKey(table, "ordered", true);
+#else
+  setKey(table, "ordered", false);
+#endif
+  setKey(table, "size", PJSUA_MAX_CALLS);
+
+  return scope.Close(table);
+}
+
+static CallTable callTable;
+
+// //////////////////////////////////////////////////////////////////////
+
+// PJSUA reuses call IDs and conference slots once a call has ended.
+// Objects in Node's thread that belong to a call remember the call's
+// generation when they are bound to it; on_call_state advances the
+// generation when the call is disconnected, so they notice the hangup
+// even if the call ID and its slot have been reused since.
+
+class CallGenerations
+{
+public:
+  CallGenerations()
+  {
+    for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+      _generation[i] = 0;
+    }
+  }
+
+  // Read the generation before checking that the call is active
+  uint32_t get(pjsua_call_id callId) const { return _generation[callId]; }
+  bool ended(pjsua_call_id callId, uint32_t generation) const { return _generation[callId] != generation; }
+
+  // Called from on_call_state
+  void callState(pjsua_call_id callId)
+  {
+    pjsua_call_info info;
+    if (pjsua_call_get_info(callId, &info) == PJ_SUCCESS && info.state == PJSIP_INV_STATE_DISCONNECTED) {
+      __sync_fetch_and_add(&_generation[callId], 1);
+    }
+  }
+
+private:
+  volatile uint32_t _generation[PJSUA_MAX_CALLS];
+};
+
+static CallGenerations callGenerations;
+
+// //////////////////////////////////////////////////////////////////////
+
+// The callback functions invoked by PJSIP from a separate thread need
+// to access V8 in order to invoke the JavaScript callback functions.
+// V8 itself is not thread safe, i.e. only one thread may access it at
+// any time.  Thus, Node's thread needs to be suspended while the
+// PJSIP callbacks are processed.  This is facilitated by a ev_async
+// event to signal Node's thread that a PJSIP callback wants to access
+// V8, a condition variable to signal the callback thread that Node's
+// thread has suspended, and another condition variable to signal
+// Node's that that the callback has finished processing.
+  
+// Timing of the synchronous callback path, kept per lock or event
+// name.  The histograms are always enabled, recording a value costs a
+// few atomic increments.  Statistics are looked up on every lock and
+// event delivery, so the registry is a fixed size hash table keyed by
+// the name pointer that is searched without locking; slots are only
+// ever claimed, never released.
+
+class LockStats
+{
+public:
+  Histogram globalMutexWait;    // time spent waiting for NodeMutex::_globalMutex
+  Histogram suspendWait;        // time spent in suspendNodeThread() until Node's thread was parked
+  Histogram nodeParked;         // time that Node's thread was parked in NodeMutex::suspend()
+  Histogram callback;           // execution time of the JavaScript callback
+
+  // The name must be a string literal, statistics are looked up by
+  // pointer
+  static LockStats& get(const char* name);
+
+  // All histograms in microseconds, keyed by name
+  static Handle<Object> getStats();
+
+private:
+  LockStats() {}
+
+  struct Slot
+  {
+    const char* volatile name;
+    LockStats* volatile stats;  // set after name has been claimed
+  };
+
+  // Names beyond the capacity of the registry share one entry
+  static const size_t registrySize = 512;
+  static Slot _registry[registrySize];
+  static LockStats _overflow;
+};
+
+LockStats::Slot LockStats::_registry[LockStats::registrySize];
+LockStats LockStats::_overflow;
+
+LockStats&
+LockStats::get(const char* name)
+{
+  size_t start = ((uintptr_t) name >> 3) % registrySize;
+  for (size_t n = 0; n < registrySize; n++) {
+    Slot& slot = _registry[(start + n) % registrySize];
+    const char* slotName = slot.name;
+    if (!slotName) {
+      if (__sync_bool_compare_and_swap(&slot.name, (const char*) 0, name)) {
+        __sync_synchronize();
+        slot.stats = new LockStats;
+        return *slot.stats;
+      }
+      slotName = slot.name;
+    }
+    if (slotName == name) {
+      // The thread that claimed the slot is creating the statistics
+      LockStats* stats;
+      while (!(stats = slot.stats)) {
+        sched_yield();
+      }
+      return *stats;
+    }
+  }
+  return _overflow;
+}
+
+static Handle<Object>
+histogramToObject(const Histogram& histogram)
+{
+  Local<Object> stats = Object::New();
+  setKey(stats, "count", (double) histogram.count());
+  setKey(stats, "min", histogram.min() / 1000.0);
+  setKey(stats, "mean", histogram.mean() / 1000.0);
+  setKey(stats, "p50", histogram.percentile(0.5) / 1000.0);
+  setKey(stats, "p90", histogram.percentile(0.9) / 1000.0);
+  setKey(stats, "p99", histogram.percentile(0.99) / 1000.0);
+  setKey(stats, "p999", histogram.percentile(0.999) / 1000.0);
+  setKey(stats, "max", histogram.max() / 1000.0);
+  return stats;
+}
+
+Handle<Object>
+LockStats::getStats()
+{
+  Local<Object> stats = Object::New();
+
+  for (size_t i = 0; i <= registrySize; i++) {
+    const char* name = (i < registrySize) ? _registry[i].name : "other";
+    const LockStats* lockStats = (i < registrySize) ? _registry[i].stats : &_overflow;
+    if (!lockStats || (lockStats == &_overflow && !_overflow.globalMutexWait.count() && !_overflow.callback.count())) {
+      continue;
+    }
+    Local<Object> entry = Object::New();
+    setKey(entry, "global_mutex_wait", histogramToObject(lockStats->globalMutexWait));
+    setKey(entry, "suspend_wait", histogramToObject(lockStats->suspendWait));
+    setKey(entry, "node_parked", histogramToObject(lockStats->nodeParked));
+    setKey(entry, "callback", histogramToObject(lockStats->callback));
+    setKey(stats, name, entry);
+  }
+
+  return stats;
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+class NodeMutex
+{
+public:
+  class Lock
+  {
+  public:
+    Lock(const char* name, NodeMutex& mutex);
+    ~Lock();
+
+  private:
+    const char* _name;
+    NodeMutex& _mutex;
+    LockStats& _stats;
+    Locker* _locker;
+    Context::Scope* _scope;
+    bool _hasSuspendedNode;
+    uint64_t _suspendedAt;      // time at which Node's thread was parked
+  };
+
+  class Unlock
+  {
+  public:
+    Unlock(const char* name, NodeMutex& mutex);
+    ~Unlock();
+
+  private:
+    const char* _name;
+    NodeMutex& _mutex;
+  };
+
+  friend class Unlock;
+  friend class Lock;
+
+  // Note:  NodeMutex instances must be created from within Node's thread.
+  NodeMutex();
+  ~NodeMutex();
+
+  void setCallback(Local<Function> callback);
+  Local<Value> invokeCallback(const char* eventName, int argc, ...);
+  Local<Value> invokeCallback(const char* eventName, int argc, Handle<Value> argv[]);
+
+private:
+  // Methods to suspend and resume Node's thread
+  void suspendNodeThread();
+  void resumeNodeThread();
+  
+  static void eventCallback(EV_P_ ev_async* w, int revents);
+
+  void suspend();               // suspend the current (Node) thread, giving way to the other thread
+
+  pthread_t _nodeThreadId;      // thread ID of node's thread
+
+  Persistent<Function> _callback;                           // JavaScript callback function
+
+  // The Mutex holds a reference to the callback context that the
+  // Javascript callback should be called within in the
+  // _callbackContext member variable.  It is set from the
+  // Lock::Lock() constructor when the C++ callback is received from
+  // within Node's thread, or from NodeMutex::suspend() when the C++
+  // callback is received from within another thread.
+  Persistent<Context> _callbackContext;                     // Global context to run callback in
+
+  ev_async _watcher;            // signalled by the other thread to suspend Node's thread
+  condition_variable _proceed;  // signaled by the ev_async callback when the other thread may access V8
+  mutex _proceedMutex;          // protects the _proceed condition
+  condition_variable _complete; // signaled by the other thread when it has completed processing
+  mutex _completeMutex;         // protects the _complete condition
+
+  static mutex _globalMutex;    // Locked whenever a callback is executed
+  static bool _nodeSuspended;   // Set when node has been suspended
+};
+
+mutex NodeMutex::_globalMutex;
+bool NodeMutex::_nodeSuspended;
+
+// //////////////////////////////////////////////////////////////////////
+
+// PJSUA events are captured as native records by the PJSIP thread
+// that receives the callback and are converted to JavaScript values
+// by the thread that owns V8 when they are delivered.
+
+// Time from the capture of an event until it is passed to JavaScript
+static Histogram deliveryLatency;
+
+// Events are allocated by PJSIP threads and deleted by Node's thread.
+// Call and account events carry snapshots of several kilobytes, so
+// deleted events are kept on free lists by size class and reused
+// instead of going back to the heap.  The free lists are lock-free
+// queues, so neither side waits for the other; when a list is empty
+// or full, the heap is used.
+
+class EventPool
+{
+public:
+  EventPool()
+  {
+    for (size_t i = 0; i < classCount; i++) {
+      _free[i].allocate(maxFree);
+    }
+  }
+
+  void* allocate(size_t size)
+  {
+    void* memory;
+    if (size <= maxSize && _free[sizeClass(size)].pop(memory)) {
+      return memory;
+    }
+    return ::operator new(size <= maxSize ? (sizeClass(size) + 1) * granularity : size);
+  }
+
+  void release(void* memory, size_t size)
+  {
+    if (size <= maxSize && _free[sizeClass(size)].push(memory)) {
+      return;
+    }
+    ::operator delete(memory);
+  }
+
+private:
+  static const size_t granularity = 256;
+  static const size_t maxSize = 16384;                      // larger events use the heap
+  static const size_t classCount = maxSize / granularity;
+  static const size_t maxFree = 256;                        // per size class
+
+  static size_t sizeClass(size_t size) { return (size - 1) / granularity; }
+
+  BoundedQueue<void*> _free[classCount];
+};
+
+static EventPool eventPool;
+
+class PJSUAEvent
+{
+public:
+  static const int maxArguments = 6;
+
+  virtual ~PJSUAEvent() {}
+
+  // The size passed to delete is that of the dynamic type
+  static void* operator new(size_t size) { return eventPool.allocate(size); }
+  static void operator delete(void* memory, size_t size) { eventPool.release(memory, size); }
+
+  virtual const char* eventName() const = 0;
+
+  // Events with the same ordering key are delivered in the order in
+  // which they were dispatched
+  virtual int orderingKey() const { return 0; }
+
+  // Store the callback arguments of the event in argv, return their
+  // number.  If arena is given, snapshots are converted lazily.
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const = 0;
+
+  void recordDeliveryLatency() const { deliveryLatency.record(monotonicNanoseconds() - _createdAt); }
+
+protected:
+  PJSUAEvent()
+    : _createdAt(monotonicNanoseconds())
+  {}
+
+private:
+  PJSUAEvent(const PJSUAEvent&);
+  PJSUAEvent& operator=(const PJSUAEvent&);
+
+  uint64_t _createdAt;
+};
+
+class PJSUACallEvent
+  : public PJSUAEvent
+{
+protected:
+  PJSUACallEvent(pjsua_call_id callId)
+  {
+    _call.capture(callId);
+  }
+  virtual int orderingKey() const { return _call.id; }
+
+  CallSnapshot _call;
+};
+
+class PJSUAAccEvent
+  : public PJSUAEvent
+{
+protected:
+  PJSUAAccEvent(pjsua_acc_id accId)
+  {
+    _acc.capture(accId);
+  }
+  virtual int orderingKey() const { return _acc.id; }
+
+  AccSnapshot _acc;
+};
+
+class PJSUACallStateEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallStateEvent(pjsua_call_id callId)
+    : PJSUACallEvent(callId)
+  {}
+  virtual const char* eventName() const { return "call_state"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = callStateCache.enabled() ? callStateCache.delta(_call) : snapshotValue(_call, arena);
+    return 1;
+  }
+};
+
+class PJSUAIncomingCallEvent
+  : public PJSUAAccEvent
+{
+public:
+  PJSUAIncomingCallEvent(pjsua_acc_id accId, pjsua_call_id callId)
+    : PJSUAAccEvent(accId)
+  {
+    _call.capture(callId);
+  }
+  virtual const char* eventName() const { return "incoming_call"; }
+  virtual int orderingKey() const { return _call.id; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_acc, arena);
+    argv[1] = snapshotValue(_call, arena);
+    argv[2] = Undefined();
+    return 3;
+  }
+
+private:
+  CallSnapshot _call;
+};
+
+class PJSUACallTsxStateEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallTsxStateEvent(pjsua_call_id callId)
+    : PJSUACallEvent(callId)
+  {}
+  virtual const char* eventName() const { return "call_tsx_state"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Undefined();
+    argv[2] = Undefined();
+    return 3;
+  }
+};
+
+class PJSUACallMediaStateEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallMediaStateEvent(pjsua_call_id callId)
+    : PJSUACallEvent(callId)
+  {}
+  virtual const char* eventName() const { return "call_media_state"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = callStateCache.enabled() ? callStateCache.delta(_call) : snapshotValue(_call, arena);
+    return 1;
+  }
+};
+
+class PJSUAStreamCreatedEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUAStreamCreatedEvent(pjsua_call_id callId, unsigned streamIndex)
+    : PJSUACallEvent(callId),
+      _streamIndex(streamIndex)
+  {}
+  virtual const char* eventName() const { return "stream_created"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Undefined();
+    argv[2] = Integer::New(_streamIndex);
+    argv[3] = Undefined();
+    return 4;
+  }
+
+private:
+  unsigned _streamIndex;
+};
+
+class PJSUAStreamDestroyedEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUAStreamDestroyedEvent(pjsua_call_id callId, unsigned streamIndex)
+    : PJSUACallEvent(callId),
+      _streamIndex(streamIndex)
+  {}
+  virtual const char* eventName() const { return "stream_destroyed"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Undefined();
+    argv[2] = Integer::New(_streamIndex);
+    return 3;
+  }
+
+private:
+  unsigned _streamIndex;
+};
+
+class PJSUADtmfDigitEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUADtmfDigitEvent(pjsua_call_id callId, int digit)
+    : PJSUACallEvent(callId),
+      _digit(digit)
+  {}
+  virtual const char* eventName() const { return "dtmf_digit"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Integer::New(_digit);
+    return 2;
+  }
+
+private:
+  int _digit;
+};
+
+class PJSUACallReplacedEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallReplacedEvent(pjsua_call_id oldCallId, pjsua_call_id newCallId)
+    : PJSUACallEvent(oldCallId)
+  {
+    _newCall.capture(newCallId);
+  }
+  virtual const char* eventName() const { return "call_replaced"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = snapshotValue(_newCall, arena);
+    return 2;
+  }
+
+private:
+  CallSnapshot _newCall;
+};
+
+class PJSUARegState2Event
+  : public PJSUAAccEvent
+{
+public:
+  // statusClass and nextRefresh as tracked by the RegistrationTable
+  PJSUARegState2Event(pjsua_acc_id accId, const pjsua_reg_info* info, int statusClass, double nextRefresh)
+    : PJSUAAccEvent(accId),
+      _status(info->cbparam->status),
+      _code(info->cbparam->code),
+      _reason(info->cbparam->reason.ptr, info->cbparam->reason.slen),
+      _expiration(info->cbparam->expiration),
+      _statusClass(statusClass),
+      _nextRefresh(nextRefresh)
+  {}
+  virtual const char* eventName() const { return "reg_state2"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    Local<Object> regInfo = regInfoShape.newObject();
+    setKey(regInfo, regInfoShape.key(REG_STATUS), _status);
+    setKey(regInfo, regInfoShape.key(REG_CODE), _code);
+    setKey(regInfo, regInfoShape.key(REG_REASON), _reason.c_str(), _reason.length());
+    setKey(regInfo, regInfoShape.key(REG_EXPIRATION), _expiration);
+    setKey(regInfo, regInfoShape.key(REG_STATUS_CLASS), _statusClass);
+    setKey(regInfo, regInfoShape.key(REG_NEXT_REFRESH), _nextRefresh);
+    // The contacts and the raw response of the REGISTER transaction are
+    // not exposed; getRegistrations() returns the same fields for all
+    // accounts at once.
+
+    argv[0] = snapshotValue(_acc, arena);
+    argv[1] = regInfo;
+    return 2;
+  }
+
+private:
+  pj_status_t _status;
+  int _code;
+  const string _reason;
+  int _expiration;
+  int _statusClass;
+  double _nextRefresh;
+};
+
+class PJSUASrvSubscribeStateEvent
+  : public PJSUAAccEvent
+{
+public:
+  PJSUASrvSubscribeStateEvent(pjsua_acc_id accId, const pj_str_t* remoteUri, pjsip_evsub_state state)
+    : PJSUAAccEvent(accId),
+      _remoteUri(remoteUri->ptr, remoteUri->slen),
+      _state(state)
+  {}
+  virtual const char* eventName() const { return "srv_subscribe_state"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_acc, arena);
+    argv[1] = Undefined();
+    argv[2] = String::New(_remoteUri.c_str(), _remoteUri.length());
+    argv[3] = evsubStateNames.idToSymbol(_state);
+    argv[4] = Undefined();
+    return 5;
+  }
+
+private:
+  const string _remoteUri;
+  pjsip_evsub_state _state;
+};
+
+class PJSUATransportStateEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUATransportStateEvent(pjsip_transport* transport, pjsip_transport_state state,
+                           const pjsip_transport_state_info* info)
+    : _transport(transport->info ? transport->info : ""),
+      _state(state),
+      _status(info ? info->status : PJ_SUCCESS)
+  {}
+  virtual const char* eventName() const { return "transport_state"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = String::New(_transport.c_str(), _transport.length());
+    argv[1] = transportStateNames.idToSymbol(_state);
+    argv[2] = Integer::New(_status);
+    return 3;
+  }
+
+private:
+  const string _transport;
+  pjsip_transport_state _state;
+  pj_status_t _status;
+};
+
+class PJSUANatDetectEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUANatDetectEvent(const pj_stun_nat_detect_result* res)
+    : _status(res->status),
+      _statusText(res->status_text ? res->status_text : ""),
+      _natType(res->nat_type)
+  {}
+  virtual const char* eventName() const { return "nat_detect"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = (_status == PJ_SUCCESS) ? Handle<Value>(Undefined()) : Handle<Value>(String::New(_statusText.c_str()));
+    argv[1] = natTypeNames.idToSymbol(_natType);
+    return 2;
+  }
+
+private:
+  pj_status_t _status;
+  const string _statusText;
+  pj_stun_nat_type _natType;
+};
+
+class PJSUACallTransferRequestEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallTransferRequestEvent(pjsua_call_id callId, const pj_str_t* dst, pjsip_status_code code)
+    : PJSUACallEvent(callId),
+      _dst(dst->ptr, dst->slen),
+      _code(code)
+  {}
+  virtual const char* eventName() const { return "call_transfer_request"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = String::New(_dst.c_str(), _dst.length());
+    argv[2] = Integer::New(_code);
+    return 3;
+  }
+
+private:
+  const string _dst;
+  pjsip_status_code _code;
+};
+
+class PJSUACallTransferStatusEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallTransferStatusEvent(pjsua_call_id callId, int stCode, const pj_str_t* stText, bool final, uint32_t token)
+    : PJSUACallEvent(callId),
+      _stCode(stCode),
+      _stText(stText->ptr, stText->slen),
+      _final(final),
+      _token(token)
+  {}
+  virtual const char* eventName() const { return "call_transfer_status"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Integer::New(_stCode);
+    argv[2] = String::New(_stText.c_str(), _stText.length());
+    argv[3] = Boolean::New(_final);
+    argv[4] = _token ? Handle<Value>(Integer::NewFromUnsigned(_token)) : Handle<Value>(Undefined());
+    return 5;
+  }
+
+private:
+  int _stCode;
+  const string _stText;
+  bool _final;
+  uint32_t _token;
+};
+
+class PJSUACallReplaceRequestEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallReplaceRequestEvent(pjsua_call_id callId, int stCode)
+    : PJSUACallEvent(callId),
+      _stCode(stCode)
+  {}
+  virtual const char* eventName() const { return "call_replace_request"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = Undefined();
+    argv[2] = Integer::New(_stCode);
+    return 3;
+  }
+
+private:
+  int _stCode;
+};
+
+class PJSUAIncomingSubscribeEvent
+  : public PJSUAAccEvent
+{
+public:
+  PJSUAIncomingSubscribeEvent(pjsua_acc_id accId, const pj_str_t* from, uint32_t token)
+    : PJSUAAccEvent(accId),
+      _from(from->ptr, from->slen),
+      _token(token)
+  {}
+  virtual const char* eventName() const { return "incoming_subscribe"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_acc, arena);
+    argv[1] = Undefined();
+    argv[2] = Undefined();
+    argv[3] = String::New(_from.c_str(), _from.length());
+    argv[4] = Undefined();
+    argv[5] = Integer::NewFromUnsigned(_token);
+    return 6;
+  }
+
+private:
+  const string _from;
+  uint32_t _token;
+};
+
+class PJSUACallMadeEvent
+  : public PJSUACallEvent
+{
+public:
+  PJSUACallMadeEvent(pjsua_call_id callId, const string& correlationId)
+    : PJSUACallEvent(callId),
+      _correlationId(correlationId)
+  {}
+  virtual const char* eventName() const { return "call_made"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = snapshotValue(_call, arena);
+    argv[1] = String::New(_correlationId.c_str(), _correlationId.length());
+    return 2;
+  }
+
+private:
+  const string _correlationId;
+};
+
+class PJSUACallFailedEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUACallFailedEvent(const string& correlationId, pjsua_acc_id accId, const string& destUri, pj_status_t status)
+    : _correlationId(correlationId),
+      _accId(accId),
+      _destUri(destUri),
+      _status(status)
+  {}
+  virtual const char* eventName() const { return "call_failed"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    char buf[256];
+    pj_strerror(_status, buf, sizeof buf);
+    argv[0] = String::New(_correlationId.c_str(), _correlationId.length());
+    argv[1] = Integer::New(_accId);
+    argv[2] = String::New(_destUri.c_str(), _destUri.length());
+    argv[3] = Integer::New(_status);
+    argv[4] = String::New(buf);
+    return 5;
+  }
+
+private:
+  const string _correlationId;
+  pjsua_acc_id _accId;
+  const string _destUri;
+  pj_status_t _status;
+};
+
+class PJSUAAccountsProgressEvent
+  : public PJSUAEvent
+{
+public:
+  struct Progress
+  {
+    uint32_t batch;
+    unsigned total;
+    unsigned added;
+    unsigned addFailed;
+    unsigned registered;
+    unsigned failed;
+  };
+
+  PJSUAAccountsProgressEvent(const Progress& progress)
+    : _progress(progress)
+  {}
+  virtual const char* eventName() const { return "accounts_progress"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    Local<Object> progress = Object::New();
+    setKey(progress, "total", _progress.total);
+    setKey(progress, "added", _progress.added);
+    setKey(progress, "add_failed", _progress.addFailed);
+    setKey(progress, "pending", _progress.total - _progress.added - _progress.addFailed);
+    setKey(progress, "registered", _progress.registered);
+    setKey(progress, "failed", _progress.failed);
+
+    argv[0] = Integer::NewFromUnsigned(_progress.batch);
+    argv[1] = progress;
+    return 2;
+  }
+
+private:
+  Progress _progress;
+};
+
+class PJSUARegChangedEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUARegChangedEvent(const vector<pjsua_acc_id>& accIds)
+    : _accIds(accIds)
+  {}
+  virtual const char* eventName() const { return "reg_changed"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    Local<Array> accIds = Array::New(_accIds.size());
+    for (unsigned i = 0; i < _accIds.size(); i++) {
+      accIds->Set(i, Integer::New(_accIds[i]));
+    }
+
+    argv[0] = accIds;
+    return 1;
+  }
+
+private:
+  const vector<pjsua_acc_id> _accIds;
+};
+
+// //////////////////////////////////////////////////////////////////////
+
+// In deferred decision mode, PJSIP callbacks that need an answer never
+// wait for JavaScript.  The DecisionTable records the decisions that
+// can still be changed after the callback has returned, identified by
+// a token that is passed to JavaScript with the event.  JavaScript
+// answers with respond(token, verdict); decisions that have not been
+// answered when their timeout expires get the configured default.
+//
+// Only incoming SUBSCRIBE requests and transfer status notifications
+// can be decided late:  A subscription is accepted as pending (202)
+// and activated or terminated by a NOTIFY when the verdict is known.
+// For transfer status notifications, the verdict decides whether the
+// subscription is continued at the next NOTIFY.  PJSUA requires
+// transfer and replace requests to be answered before the callback
+// returns, so they are answered with their default verdict and the
+// event reports the code that was used.  Their defaults reject the
+// request (603); a transfer or replace is only accepted without
+// asking JavaScript if it has been opted in with decision_defaults.
+// Once JavaScript has decided to stop a transfer status subscription,
+// that decision stands until the final notification, regardless of
+// the verdicts for later tokens.
+//
+// The table is accessed by PJSIP threads and Node's thread.  Its lock
+// is only held while the table is modified.  Verdicts are applied
+// with the PJSUA lock held, which is also held when a server
+// subscription is terminated, so the pjsua_srv_pres of a decision is
+// still valid when its NOTIFY is sent.
+
+class DecisionTable
+{
+public:
+  // All kinds of decisions have a default verdict, but only
+  // TRANSFER_STATUS and INCOMING_SUBSCRIBE decisions are recorded
+  enum Kind { TRANSFER_REQUEST, TRANSFER_STATUS, REPLACE_REQUEST, INCOMING_SUBSCRIBE, KIND_COUNT };
+  static const char* kindNames[KIND_COUNT];
+
+  struct Decision
+  {
+    Kind kind;
+    uint64_t deadline;                                      // monotonic nanoseconds
+    pjsua_call_id callId;
+    pjsua_acc_id accId;
+    pjsua_srv_pres* srvPres;
+  };
+
+  DecisionTable()
+    : _nextToken(1)
+  {
+    for (int i = 0; i < KIND_COUNT; i++) {
+      _timeout[i] = 2000000000ull;
+    }
+    _defaultVerdict[TRANSFER_REQUEST] = PJSIP_SC_DECLINE;
+    _defaultVerdict[TRANSFER_STATUS] = 1;                   // continue
+    _defaultVerdict[REPLACE_REQUEST] = PJSIP_SC_DECLINE;
+    _defaultVerdict[INCOMING_SUBSCRIBE] = PJSIP_SC_OK;
+    for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+      _transferContinue[i] = true;
+    }
+  }
+
+  void setTimeout(Kind kind, uint64_t timeout) { _timeout[kind] = timeout; }
+  void setDefaultVerdict(Kind kind, int verdict) { _defaultVerdict[kind] = verdict; }
+  int defaultVerdict(Kind kind) const { return _defaultVerdict[kind]; }
+
+  uint32_t add(Decision decision)
+  {
+    decision.deadline = monotonicNanoseconds() + _timeout[decision.kind];
+    unique_lock<mutex> lock(_mutex);
+    uint32_t token = _nextToken++;
+    if (!_nextToken) {
+      _nextToken = 1;
+    }
+    _pending[token] = decision;
+    return token;
+  }
+
+  // Remove the decision with the given token from the table
+  bool take(uint32_t token, Decision& decision)
+  {
+    unique_lock<mutex> lock(_mutex);
+    map<uint32_t, Decision>::iterator i = _pending.find(token);
+    if (i == _pending.end()) {
+      return false;
+    }
+    decision = i->second;
+    _pending.erase(i);
+    return true;
+  }
+
+  // Remove the decisions that have expired
+  void expire(vector<Decision>& expired)
+  {
+    uint64_t now = monotonicNanoseconds();
+    unique_lock<mutex> lock(_mutex);
+    for (map<uint32_t, Decision>::iterator i = _pending.begin(); i != _pending.end(); ) {
+      if (i->second.deadline <= now) {
+        expired.push_back(i->second);
+        _pending.erase(i++);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  // Called when a server subscription has been terminated
+  void forget(pjsua_srv_pres* srvPres)
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (map<uint32_t, Decision>::iterator i = _pending.begin(); i != _pending.end(); ) {
+      if (i->second.kind == INCOMING_SUBSCRIBE && i->second.srvPres == srvPres) {
+        _pending.erase(i++);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  // Apply the verdict for the decision with the given token, return
+  // false if it has already been decided or has expired.  Called from
+  // Node's thread.
+  bool respond(uint32_t token, int verdict)
+  {
+    PJSUA_LOCK();
+    Decision decision;
+    bool found = take(token, decision);
+    if (found) {
+      apply(decision, verdict);
+    }
+    PJSUA_UNLOCK();
+    return found;
+  }
+
+  // Apply the default verdict to all decisions that have expired.
+  // Called from Node's thread.
+  void expireAll()
+  {
+    PJSUA_LOCK();
+    vector<Decision> expired;
+    expire(expired);
+    for (vector<Decision>::iterator i = expired.begin(); i != expired.end(); i++) {
+      apply(*i, _defaultVerdict[i->kind]);
+    }
+    PJSUA_UNLOCK();
+  }
+
+  bool transferContinue(pjsua_call_id callId) const { return _transferContinue[callId]; }
+  void resetTransfer(pjsua_call_id callId) { _transferContinue[callId] = _defaultVerdict[TRANSFER_STATUS]; }
+
+private:
+  // Must be called with the PJSUA lock held
+  void apply(const Decision& decision, int verdict);
+
+  uint64_t _timeout[KIND_COUNT];
+  int _defaultVerdict[KIND_COUNT];
+  volatile bool _transferContinue[PJSUA_MAX_CALLS];
+
+  mutex _mutex;
+  uint32_t _nextToken;
+  map<uint32_t, Decision> _pending;
+};
+
+const char* DecisionTable::kindNames[DecisionTable::KIND_COUNT] = {
+  "call_transfer_request", "call_transfer_status", "call_replace_request", "incoming_subscribe"
+};
+
+void
+DecisionTable::apply(const Decision& decision, int verdict)
+{
+  switch (decision.kind) {
+  case TRANSFER_STATUS:
+    // Stopping is sticky, resetTransfer() is called at the final notification
+    if (!verdict) {
+      _transferContinue[decision.callId] = false;
+    }
+    break;
+  case INCOMING_SUBSCRIBE:
+    if (verdict / 100 == 2) {
+      pjsua_pres_notify(decision.accId, decision.srvPres, PJSIP_EVSUB_STATE_ACTIVE, NULL, NULL, PJ_TRUE, NULL);
+    } else {
+      pj_str_t reason = pj_str((char*) "rejected");
+      pjsua_pres_notify(decision.accId, decision.srvPres, PJSIP_EVSUB_STATE_TERMINATED, NULL, &reason, PJ_FALSE, NULL);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static DecisionTable decisionTable;
+
+// //////////////////////////////////////////////////////////////////////
+
+// Call admission control is evaluated natively in on_incoming_call so
+// that calls can be rejected during overload without involving
+// JavaScript.  Rules limit the number of concurrent calls, globally
+// and per account, and the rate of incoming calls using a token
+// bucket.  Rejected calls are answered with the configured status code
+// and a Retry-After header, and no events are delivered for them.
+// PJSUA calls on_incoming_call with its lock held, so the call table
+// in pjsua_var can be inspected directly.
+
+class AdmissionControl
+{
+public:
+  enum Verdict { ADMIT, REJECT_MAX_CALLS, REJECT_ACCOUNT_CALLS, REJECT_CPS, VERDICT_COUNT };
+
+  AdmissionControl()
+    : _maxCalls(0),
+      _maxCallsPerAccount(0),
+      _cps(0),
+      _burst(0),
+      _tokens(0),
+      _lastRefill(0),
+      _rejectCode(PJSIP_SC_SERVICE_UNAVAILABLE),
+      _retryAfter(5)
+  {
+    for (int i = 0; i < VERDICT_COUNT; i++) {
+      _counters[i] = 0;
+    }
+    for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+      _rejected[i] = false;
+    }
+  }
+
+  void configure(unsigned maxCalls, unsigned maxCallsPerAccount, const map<pjsua_acc_id, unsigned>& accountLimits,
+                 double cps, double burst, int rejectCode, unsigned retryAfter)
+  {
+    unique_lock<mutex> lock(_mutex);
+    _maxCalls = maxCalls;
+    _maxCallsPerAccount = maxCallsPerAccount;
+    _accountLimits = accountLimits;
+    _cps = cps;
+    _burst = burst;
+    _tokens = burst;
+    _lastRefill = monotonicNanoseconds();
+    _rejectCode = rejectCode;
+    _retryAfter = retryAfter;
+  }
+
+  // Decide on an incoming call.  Rejected calls are answered and
+  // remembered so that their events can be suppressed.
+  Verdict admit(pjsua_acc_id accId, pjsua_call_id callId);
+
+  // Calls rejected by admission control never reach JavaScript.
+  // suppressCallState() is used by on_call_state, which is the last
+  // callback for a call and forgets the rejection.
+  bool suppressEvents(pjsua_call_id callId) const
+  {
+    return callId >= 0 && callId < (pjsua_call_id) PJSUA_MAX_CALLS && _rejected[callId];
+  }
+  bool suppressCallState(pjsua_call_id callId);
+
+  Handle<Object> getStats() const;
+
+private:
+  Verdict evaluate(pjsua_acc_id accId);
+  void reject(pjsua_call_id callId, int code, unsigned retryAfter);
+
+  mutex _mutex;
+  unsigned _maxCalls;                                       // 0 means no limit
+  unsigned _maxCallsPerAccount;                             // 0 means no limit
+  map<pjsua_acc_id, unsigned> _accountLimits;               // overrides _maxCallsPerAccount
+  double _cps;                                              // 0 means no limit
+  double _burst;
+  double _tokens;
+  uint64_t _lastRefill;
+  int _rejectCode;
+  unsigned _retryAfter;                                     // seconds, 0 for no Retry-After header
+
+  volatile uint64_t _counters[VERDICT_COUNT];
+  volatile bool _rejected[PJSUA_MAX_CALLS];
+};
+
+AdmissionControl::Verdict
+AdmissionControl::evaluate(pjsua_acc_id accId)
+{
+  if (_maxCalls && pjsua_call_get_count() > _maxCalls) {
+    return REJECT_MAX_CALLS;
+  }
+
+  map<pjsua_acc_id, unsigned>::const_iterator i = _accountLimits.find(accId);
+  unsigned accountLimit = (i == _accountLimits.end()) ? _maxCallsPerAccount : i->second;
+  if (accountLimit) {
+    unsigned accountCalls = 0;
+    for (unsigned callId = 0; callId < pjsua_var.ua_cfg.max_calls; callId++) {
+      if (pjsua_var.calls[callId].inv && pjsua_var.calls[callId].acc_id == accId) {
+        accountCalls++;
+      }
+    }
+    // The new call has already been allocated and is included
+    if (accountCalls > accountLimit) {
+      return REJECT_ACCOUNT_CALLS;
+    }
+  }
+
+  if (_cps > 0) {
+    uint64_t now = monotonicNanoseconds();
+    _tokens = min(_burst, _tokens + (now - _lastRefill) * _cps / 1e9);
+    _lastRefill = now;
+    if (_tokens < 1.0) {
+      return REJECT_CPS;
+    }
+    _tokens -= 1.0;
+  }
+
+  return ADMIT;
+}
+
+AdmissionControl::Verdict
+AdmissionControl::admit(pjsua_acc_id accId, pjsua_call_id callId)
+{
+  Verdict verdict;
+  int rejectCode;
+  unsigned retryAfter;
+  {
+    unique_lock<mutex> lock(_mutex);
+    verdict = evaluate(accId);
+    rejectCode = _rejectCode;
+    retryAfter = _retryAfter;
+  }
+
+  __sync_fetch_and_add(&_counters[verdict], 1);
+  _rejected[callId] = (verdict != ADMIT);
+
+  if (verdict != ADMIT) {
+    reject(callId, rejectCode, retryAfter);
+  }
+  return verdict;
+}
+
+void
+AdmissionControl::reject(pjsua_call_id callId, int code, unsigned retryAfter)
+{
+  pjsua_msg_data msgData;
+  pjsua_msg_data_init(&msgData);
+
+  char retryAfterValue[16];
+  pjsip_generic_string_hdr retryAfterHeader;
+  if (retryAfter) {
+    snprintf(retryAfterValue, sizeof retryAfterValue, "%u", retryAfter);
+    pj_str_t name = pj_str((char*) "Retry-After");
+    pj_str_t value = pj_str(retryAfterValue);
+    pjsip_generic_string_hdr_init2(&retryAfterHeader, &name, &value);
+    pj_list_push_back(&msgData.hdr_list, &retryAfterHeader);
+  }
+
+  if (pjsua_call_answer(callId, code, NULL, &msgData) != PJ_SUCCESS) {
+    pjsua_call_hangup(callId, code, NULL, NULL);
+  }
+}
+
+bool
+AdmissionControl::suppressCallState(pjsua_call_id callId)
+{
+  if (!suppressEvents(callId)) {
+    return false;
+  }
+
+  // The call ID is reused once the rejected call has been disconnected
+  pjsip_inv_session* inv = pjsua_var.calls[callId].inv;
+  if (!inv || inv->state == PJSIP_INV_STATE_DISCONNECTED) {
+    _rejected[callId] = false;
+  }
+  return true;
+}
+
+Handle<Object>
+AdmissionControl::getStats() const
+{
+  Local<Object> stats = Object::New();
+  setKey(stats, "admitted", (double) _counters[ADMIT]);
+  setKey(stats, "rejected_max_calls", (double) _counters[REJECT_MAX_CALLS]);
+  setKey(stats, "rejected_account_calls", (double) _counters[REJECT_ACCOUNT_CALLS]);
+  setKey(stats, "rejected_cps", (double) _counters[REJECT_CPS]);
+  return stats;
+}
+
+static AdmissionControl admissionControl;
+
+// //////////////////////////////////////////////////////////////////////
+
+// The CallOriginator places outgoing calls queued by
+// callMakeCallBatch() from a dedicated thread, at most cps calls per
+// second and with at most maxInFlight originated calls active at any
+// time.  Every call carries a JavaScript supplied correlation ID.
+// Its request record is passed as the user_data of the call and is
+// released when the call has been disconnected.
+//
+// A call_made event is delivered before the first call_state event
+// of an originated call, and a call_failed event if the call could
+// not be placed.
+
+class CallOriginator
+{
+public:
+  CallOriginator()
+    : _dispatch(0),
+      _started(false),
+      _cps(10),
+      _maxInFlight(0),
+      _inFlight(0),
+      _made(0),
+      _failed(0)
+  {
+    for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+      _calls[i] = 0;
+    }
+  }
+
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  struct Request
+  {
+    Request(pjsua_acc_id accId, const string& destUri, const string& correlationId)
+      : accId(accId),
+        destUri(destUri),
+        correlationId(correlationId),
+        callId(PJSUA_INVALID_ID),
+        made(false),
+        disconnected(false)
+    {}
+
+    pjsua_acc_id accId;
+    const string destUri;
+    const string correlationId;
+    pjsua_call_id callId;         // set once PJSUA has reported the call
+    bool made;                    // pjsua_call_make_call() has returned successfully
+    bool disconnected;            // the call was disconnected before pjsua_call_make_call() returned
+  };
+
+  // Start the pacing thread if necessary.  Must be called before
+  // requests are queued.
+  void start(Dispatch dispatch);
+
+  // cps == 0 disables pacing, maxInFlight == 0 disables the limit
+  void configure(double cps, unsigned maxInFlight);
+  double cps() const { return _cps; }
+  unsigned maxInFlight() const { return _maxInFlight; }
+
+  // Takes ownership of the requests
+  void enqueue(const vector<Request*>& requests);
+
+  // Called from on_call_state before the call state event is dispatched
+  void callState(pjsua_call_id callId);
+
+  bool correlationId(pjsua_call_id callId, string& correlationId);
+
+  Handle<Object> getStats();
+
+private:
+  static void* run(void* arg);
+  void pace();
+  void release(Request* request);
+
+  Dispatch _dispatch;
+  bool _started;
+  pthread_t _thread;
+  pj_thread_desc _threadDesc;
+
+  mutex _mutex;
+  condition_variable _wakeup;                               // signalled when requests or in flight slots become available
+  deque<Request*> _pending;
+  Request* _calls[PJSUA_MAX_CALLS];                         // requests by call ID
+  double _cps;
+  unsigned _maxInFlight;
+  unsigned _inFlight;
+  uint64_t _made;
+  uint64_t _failed;
+};
+
+void
+CallOriginator::start(Dispatch dispatch)
+{
+  unique_lock<mutex> lock(_mutex);
+  if (_started) {
+    return;
+  }
+  _dispatch = dispatch;
+  if (pthread_create(&_thread, 0, run, this)) {
+    throw JSException("Could not start call origination thread");
+  }
+  _started = true;
+}
+
+void
+CallOriginator::configure(double cps, unsigned maxInFlight)
+{
+  unique_lock<mutex> lock(_mutex);
+  _cps = cps;
+  _maxInFlight = maxInFlight;
+  _wakeup.notify_one();
+}
+
+void
+CallOriginator::enqueue(const vector<Request*>& requests)
+{
+  unique_lock<mutex> lock(_mutex);
+  _pending.insert(_pending.end(), requests.begin(), requests.end());
+  _wakeup.notify_one();
+}
+
+void*
+CallOriginator::run(void* arg)
+{
+  CallOriginator* originator = (CallOriginator*) arg;
+
+  pj_thread_t* thread;
+  pj_bzero(originator->_threadDesc, sizeof originator->_threadDesc);
+  if (pj_thread_register("originator", originator->_threadDesc, &thread) != PJ_SUCCESS) {
+    cerr << "could not register call origination thread with PJLIB" << endl;
+    abort();
+  }
+
+  originator->pace();
+  return 0;
+}
+
+static void
+sleepUntil(uint64_t deadline)
+{
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+    ;
+}
+
+void
+CallOriginator::pace()
+{
+  uint64_t nextCall = 0;
+
+  for (;;) {
+    Request* request;
+    uint64_t interval;
+    {
+      unique_lock<mutex> lock(_mutex);
+      while (_pending.empty() || (_maxInFlight && _inFlight >= _maxInFlight)) {
+        _wakeup.wait(lock);
+      }
+      request = _pending.front();
+      _pending.pop_front();
+      _inFlight++;
+      interval = (_cps > 0) ? (uint64_t) (1e9 / _cps) : 0;
+    }
+
+    // Calls are scheduled on a fixed grid so that the rate does not
+    // drift with the time spent in pjsua_call_make_call()
+    uint64_t now = monotonicNanoseconds();
+    if (nextCall < now) {
+      nextCall = now;
+    } else {
+      sleepUntil(nextCall);
+    }
+    nextCall += interval;
+
+    pj_str_t destUri;
+    destUri.ptr = (char*) request->destUri.c_str();
+    destUri.slen = request->destUri.length();
+
+    pjsua_call_id callId;
+    pj_status_t status = pjsua_call_make_call(request->accId, &destUri, 0, request, 0, &callId);
+    if (status == PJ_SUCCESS) {
+      unique_lock<mutex> lock(_mutex);
+      _made++;
+      request->made = true;
+      if (!request->disconnected) {
+        continue;
+      }
+    } else {
+      {
+        unique_lock<mutex> lock(_mutex);
+        _failed++;
+      }
+      _dispatch(new PJSUACallFailedEvent(request->correlationId, request->accId, request->destUri, status));
+    }
+
+    unique_lock<mutex> lock(_mutex);
+    release(request);
+  }
+}
+
+// Must be called with _mutex held
+void
+CallOriginator::release(Request* request)
+{
+  if (request->callId != PJSUA_INVALID_ID && _calls[request->callId] == request) {
+    _calls[request->callId] = 0;
+  }
+  _inFlight--;
+  delete request;
+  _wakeup.notify_one();
+}
+
+void
+CallOriginator::callState(pjsua_call_id callId)
+{
+  Request* request = (Request*) pjsua_call_get_user_data(callId);
+  if (!request) {
+    return;
+  }
+
+  pjsip_inv_session* inv = pjsua_var.calls[callId].inv;
+  bool disconnected = !inv || inv->state == PJSIP_INV_STATE_DISCONNECTED;
+
+  bool announce = false;
+  string correlationId;
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (request->callId == PJSUA_INVALID_ID) {
+      request->callId = callId;
+      _calls[callId] = request;
+      correlationId = request->correlationId;
+      announce = true;
+    }
+  }
+
+  // Dispatch without holding the lock, JavaScript may look up
+  // correlation IDs while the event is being delivered
+  if (announce) {
+    _dispatch(new PJSUACallMadeEvent(callId, correlationId));
+  }
+
+  if (disconnected) {
+    unique_lock<mutex> lock(_mutex);
+    pjsua_call_set_user_data(callId, 0);
+    if (_calls[callId] == request) {
+      _calls[callId] = 0;
+    }
+    if (request->made) {
+      release(request);
+    } else {
+      request->disconnected = true;
+    }
+  }
+}
+
+bool
+CallOriginator::correlationId(pjsua_call_id callId, string& correlationId)
+{
+  if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    return false;
+  }
+
+  unique_lock<mutex> lock(_mutex);
+  if (!_calls[callId]) {
+    return false;
+  }
+  correlationId = _calls[callId]->correlationId;
+  return true;
+}
+
+Handle<Object>
+CallOriginator::getStats()
+{
+  unique_lock<mutex> lock(_mutex);
+  Local<Object> stats = Object::New();
+  setKey(stats, "queued", (unsigned) _pending.size());
+  setKey(stats, "in_flight", _inFlight);
+  setKey(stats, "made", (double) _made);
+  setKey(stats, "failed", (double) _failed);
+  setKey(stats, "cps", _cps);
+  setKey(stats, "max_in_flight", _maxInFlight);
+  return stats;
+}
+
+static CallOriginator callOriginator;
+
+// //////////////////////////////////////////////////////////////////////
+
+// Per transport packet and byte counters are collected by a PJSIP
+// module that sits just above the transport layer and sees every
+// message that is received or sent.  UDP transports are identified
+// by their pjsip_transport, TCP connections are accounted to the
+// listener with the same local port.  Outgoing TCP connections use
+// ephemeral local ports and are not counted.  The module is only
+// registered after all transports have been added, so the transport
+// list never changes while worker threads search it and the counters
+// are updated without locking.
+
+class TransportStats
+{
+public:
+  // Must not be called after registerModule()
+  void add(pjsua_transport_id id, const char* type, pjsip_transport_type_e transportType,
+           pjsip_transport* transport, unsigned port)
+  {
+    _entries.push_back(new Entry(id, type, transportType, transport, port));
+  }
+
+  void registerModule();
+  Handle<Array> getStats() const;
+
+private:
+  struct Entry
+  {
+    Entry(pjsua_transport_id id, const char* type, pjsip_transport_type_e transportType,
+          pjsip_transport* transport, unsigned port)
+      : id(id),
+        type(type),
+        transportType(transportType),
+        transport(transport),
+        port(port),
+        rxPackets(0),
+        rxBytes(0),
+        txPackets(0),
+        txBytes(0)
+    {}
+
+    pjsua_transport_id id;
+    const char* type;
+    pjsip_transport_type_e transportType;
+    pjsip_transport* transport;                             // 0 for connection oriented transports
+    unsigned port;
+    volatile uint64_t rxPackets;
+    volatile uint64_t rxBytes;
+    volatile uint64_t txPackets;
+    volatile uint64_t txBytes;
+  };
+
+  Entry* find(pjsip_transport* transport) const;
+
+  static pj_bool_t onRxMessage(pjsip_rx_data* rdata);
+  static pj_status_t onTxMessage(pjsip_tx_data* tdata);
+
+  static pjsip_module_ _module;
+  vector<Entry*> _entries;
+};
+
+static TransportStats transportStats;
+
+pjsip_module_ TransportStats::_module = {
+  NULL, NULL,                                               // prev, next
+  { (char*) "mod-transport-stats", 19 },                    // name
+  -1,                                                       // id
+  PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1,                   // priority
+  NULL,                                                     // load()
+  NULL,                                                     // start()
+  NULL,                                                     // stop()
+  NULL,                                                     // unload()
+  &onRxMessage,                                             // on_rx_request()
+  &onRxMessage,                                             // on_rx_response()
+  &onTxMessage,                                             // on_tx_request()
+  &onTxMessage,                                             // on_tx_response()
+  NULL                                                      // on_tsx_state()
+};
+
+void
+TransportStats::registerModule()
+{
+  pj_status_t status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &_module);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error registering transport statistics module", status);
+  }
+}
+
+TransportStats::Entry*
+TransportStats::find(pjsip_transport* transport) const
+{
+  if (!transport) {
+    return 0;
+  }
+  for (vector<Entry*>::const_iterator i = _entries.begin(); i != _entries.end(); i++) {
+    if ((*i)->transport) {
+      if ((*i)->transport == transport) {
+        return *i;
+      }
+    } else if ((*i)->transportType == transport->key.type
+               && (*i)->port == pj_sockaddr_get_port(&transport->local_addr)) {
+      return *i;
+    }
+  }
+  return 0;
+}
+
+pj_bool_t
+TransportStats::onRxMessage(pjsip_rx_data* rdata)
+{
+  Entry* entry = transportStats.find(rdata->tp_info.transport);
+  if (entry) {
+    __sync_fetch_and_add(&entry->rxPackets, 1);
+    __sync_fetch_and_add(&entry->rxBytes, rdata->pkt_info.len);
+  }
+  return PJ_FALSE;                                          // continue processing
+}
+
+pj_status_t
+TransportStats::onTxMessage(pjsip_tx_data* tdata)
+{
+  Entry* entry = transportStats.find(tdata->tp_info.transport);
+  if (entry) {
+    __sync_fetch_and_add(&entry->txPackets, 1);
+    __sync_fetch_and_add(&entry->txBytes, tdata->buf.cur - tdata->buf.start);
+  }
+  return PJ_SUCCESS;
+}
+
+Handle<Array>
+TransportStats::getStats() const
+{
+  Local<Array> stats = Array::New(_entries.size());
+  for (size_t i = 0; i < _entries.size(); i++) {
+    const Entry* entry = _entries[i];
+    Local<Object> transport = Object::New();
+    setKey(transport, "id", entry->id);
+    setKey(transport, "type", entry->type);
+    setKey(transport, "port", entry->port);
+    setKey(transport, "rx_packets", (double) entry->rxPackets);
+    setKey(transport, "rx_bytes", (double) entry->rxBytes);
+    setKey(transport, "tx_packets", (double) entry->txPackets);
+    setKey(transport, "tx_bytes", (double) entry->txBytes);
+    stats->Set(i, transport);
+  }
+  return stats;
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// The LogPipeline replaces PJ's synchronous log writer.  The writer
+// callback only copies the already formatted line into a slot of a
+// lock-free queue, so SIP worker threads never wait for the console,
+// a file or JavaScript.  Lines are delivered in batches, either to
+// the JavaScript callback as a "log" event from a timer in Node's
+// thread or to a file by a background thread.  Lines that do not fit
+// into the queue are dropped and counted, overlong lines are
+// truncated.
+
+class LogPipeline
+{
+public:
+  LogPipeline();
+
+  // Deliver log lines to the JavaScript callback every interval seconds
+  void start(Local<Function> callback, size_t size, double interval);
+  // Write log lines to the given file from a background thread
+  void start(const string& filename, size_t size, double interval);
+  // Deliver the queued lines, stop the timer or the thread and hand
+  // logging back to PJ's console writer
+  void stop();
+
+  bool enabled() const { return _enabled; }
+
+  // pjsua_logging_config.cb
+  static void write(int level, const char* data, int length);
+
+  Handle<Object> getStats() const;
+
+private:
+  struct Line
+  {
+    int level;
+    unsigned length;
+    char text[1016];
+  };
+
+  void allocate(size_t size, double interval);
+  void deliver();
+  void writeLines();
+  static void timerCallback(EV_P_ ev_timer* w, int revents);
+  static void* run(void* arg);
+
+  BoundedQueue<Line> _queue;
+  volatile bool _enabled;
+  double _interval;
+
+  ev_timer _timer;                                          // delivers lines to JavaScript
+  Persistent<Function> _callback;
+  Persistent<Context> _callbackContext;
+
+  FILE* _file;
+  pthread_t _thread;                                        // writes lines to _file
+  volatile bool _stopping;
+
+  volatile uint64_t _dropped;
+  volatile uint64_t _truncated;
+  volatile uint64_t _delivered;                             // by Node's or the writer thread
+};
+
+static LogPipeline logPipeline;
+
+LogPipeline::LogPipeline()
+  : _enabled(false),
+    _interval(0),
+    _file(0),
+    _stopping(false),
+    _dropped(0),
+    _truncated(0),
+    _delivered(0)
+{
+  ev_init(&_timer, timerCallback);
+  _timer.data = this;
+}
+
+void
+LogPipeline::allocate(size_t size, double interval)
+{
+  _queue.allocate(size);
+  _interval = interval;
+}
+
+void
+LogPipeline::start(Local<Function> callback, size_t size, double interval)
+{
+  _callback = Persistent<Function>::New(callback);
+  _callbackContext = Persistent<Context>::New(Context::GetCurrent());
+  allocate(size, interval);
+
+  ev_timer_set(&_timer, interval, interval);
+  ev_timer_start(EV_DEFAULT_UC_ &_timer);
+  __sync_synchronize();
+  _enabled = true;
+}
+
+void
+LogPipeline::start(const string& filename, size_t size, double interval)
+{
+  _file = fopen(filename.c_str(), "a");
+  if (!_file) {
+    throw JSException("Could not open log file " + filename + ": " + strerror(errno));
+  }
+  allocate(size, interval);
+
+  _stopping = false;
+  if (pthread_create(&_thread, 0, run, this)) {
+    fclose(_file);
+    _file = 0;
+    throw JSException("Could not start log writer thread");
+  }
+  __sync_synchronize();
+  _enabled = true;
+}
+
+void
+LogPipeline::stop()
+{
+  if (!_enabled) {
+    return;
+  }
+  pj_log_set_log_func(&pj_log_write);
+  _enabled = false;
+
+  if (_file) {
+    _stopping = true;
+    pthread_join(_thread, 0);
+    fclose(_file);
+    _file = 0;
+  } else {
+    ev_timer_stop(EV_DEFAULT_UC_ &_timer);
+    if (_queue.size()) {
+      deliver();
+    }
+  }
+}
+
+void
+LogPipeline::write(int level, const char* data, int length)
+{
+  Line line;
+  line.level = level;
+  line.length = length;
+  if (line.length > sizeof line.text) {
+    line.length = sizeof line.text;
+    __sync_fetch_and_add(&logPipeline._truncated, 1);
+  }
+  memcpy(line.text, data, line.length);
+
+  if (!logPipeline._queue.push(line)) {
+    __sync_fetch_and_add(&logPipeline._dropped, 1);
+  }
+}
+
+void*
+LogPipeline::run(void* arg)
+{
+  LogPipeline* pipeline = (LogPipeline*) arg;
+
+  while (!pipeline->_stopping) {
+    pipeline->writeLines();
+    usleep((useconds_t) (pipeline->_interval * 1000000.0));
+  }
+  pipeline->writeLines();
+
+  return 0;
+}
+
+// Called by the writer thread
+void
+LogPipeline::writeLines()
+{
+  Line line;
+  size_t written = 0;
+  while (_queue.pop(line)) {
+    fwrite(line.text, 1, line.length, _file);
+    if (line.length && line.text[line.length - 1] != '\n') {
+      fputc('\n', _file);
+    }
+    written++;
+  }
+  if (written) {
+    fflush(_file);
+    __sync_fetch_and_add(&_delivered, written);
+  }
+}
+
+void
+LogPipeline::timerCallback(EV_P_ ev_timer* w, int revents)
+{
+  LogPipeline* pipeline = reinterpret_cast<LogPipeline*>(w->data);
+  if (pipeline->_queue.size()) {
+    pipeline->deliver();
+  }
+}
+
+// Invoke the callback with "log" and an array of [ level, line ]
+// arrays
+void
+LogPipeline::deliver()
+{
+  HandleScope scope;
+  Context::Scope contextScope(_callbackContext);
+
+  Local<Array> lines = Array::New();
+  unsigned count = 0;
+  Line line;
+  while (_queue.pop(line)) {
+    unsigned length = line.length;
+    while (length && line.text[length - 1] == '\n') {
+      length--;
+    }
+    Local<Array> entry = Array::New(2);
+    entry->Set(0, Integer::New(line.level));
+    entry->Set(1, String::New(line.text, length));
+    lines->Set(count++, entry);
+  }
+  __sync_fetch_and_add(&_delivered, count);
+
+  Handle<Value> argv[2] = { String::NewSymbol("log"), lines };
+
+  TryCatch tryCatch;
+  _callback->Call(_callbackContext->Global(), 2, argv);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+}
+
+Handle<Object>
+LogPipeline::getStats() const
+{
+  Local<Object> stats = Object::New();
+  setKey(stats, "enabled", (bool) _enabled);
+  setKey(stats, "capacity", (double) (_queue.allocated() ? _queue.capacity() : 0));
+  setKey(stats, "queued", (double) (_queue.allocated() ? _queue.size() : 0));
+  setKey(stats, "delivered", (double) _delivered);
+  setKey(stats, "dropped", (double) _dropped);
+  setKey(stats, "truncated", (double) _truncated);
+  setKey(stats, "level", pj_log_get_level());
+  return stats;
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// The AccountProvisioner adds the accounts passed to addAccounts()
+// from a timer in Node's thread, at most regRate accounts per second
+// with randomized spacing, so that their initial REGISTER requests do
+// not arrive at the registrar at once.  The registration interval of
+// every account is randomized as well so that refreshes do not stay
+// synchronized.  Registration results of provisioned accounts are
+// not delivered as reg_state2 events but counted per batch and
+// reported by periodic accounts_progress events.  A batch ends once
+// all of its accounts have been added and have a registration result:
+// its last accounts_progress event is delivered, its accounts then
+// deliver reg_state2 events like any other account, and the progress
+// timer stops when no batch is left.
+
+class AccountProvisioner
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  struct Account
+  {
+    string user;
+    string domain;
+    string password;
+    string registrar;
+    unsigned regTimeout;
+  };
+
+  AccountProvisioner();
+
+  // Takes ownership of the accounts, returns the batch ID.
+  // jitter is the fraction by which spacing and registration
+  // intervals are varied.
+  uint32_t enqueue(Dispatch dispatch, const vector<Account*>& accounts, double regRate, double jitter,
+                   double progressInterval);
+
+  // Called from on_reg_state2, returns true if the event should not
+  // be delivered
+  bool regState(pjsua_acc_id accId, const pjsua_reg_info* info);
+
+private:
+  enum RegState { UNKNOWN, REGISTERED, FAILED };
+
+  struct Batch
+  {
+    PJSUAAccountsProgressEvent::Progress progress;
+    double regRate;
+    double jitter;
+    bool changed;
+  };
+
+  static void addTimerCallback(EV_P_ ev_timer* w, int revents);
+  static void progressTimerCallback(EV_P_ ev_timer* w, int revents);
+
+  void addNext();
+  void scheduleNext();
+  void reportProgress();
+
+  // Returns a factor between 1 - jitter and 1 + jitter
+  double randomFactor(double jitter);
+
+  Dispatch _dispatch;
+  unsigned _randomState;                                    // only used in Node's thread
+
+  mutex _mutex;                                             // protects the batches and account states
+  deque<pair<uint32_t, Account*> > _pending;
+  map<uint32_t, Batch> _batches;
+  uint32_t _nextBatch;
+  uint32_t _accBatch[PJSUA_MAX_ACC];                        // 0 for accounts not added by the provisioner
+  RegState _accState[PJSUA_MAX_ACC];
+
+  ev_timer _addTimer;
+  ev_timer _progressTimer;
+};
+
+AccountProvisioner::AccountProvisioner()
+  : _dispatch(0),
+    _randomState((unsigned) (monotonicNanoseconds() ^ getpid())),
+    _nextBatch(1)
+{
+  for (unsigned i = 0; i < PJSUA_MAX_ACC; i++) {
+    _accBatch[i] = 0;
+    _accState[i] = UNKNOWN;
+  }
+  ev_init(&_addTimer, addTimerCallback);
+  _addTimer.data = this;
+  ev_init(&_progressTimer, progressTimerCallback);
+  _progressTimer.data = this;
+}
+
+uint32_t
+AccountProvisioner::enqueue(Dispatch dispatch, const vector<Account*>& accounts, double regRate, double jitter,
+                            double progressInterval)
+{
+  _dispatch = dispatch;
+
+  uint32_t batchId;
+  {
+    unique_lock<mutex> lock(_mutex);
+    batchId = _nextBatch++;
+    Batch& batch = _batches[batchId];
+    batch.progress.batch = batchId;
+    batch.progress.total = accounts.size();
+    batch.progress.added = 0;
+    batch.progress.addFailed = 0;
+    batch.progress.registered = 0;
+    batch.progress.failed = 0;
+    batch.regRate = regRate;
+    batch.jitter = jitter;
+    batch.changed = true;
+
+    for (vector<Account*>::const_iterator i = accounts.begin(); i != accounts.end(); i++) {
+      _pending.push_back(make_pair(batchId, *i));
+    }
+  }
+
+  // The interval of the latest batch applies to all batches
+  ev_timer_stop(EV_DEFAULT_UC_ &_progressTimer);
+  ev_timer_set(&_progressTimer, progressInterval, progressInterval);
+  ev_timer_start(EV_DEFAULT_UC_ &_progressTimer);
+  if (!ev_is_active(&_addTimer)) {
+    scheduleNext();
+  }
+
+  return batchId;
+}
+
+// Every process uses its own sequence, so that processes started
+// together do not register in lockstep
+double
+AccountProvisioner::randomFactor(double jitter)
+{
+  return 1.0 + jitter * ((double) rand_r(&_randomState) / RAND_MAX - 0.5) * 2.0;
+}
+
+void
+AccountProvisioner::scheduleNext()
+{
+  double delay;
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_pending.empty()) {
+      return;
+    }
+    const Batch& batch = _batches[_pending.front().first];
+    delay = randomFactor(batch.jitter) / batch.regRate;
+  }
+  ev_timer_set(&_addTimer, delay, 0.);
+  ev_timer_start(EV_DEFAULT_UC_ &_addTimer);
+}
+
+void
+AccountProvisioner::addNext()
+{
+  pair<uint32_t, Account*> next;
+  double jitter;
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_pending.empty()) {
+      return;
+    }
+    next = _pending.front();
+    _pending.pop_front();
+    jitter = _batches[next.first].jitter;
+  }
+  const Account& account = *next.second;
+
+  const string id = "sip:" + account.user + "@" + account.domain;
+  const string regUri = "sip:" + (account.registrar.empty() ? account.domain : account.registrar);
+
+  pjsua_acc_config accConfig;
+  pjsua_acc_config_default(&accConfig);
+  accConfig.id = pj_str((char*) id.c_str());
+  accConfig.reg_uri = pj_str((char*) regUri.c_str());
+  // A jitter of 1 may scale the interval down to 0
+  accConfig.reg_timeout = max(1u, (unsigned) (account.regTimeout * randomFactor(jitter)));
+  accConfig.cred_count = 1;
+  accConfig.cred_info[0].realm = pj_str((char*) account.domain.c_str());
+  accConfig.cred_info[0].scheme = pj_str((char*) "digest");
+  accConfig.cred_info[0].username = pj_str((char*) account.user.c_str());
+  accConfig.cred_info[0].data_type = PJSIP_CRED_DATA_PLAIN_PASSWD;
+  accConfig.cred_info[0].data = pj_str((char*) account.password.c_str());
+  accConfig.allow_contact_rewrite = 1;
+
+  // The registration is started by pjsua_acc_add(), so the account
+  // must be known as provisioned before.  PJSUA allocates the lowest
+  // free account ID.
+  pjsua_acc_id accId = PJSUA_INVALID_ID;
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (unsigned i = 0; i < PJSUA_MAX_ACC; i++) {
+      if (!pjsua_acc_is_valid(i)) {
+        accId = i;
+        break;
+      }
+    }
+    if (accId != PJSUA_INVALID_ID) {
+      _accBatch[accId] = next.first;
+      _accState[accId] = UNKNOWN;
+    }
+  }
+
+  pjsua_acc_id addedId;
+  pj_status_t status = pjsua_acc_add(&accConfig, PJ_FALSE, &addedId);
+
+  {
+    unique_lock<mutex> lock(_mutex);
+    Batch& batch = _batches[next.first];
+    if (status == PJ_SUCCESS) {
+      batch.progress.added++;
+      if (addedId != accId) {
+        if (accId != PJSUA_INVALID_ID && _accBatch[accId] == next.first && _accState[accId] == UNKNOWN) {
+          _accBatch[accId] = 0;
+        }
+        _accBatch[addedId] = next.first;
+        _accState[addedId] = UNKNOWN;
+      }
+    } else {
+      batch.progress.addFailed++;
+      if (accId != PJSUA_INVALID_ID && _accBatch[accId] == next.first && _accState[accId] == UNKNOWN) {
+        _accBatch[accId] = 0;
+      }
+    }
+    batch.changed = true;
+  }
+
+  delete next.second;
+}
+
+void
+AccountProvisioner::addTimerCallback(EV_P_ ev_timer* w, int revents)
+{
+  AccountProvisioner* provisioner = reinterpret_cast<AccountProvisioner*>(w->data);
+  provisioner->addNext();
+  provisioner->scheduleNext();
+}
+
+bool
+AccountProvisioner::regState(pjsua_acc_id accId, const pjsua_reg_info* info)
+{
+  if (accId < 0 || accId >= (pjsua_acc_id) PJSUA_MAX_ACC) {
+    return false;
+  }
+
+  unique_lock<mutex> lock(_mutex);
+  uint32_t batchId = _accBatch[accId];
+  if (!batchId) {
+    return false;
+  }
+
+  RegState state = (info->cbparam->code / 100 == 2 && info->cbparam->expiration > 0) ? REGISTERED : FAILED;
+  if (state != _accState[accId]) {
+    Batch& batch = _batches[batchId];
+    if (_accState[accId] == REGISTERED) {
+      batch.progress.registered--;
+    } else if (_accState[accId] == FAILED) {
+      batch.progress.failed--;
+    }
+    if (state == REGISTERED) {
+      batch.progress.registered++;
+    } else {
+      batch.progress.failed++;
+    }
+    _accState[accId] = state;
+    batch.changed = true;
+  }
+  return true;
+}
+
+// Report the batches whose progress has changed since the last report
+// and remove the batches that have ended
+void
+AccountProvisioner::reportProgress()
+{
+  vector<PJSUAAccountsProgressEvent::Progress> changed;
+  bool idle;
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (map<uint32_t, Batch>::iterator i = _batches.begin(); i != _batches.end(); ) {
+      const PJSUAAccountsProgressEvent::Progress& progress = i->second.progress;
+      if (i->second.changed) {
+        changed.push_back(progress);
+        i->second.changed = false;
+      }
+      if (progress.added + progress.addFailed == progress.total
+          && progress.registered + progress.failed == progress.added) {
+        for (unsigned accId = 0; accId < PJSUA_MAX_ACC; accId++) {
+          if (_accBatch[accId] == i->first) {
+            _accBatch[accId] = 0;
+            _accState[accId] = UNKNOWN;
+          }
+        }
+        _batches.erase(i++);
+      } else {
+        i++;
+      }
+    }
+    idle = _batches.empty();
+  }
+  if (idle) {
+    ev_timer_stop(EV_DEFAULT_UC_ &_progressTimer);
+  }
+
+  for (vector<PJSUAAccountsProgressEvent::Progress>::const_iterator i = changed.begin(); i != changed.end(); i++) {
+    _dispatch(new PJSUAAccountsProgressEvent(*i));
+  }
+}
+
+void
+AccountProvisioner::progressTimerCallback(EV_P_ ev_timer* w, int revents)
+{
+  AccountProvisioner* provisioner = reinterpret_cast<AccountProvisioner*>(w->data);
+  provisioner->reportProgress();
+}
+
+static AccountProvisioner accountProvisioner;
+
+// //////////////////////////////////////////////////////////////////////
+
+// The RegistrationTable holds the result of the last registration
+// request of every account.  It is updated from on_reg_state2 and
+// read in bulk by getRegistrations().  When notifications are enabled
+// by the reg_notify_interval option, reg_state2 events are no longer
+// delivered.  Instead, a timer in Node's thread delivers one
+// reg_changed event with the IDs of the accounts whose status class
+// (see statusClass()) has changed since the previous tick, so that
+// successful refreshes cause no events at all.
+
+#ifndef PJSIP_REGISTER_CLIENT_DELAY_BEFORE_REFRESH
+#define PJSIP_REGISTER_CLIENT_DELAY_BEFORE_REFRESH 5
+#endif
+
+enum RegEntryField { REG_ENTRY_ACC_ID, REG_ENTRY_STATUS, REG_ENTRY_STATUS_CLASS, REG_ENTRY_CODE, REG_ENTRY_REASON,
+                     REG_ENTRY_EXPIRATION, REG_ENTRY_NEXT_REFRESH, REG_ENTRY_FIELD_COUNT };
+static const char* regEntryFieldNames[REG_ENTRY_FIELD_COUNT] = {
+  "acc_id", "status", "status_class", "code", "reason", "expiration", "next_refresh"
+};
+static ObjectShape regEntryShape(regEntryFieldNames, REG_ENTRY_FIELD_COUNT);
+
+class RegistrationTable
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  RegistrationTable();
+
+  // Enable coalesced reg_changed events
+  void startNotifications(Dispatch dispatch, double interval);
+
+  // Called from on_reg_state2, returns true if the reg_state2 event
+  // should not be delivered
+  bool update(pjsua_acc_id accId, const pjsua_reg_info* info);
+
+  // Entry of the account, or undefined if no registration response
+  // has been received for the account yet
+  Handle<Value> get(pjsua_acc_id accId);
+
+  // Status class and next refresh time of the account's entry
+  void summary(pjsua_acc_id accId, int& statusClass, double& nextRefresh);
+  // 0 before the first response, 1 while registered and the class of
+  // the status code otherwise.  Transport errors are class 7, like in
+  // pjsua_acc_info.status.
+  static int statusClass(int code, int expiration);
+
+private:
+  struct Entry
+  {
+    bool valid;
+    pj_status_t status;
+    int code;
+    char reason[64];
+    int expiration;
+    double nextRefresh;                                     // milliseconds since the epoch, 0 if none
+    bool changed;
+  };
+
+  static void timerCallback(EV_P_ ev_timer* w, int revents);
+  void notify();
+
+  Dispatch _dispatch;
+  mutex _mutex;                                             // protects the entries and _changed
+  Entry _entries[PJSUA_MAX_ACC];
+  vector<pjsua_acc_id> _changed;
+  ev_timer _timer;
+};
+
+RegistrationTable::RegistrationTable()
+  : _dispatch(0)
+{
+  for (unsigned i = 0; i < PJSUA_MAX_ACC; i++) {
+    _entries[i].valid = false;
+    _entries[i].changed = false;
+  }
+  ev_init(&_timer, timerCallback);
+  _timer.data = this;
+}
+
+void
+RegistrationTable::startNotifications(Dispatch dispatch, double interval)
+{
+  _dispatch = dispatch;
+  ev_timer_set(&_timer, interval, interval);
+  ev_timer_start(EV_DEFAULT_UC_ &_timer);
+}
+
+int
+RegistrationTable::statusClass(int code, int expiration)
+{
+  if (code / 100 == 2) {
+    return expiration > 0 ? 1 : 0;
+  }
+  return (code >= 100 && code < 700) ? code / 100 : 7;
+}
+
+bool
+RegistrationTable::update(pjsua_acc_id accId, const pjsua_reg_info* info)
+{
+  if (accId < 0 || accId >= (pjsua_acc_id) PJSUA_MAX_ACC) {
+    return false;
+  }
+  const pjsip_regc_cbparam* param = info->cbparam;
+
+  pj_time_val now;
+  pj_gettimeofday(&now);
+
+  unique_lock<mutex> lock(_mutex);
+  Entry& entry = _entries[accId];
+
+  int previousClass = entry.valid ? statusClass(entry.code, entry.expiration) : 0;
+  entry.valid = true;
+  entry.status = param->status;
+  entry.code = param->code;
+  size_t reasonLength = min((size_t) param->reason.slen, sizeof entry.reason - 1);
+  memcpy(entry.reason, param->reason.ptr, reasonLength);
+  entry.reason[reasonLength] = 0;
+  entry.expiration = param->expiration;
+  entry.nextRefresh = 0;
+  if (param->code / 100 == 2 && param->expiration > 0) {
+    int delay = max(1, (int) param->expiration - PJSIP_REGISTER_CLIENT_DELAY_BEFORE_REFRESH);
+    entry.nextRefresh = (now.sec + delay) * 1000.0 + now.msec;
+  }
+
+  if (statusClass(entry.code, entry.expiration) != previousClass && !entry.changed) {
+    entry.changed = true;
+    _changed.push_back(accId);
+  }
+
+  return _dispatch != 0;
+}
+
+void
+RegistrationTable::summary(pjsua_acc_id accId, int& statusClass, double& nextRefresh)
+{
+  statusClass = 0;
+  nextRefresh = 0;
+  if (accId < 0 || accId >= (pjsua_acc_id) PJSUA_MAX_ACC) {
+    return;
+  }
+  unique_lock<mutex> lock(_mutex);
+  const Entry& entry = _entries[accId];
+  if (entry.valid) {
+    statusClass = RegistrationTable::statusClass(entry.code, entry.expiration);
+    nextRefresh = entry.nextRefresh;
+  }
+}
+
+Handle<Value>
+RegistrationTable::get(pjsua_acc_id accId)
+{
+  HandleScope scope;
+
+  Entry entry;
+  {
+    unique_lock<mutex> lock(_mutex);
+    entry = _entries[accId];
+  }
+  if (!entry.valid) {
+    return Undefined();
+  }
+
+  Local<Object> result = regEntryShape.newObject();
+  setKey(result, regEntryShape.key(REG_ENTRY_ACC_ID), accId);
+  setKey(result, regEntryShape.key(REG_ENTRY_STATUS), entry.status);
+  setKey(result, regEntryShape.key(REG_ENTRY_STATUS_CLASS), statusClass(entry.code, entry.expiration));
+  setKey(result, regEntryShape.key(REG_ENTRY_CODE), entry.code);
+  setKey(result, regEntryShape.key(REG_ENTRY_REASON), entry.reason);
+  setKey(result, regEntryShape.key(REG_ENTRY_EXPIRATION), entry.expiration);
+  setKey(result, regEntryShape.key(REG_ENTRY_NEXT_REFRESH), entry.nextRefresh);
+  return scope.Close(result);
+}
+
+void
+RegistrationTable::notify()
+{
+  vector<pjsua_acc_id> changed;
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_changed.empty()) {
+      return;
+    }
+    changed.swap(_changed);
+    for (vector<pjsua_acc_id>::const_iterator i = changed.begin(); i != changed.end(); i++) {
+      _entries[*i].changed = false;
+    }
+  }
+  _dispatch(new PJSUARegChangedEvent(changed));
+}
+
+void
+RegistrationTable::timerCallback(EV_P_ ev_timer* w, int revents)
+{
+  reinterpret_cast<RegistrationTable*>(w->data)->notify();
+}
+
+static RegistrationTable registrationTable;
+
+// //////////////////////////////////////////////////////////////////////
+
+// Audio is passed to JavaScript in Buffers whose memory comes from a
+// SlabPool.  When a Buffer is garbage collected, its slab is returned
+// to the pool and reused, so steady streaming allocates no memory.
+// At most maxFree slabs of each size are kept, so that a burst of
+// taps does not pin its peak memory; slabs beyond that are deleted.
+// The pool is only used from Node's thread.
+
+class SlabPool
+{
+public:
+  SlabPool()
+    : _allocated(0),
+      _reused(0),
+      _outstanding(0),
+      _deleted(0)
+  {}
+
+  char* allocate(size_t size);
+  void release(char* slab, size_t size);
+
+  // Wrap the first length bytes of the slab into a Buffer that
+  // returns the slab to the pool when it is collected
+  Handle<Object> toBuffer(char* slab, size_t size, size_t length);
+
+  Handle<Object> getStats() const;
+
+private:
+  static void freeCallback(char* data, void* hint);
+
+  static const size_t maxFree = 64;                         // per size
+
+  map<size_t, vector<char*> > _free;                        // free slabs by size
+  uint64_t _allocated;
+  uint64_t _reused;
+  uint64_t _outstanding;
+  uint64_t _deleted;
+};
+
+char*
+SlabPool::allocate(size_t size)
+{
+  _outstanding++;
+  vector<char*>& free = _free[size];
+  if (free.empty()) {
+    _allocated++;
+    return new char[size];
+  }
+  _reused++;
+  char* slab = free.back();
+  free.pop_back();
+  return slab;
+}
+
+void
+SlabPool::release(char* slab, size_t size)
+{
+  _outstanding--;
+  vector<char*>& free = _free[size];
+  if (free.size() >= maxFree) {
+    _deleted++;
+    delete[] slab;
+    return;
+  }
+  free.push_back(slab);
+}
+
+static SlabPool slabPool;
+
+void
+SlabPool::freeCallback(char* data, void* hint)
+{
+  slabPool.release(data, (size_t) hint);
+}
+
+Handle<Object>
+SlabPool::toBuffer(char* slab, size_t size, size_t length)
+{
+  return node::Buffer::New(slab, length, freeCallback, (void*) size)->handle_;
+}
+
+Handle<Object>
+SlabPool::getStats() const
+{
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+  setKey(stats, "allocated", (double) _allocated);
+  setKey(stats, "reused", (double) _reused);
+  setKey(stats, "outstanding", (double) _outstanding);
+  setKey(stats, "deleted", (double) _deleted);
+  return scope.Close(stats);
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// An AudioTap is a media port that is added to the conference bridge
+// and receives the audio of the conference slot that it is connected
+// to.  The bridge's clock thread copies every frame into a single
+// producer, single consumer ring of frames; if the ring is full, the
+// frame is dropped and counted as overrun.  A timer in Node's thread
+// empties the ring once per aggregation window and delivers the
+// frames as audio events carrying one Buffer.
+//
+// A tap of a call's slot ends when the call is disconnected: the
+// timer delivers the remaining frames, removes the tap and delivers
+// an audio_end event.  Taps of other slots live until they are
+// destroyed.
+
+class AudioTap;
+
+static map<uint32_t, AudioTap*> audioTaps;
+static uint32_t nextAudioTapId = 1;
+
+class AudioTap
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  // window is the aggregation window in seconds, ringFrames the number
+  // of frames that the ring can hold
+  AudioTap(uint32_t id, Dispatch dispatch, double window, unsigned ringFrames);
+  ~AudioTap();
+
+  // Add the tap to the bridge and connect the source slot to it.  If
+  // the slot belongs to a call, the tap is bound to the call.
+  void attach(pjsua_conf_port_id source);
+
+  uint32_t id() const { return _id; }
+  pjsua_conf_port_id slot() const { return _slot; }
+  uint64_t frames() const { return _frames; }
+  uint64_t overruns() const { return _overruns; }
+
+private:
+  static pj_status_t putFrame(pjmedia_port* port, const pjmedia_frame* frame);
+  static pj_status_t getFrame(pjmedia_port* port, pjmedia_frame* frame);
+  static void timerCallback(EV_P_ ev_timer* w, int revents);
+
+  void deliver();
+
+  uint32_t _id;
+  Dispatch _dispatch;
+  pjmedia_port _port;
+  pj_pool_t* _pool;
+  pjsua_conf_port_id _slot;
+  pjsua_call_id _callId;                                    // PJSUA_INVALID_ID if not bound to a call
+  uint32_t _callGeneration;
+  size_t _frameSize;                                        // bytes
+  size_t _windowFrames;
+
+  char* _ring;
+  unsigned _ringFrames;
+  volatile unsigned _head;                                  // written by the clock thread
+  volatile unsigned _tail;                                  // written by Node's thread
+  volatile uint64_t _frames;
+  volatile uint64_t _overruns;
+
+  ev_timer _timer;
+};
+
+class PJSUAAudioEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUAAudioEvent(uint32_t tapId, char* slab, size_t size, size_t length, uint64_t overruns)
+    : _tapId(tapId),
+      _slab(slab),
+      _size(size),
+      _length(length),
+      _overruns(overruns)
+  {}
+  virtual ~PJSUAAudioEvent()
+  {
+    if (_slab) {
+      slabPool.release(_slab, _size);
+    }
+  }
+  virtual const char* eventName() const { return "audio"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    // The Buffer takes over the slab
+    argv[0] = Integer::NewFromUnsigned(_tapId);
+    argv[1] = slabPool.toBuffer(_slab, _size, _length);
+    argv[2] = Number::New(_overruns);
+    _slab = 0;
+    return 3;
+  }
+
+private:
+  uint32_t _tapId;
+  mutable char* _slab;
+  size_t _size;
+  size_t _length;
+  uint64_t _overruns;
+};
+
+class PJSUAAudioEndEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUAAudioEndEvent(uint32_t tapId, pjsua_call_id callId)
+    : _tapId(tapId),
+      _callId(callId)
+  {}
+  virtual const char* eventName() const { return "audio_end"; }
+  virtual int orderingKey() const { return _callId; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = Integer::NewFromUnsigned(_tapId);
+    argv[1] = Integer::New(_callId);
+    return 2;
+  }
+
+private:
+  uint32_t _tapId;
+  pjsua_call_id _callId;
+};
+
+AudioTap::AudioTap(uint32_t id, Dispatch dispatch, double window, unsigned ringFrames)
+  : _id(id),
+    _dispatch(dispatch),
+    _pool(0),
+    _slot(PJSUA_INVALID_ID),
+    _callId(PJSUA_INVALID_ID),
+    _callGeneration(0),
+    _ring(0),
+    _ringFrames(ringFrames),
+    _head(0),
+    _tail(0),
+    _frames(0),
+    _overruns(0)
+{
+  const unsigned clockRate = pjmedia_conf_get_clock_rate(pjsua_var.mconf);
+  const unsigned channelCount = pjmedia_conf_get_channel_count(pjsua_var.mconf);
+  const unsigned samplesPerFrame = pjmedia_conf_get_samples_per_frame(pjsua_var.mconf);
+
+  pj_str_t name = pj_str((char*) "tap");
+  pj_bzero(&_port, sizeof _port);
+  pjmedia_port_info_init(&_port.info, &name, PJMEDIA_PORT_SIGNATURE('T', 'A', 'P', 'P'),
+                         clockRate, channelCount, 16, samplesPerFrame);
+  _port.port_data.pdata = this;
+  _port.put_frame = putFrame;
+  _port.get_frame = getFrame;
+
+  _frameSize = samplesPerFrame * 2;
+  const double framesPerSecond = (double) clockRate * channelCount / samplesPerFrame;
+  _windowFrames = max((size_t) 1, (size_t) (window * framesPerSecond + 0.5));
+  _ringFrames = max(_ringFrames, (unsigned) _windowFrames * 2);
+  _ring = new char[_ringFrames * _frameSize];
+
+  ev_init(&_timer, timerCallback);
+  _timer.data = this;
+  ev_timer_set(&_timer, window, window);
+}
+
+AudioTap::~AudioTap()
+{
+  ev_timer_stop(EV_DEFAULT_UC_ &_timer);
+  // The bridge calls no port callbacks after the port has been
+  // removed.  Frames not delivered yet are discarded.
+  if (_slot != PJSUA_INVALID_ID) {
+    pjsua_conf_remove_port(_slot);
+  }
+  if (_pool) {
+    pj_pool_release(_pool);
+  }
+  delete[] _ring;
+}
+
+void
+AudioTap::attach(pjsua_conf_port_id source)
+{
+  pjsua_call_id calls[PJSUA_MAX_CALLS];
+  unsigned callCount = PJSUA_MAX_CALLS;
+  if (pjsua_enum_calls(calls, &callCount) == PJ_SUCCESS) {
+    for (unsigned i = 0; i < callCount; i++) {
+      uint32_t generation = callGenerations.get(calls[i]);
+      if (pjsua_call_get_conf_port(calls[i]) == source) {
+        _callId = calls[i];
+        _callGeneration = generation;
+        break;
+      }
+    }
+  }
+
+  _pool = pjsua_pool_create("tap", 512, 512);
+  pj_status_t status = pjsua_conf_add_port(_pool, &_port, &_slot);
+  if (status != PJ_SUCCESS) {
+    _slot = PJSUA_INVALID_ID;
+    throw PJJSException("Error adding tap port to the conference bridge", status);
+  }
+  status = pjsua_conf_connect(source, _slot);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error connecting tap port", status);
+  }
+  ev_timer_start(EV_DEFAULT_UC_ &_timer);
+}
+
+pj_status_t
+AudioTap::putFrame(pjmedia_port* port, const pjmedia_frame* frame)
+{
+  AudioTap* tap = reinterpret_cast<AudioTap*>(port->port_data.pdata);
+
+  unsigned head = tap->_head;
+  if (head - tap->_tail == tap->_ringFrames) {
+    tap->_overruns++;
+    return PJ_SUCCESS;
+  }
+
+  // Missing frames are delivered as silence to preserve the timing
+  char* slot = tap->_ring + (head % tap->_ringFrames) * tap->_frameSize;
+  if (frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size == tap->_frameSize) {
+    memcpy(slot, frame->buf, tap->_frameSize);
+  } else {
+    memset(slot, 0, tap->_frameSize);
+  }
+  tap->_frames++;
+
+  __sync_synchronize();
+  tap->_head = head + 1;
+  return PJ_SUCCESS;
+}
+
+pj_status_t
+AudioTap::getFrame(pjmedia_port* port, pjmedia_frame* frame)
+{
+  frame->type = PJMEDIA_FRAME_TYPE_NONE;
+  frame->size = 0;
+  return PJ_SUCCESS;
+}
+
+// Deliver the frames in the ring, at most one window per Buffer
+void
+AudioTap::deliver()
+{
+  const size_t slabSize = _windowFrames * _frameSize;
+  for (;;) {
+    unsigned head = _head;
+    __sync_synchronize();
+    unsigned tail = _tail;
+    if (head == tail) {
+      return;
+    }
+
+    size_t count = min((size_t) (head - tail), _windowFrames);
+    char* slab = slabPool.allocate(slabSize);
+    for (size_t i = 0; i < count; i++) {
+      memcpy(slab + i * _frameSize, _ring + ((tail + i) % _ringFrames) * _frameSize, _frameSize);
+    }
+    __sync_synchronize();
+    _tail = tail + count;
+
+    _dispatch(new PJSUAAudioEvent(_id, slab, slabSize, count * _frameSize, _overruns));
+  }
+}
+
+void
+AudioTap::timerCallback(EV_P_ ev_timer* w, int revents)
+{
+  AudioTap* tap = reinterpret_cast<AudioTap*>(w->data);
+  const uint32_t id = tap->_id;
+  const pjsua_call_id callId = tap->_callId;
+  const Dispatch dispatch = tap->_dispatch;
+  bool ended = callId != PJSUA_INVALID_ID && callGenerations.ended(callId, tap->_callGeneration);
+  tap->deliver();
+  if (ended) {
+    // The tap is gone before JavaScript sees the event
+    map<uint32_t, AudioTap*>::iterator i = audioTaps.find(id);
+    if (i != audioTaps.end()) {
+      delete i->second;
+      audioTaps.erase(i);
+      dispatch(new PJSUAAudioEndEvent(id, callId));
+    }
+  }
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// Calls are recorded by media ports that are added to the conference
+// bridge.  The bridge's clock thread only copies frames into one of
+// two buffers of a Track and never touches files.  When the buffer is
+// full, it is handed to the RecordingWriter thread and the clock
+// thread continues with the other buffer.  If the writer has not
+// emptied that buffer yet, frames are dropped and counted as
+// overruns.  The writer thread polls all recordings, writes full
+// buffers and rolls files when they reach the configured size or
+// duration.  Closed files are reported by recording_file events.
+
+class PJSUARecordingFileEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUARecordingFileEvent(uint32_t recordingId, const string& path, uint64_t bytes, bool last)
+    : _recordingId(recordingId),
+      _path(path),
+      _bytes(bytes),
+      _last(last)
+  {}
+  virtual const char* eventName() const { return "recording_file"; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = Integer::NewFromUnsigned(_recordingId);
+    argv[1] = String::New(_path.c_str(), _path.length());
+    argv[2] = Number::New(_bytes);
+    argv[3] = Boolean::New(_last);
+    return 4;
+  }
+
+private:
+  uint32_t _recordingId;
+  const string _path;
+  uint64_t _bytes;
+  bool _last;
+};
+
+// Files that could not be opened, their audio is discarded
+static volatile uint64_t recordingOpenErrors;
+
+class Recording
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  enum Format { WAV, RAW };
+
+  struct Options
+  {
+    Format format;
+    bool splitChannels;
+    uint64_t maxBytes;                                      // 0 for no limit
+    double maxDuration;                                     // seconds, 0 for no limit
+    double bufferDuration;                                  // seconds of audio per buffer
+  };
+
+  Recording(uint32_t id, Dispatch dispatch, pjsua_call_id callId, const string& path, const Options& options);
+  ~Recording();
+
+  // Add the ports to the bridge and connect them.  Without
+  // splitChannels, one file receives the audio from and to the call
+  // mixed.  With splitChannels, the audio received from the call
+  // and the audio sent to it go to separate files, with -rx and -tx
+  // appended to the file name.  The sources sent to the call are
+  // determined when the recording starts.
+  void attach();
+
+  // Remove the ports from the bridge.  The writer thread then writes
+  // the remaining audio, closes the files and deletes the recording.
+  void detach();
+
+  uint32_t id() const { return _id; }
+  pjsua_call_id callId() const { return _callId; }
+  bool detached() const { return _detached; }
+
+  // Called by the writer thread, returns the number of bytes written
+  size_t write();
+  void close();
+
+  uint64_t overruns() const;
+
+private:
+  class Track
+  {
+  public:
+    Track();
+    ~Track();
+
+    void initialize(Recording* recording, const char* suffix, size_t frameSize, size_t bufferFrames);
+
+    static pj_status_t putFrame(pjmedia_port* port, const pjmedia_frame* frame);
+    static pj_status_t getFrame(pjmedia_port* port, pjmedia_frame* frame);
+
+    Recording* _recording;
+    const char* _suffix;
+    pjmedia_port _port;
+    pj_pool_t* _pool;
+    pjsua_conf_port_id _slot;
+
+    size_t _frameSize;
+    size_t _bufferFrames;
+    char* _buffers[2];
+    volatile size_t _used[2];                               // frames in the buffer
+    volatile bool _full[2];                                 // buffer handed to the writer
+    unsigned _active;                                       // buffer filled by the clock thread
+    volatile uint64_t _overruns;
+
+    // Writer thread state
+    FILE* _file;
+    string _path;
+    unsigned _fileIndex;
+    uint64_t _fileBytes;
+  };
+
+  void writeBuffer(Track& track, const char* data, size_t length);
+  void openFile(Track& track);
+  void closeFile(Track& track, bool last);
+
+  uint32_t _id;
+  Dispatch _dispatch;
+  pjsua_call_id _callId;
+  string _stem;                                             // path without extension
+  string _extension;
+  Options _options;
+  unsigned _clockRate;
+  unsigned _channelCount;
+  uint64_t _fileLimit;                                      // bytes of audio per file, 0 for no limit
+
+  Track _tracks[2];
+  unsigned _trackCount;
+  volatile bool _detached;
+};
+
+Recording::Track::Track()
+  : _recording(0),
+    _suffix(""),
+    _pool(0),
+    _slot(PJSUA_INVALID_ID),
+    _frameSize(0),
+    _bufferFrames(0),
+    _active(0),
+    _overruns(0),
+    _file(0),
+    _fileIndex(0),
+    _fileBytes(0)
+{
+  for (int i = 0; i < 2; i++) {
+    _buffers[i] = 0;
+    _used[i] = 0;
+    _full[i] = false;
+  }
+}
+
+Recording::Track::~Track()
+{
+  if (_pool) {
+    pj_pool_release(_pool);
+  }
+  delete[] _buffers[0];
+  delete[] _buffers[1];
+}
+
+void
+Recording::Track::initialize(Recording* recording, const char* suffix, size_t frameSize, size_t bufferFrames)
+{
+  _recording = recording;
+  _suffix = suffix;
+  _frameSize = frameSize;
+  _bufferFrames = bufferFrames;
+  _buffers[0] = new char[frameSize * bufferFrames];
+  _buffers[1] = new char[frameSize * bufferFrames];
+
+  pj_str_t name = pj_str((char*) "recorder");
+  pj_bzero(&_port, sizeof _port);
+  pjmedia_port_info_init(&_port.info, &name, PJMEDIA_PORT_SIGNATURE('R', 'E', 'C', 'P'),
+                         recording->_clockRate, recording->_channelCount, 16, frameSize / 2);
+  _port.port_data.pdata = this;
+  _port.put_frame = putFrame;
+  _port.get_frame = getFrame;
+}
+
+pj_status_t
+Recording::Track::putFrame(pjmedia_port* port, const pjmedia_frame* frame)
+{
+  Track* track = reinterpret_cast<Track*>(port->port_data.pdata);
+
+  unsigned active = track->_active;
+  if (track->_used[active] == track->_bufferFrames) {
+    if (track->_full[1 - active]) {
+      track->_overruns++;
+      return PJ_SUCCESS;
+    }
+    __sync_synchronize();
+    track->_full[active] = true;
+    active = track->_active = 1 - active;
+  }
+
+  char* target = track->_buffers[active] + track->_used[active] * track->_frameSize;
+  if (frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size == track->_frameSize) {
+    memcpy(target, frame->buf, track->_frameSize);
+  } else {
+    memset(target, 0, track->_frameSize);
+  }
+  track->_used[active]++;
+  return PJ_SUCCESS;
+}
+
+pj_status_t
+Recording::Track::getFrame(pjmedia_port* port, pjmedia_frame* frame)
+{
+  frame->type = PJMEDIA_FRAME_TYPE_NONE;
+  frame->size = 0;
+  return PJ_SUCCESS;
+}
+
+Recording::Recording(uint32_t id, Dispatch dispatch, pjsua_call_id callId, const string& path,
+                     const Options& options)
+  : _id(id),
+    _dispatch(dispatch),
+    _callId(callId),
+    _options(options),
+    _clockRate(pjmedia_conf_get_clock_rate(pjsua_var.mconf)),
+    _channelCount(pjmedia_conf_get_channel_count(pjsua_var.mconf)),
+    _trackCount(options.splitChannels ? 2 : 1),
+    _detached(false)
+{
+  size_t slash = path.rfind('/');
+  size_t dot = path.rfind('.');
+  if (dot != string::npos && (slash == string::npos || dot > slash)) {
+    _stem = path.substr(0, dot);
+    _extension = path.substr(dot);
+  } else {
+    _stem = path;
+    _extension = (options.format == WAV) ? ".wav" : ".raw";
+  }
+
+  const uint64_t bytesPerSecond = (uint64_t) _clockRate * _channelCount * 2;
+  _fileLimit = 0;
+  if (options.maxDuration > 0) {
+    _fileLimit = (uint64_t) (options.maxDuration * bytesPerSecond);
+  }
+  if (options.maxBytes) {
+    if (options.maxBytes <= 44) {
+      throw JSException("max_size must be larger than 44 bytes");
+    }
+    uint64_t maxData = options.maxBytes - ((options.format == WAV) ? 44 : 0);
+    _fileLimit = _fileLimit ? min(_fileLimit, maxData) : maxData;
+  }
+
+  // Never split a file within a sample
+  const unsigned sampleSize = _channelCount * 2;
+  if (_fileLimit) {
+    _fileLimit -= _fileLimit % sampleSize;
+    if (!_fileLimit) {
+      throw JSException("max_duration is shorter than one sample");
+    }
+  }
+
+  const size_t frameSize = pjmedia_conf_get_samples_per_frame(pjsua_var.mconf) * 2;
+  const size_t bufferFrames = max((size_t) 1, (size_t) (options.bufferDuration * bytesPerSecond / frameSize));
+  _tracks[0].initialize(this, options.splitChannels ? "-rx" : "", frameSize, bufferFrames);
+  if (options.splitChannels) {
+    _tracks[1].initialize(this, "-tx", frameSize, bufferFrames);
+  }
+}
+
+Recording::~Recording()
+{
+  close();
+}
+
+void
+Recording::attach()
+{
+  pjsua_call_info info;
+  pj_status_t status = pjsua_call_get_info(_callId, &info);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error getting call info", status);
+  }
+  if (info.conf_slot == PJSUA_INVALID_ID) {
+    throw JSException("Call has no active media");
+  }
+
+  for (unsigned i = 0; i < _trackCount; i++) {
+    Track& track = _tracks[i];
+    track._pool = pjsua_pool_create("recorder", 512, 512);
+    status = pjsua_conf_add_port(track._pool, &track._port, &track._slot);
+    if (status != PJ_SUCCESS) {
+      track._slot = PJSUA_INVALID_ID;
+      throw PJJSException("Error adding recorder port to the conference bridge", status);
+    }
+  }
+
+  // The call's audio goes to the first track
+  status = pjsua_conf_connect(info.conf_slot, _tracks[0]._slot);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error connecting recorder port", status);
+  }
+
+  // The ports that transmit to the call go to the last track
+  Track& txTrack = _tracks[_trackCount - 1];
+  pjsua_conf_port_id ports[PJSUA_MAX_CONF_PORTS];
+  unsigned count = PJSUA_MAX_CONF_PORTS;
+  pjsua_enum_conf_ports(ports, &count);
+  for (unsigned i = 0; i < count; i++) {
+    pjsua_conf_port_info portInfo;
+    if (ports[i] == info.conf_slot || pjsua_conf_get_port_info(ports[i], &portInfo) != PJ_SUCCESS) {
+      continue;
+    }
+    for (unsigned j = 0; j < portInfo.listener_cnt; j++) {
+      if (portInfo.listeners[j] == info.conf_slot) {
+        pjsua_conf_connect(ports[i], txTrack._slot);
+        break;
+      }
+    }
+  }
+}
+
+void
+Recording::detach()
+{
+  // The bridge calls no port callbacks after the port has been removed
+  for (unsigned i = 0; i < _trackCount; i++) {
+    if (_tracks[i]._slot != PJSUA_INVALID_ID) {
+      pjsua_conf_remove_port(_tracks[i]._slot);
+      _tracks[i]._slot = PJSUA_INVALID_ID;
+    }
+  }
+  __sync_synchronize();
+  _detached = true;
+}
+
+uint64_t
+Recording::overruns() const
+{
+  return _tracks[0]._overruns + _tracks[1]._overruns;
+}
+
+static void
+writeWavHeader(FILE* file, unsigned clockRate, unsigned channelCount, uint32_t dataBytes)
+{
+  struct {
+    char riff[4];
+    uint32_t riffSize;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmtSize;
+    uint16_t formatTag;
+    uint16_t channels;
+    uint32_t sampleRate;
+    uint32_t byteRate;
+    uint16_t blockAlign;
+    uint16_t bitsPerSample;
+    char data[4];
+    uint32_t dataSize;
+  } __attribute__((packed)) header = {
+    { 'R', 'I', 'F', 'F' }, 36 + dataBytes, { 'W', 'A', 'V', 'E' },
+    { 'f', 'm', 't', ' ' }, 16, 1, (uint16_t) channelCount, clockRate, clockRate * channelCount * 2,
+    (uint16_t) (channelCount * 2), 16,
+    { 'd', 'a', 't', 'a' }, dataBytes
+  };
+  fwrite(&header, sizeof header, 1, file);
+}
+
+void
+Recording::openFile(Track& track)
+{
+  char index[16] = "";
+  if (track._fileIndex) {
+    snprintf(index, sizeof index, ".%u", track._fileIndex);
+  }
+  track._path = _stem + track._suffix + index + _extension;
+  track._fileIndex++;
+  track._fileBytes = 0;
+
+  track._file = fopen(track._path.c_str(), "w");
+  if (!track._file) {
+    __sync_fetch_and_add(&recordingOpenErrors, 1);
+    return;
+  }
+  if (_options.format == WAV) {
+    writeWavHeader(track._file, _clockRate, _channelCount, 0);
+  }
+}
+
+void
+Recording::closeFile(Track& track, bool last)
+{
+  if (track._file) {
+    if (_options.format == WAV) {
+      fseek(track._file, 0, SEEK_SET);
+      writeWavHeader(track._file, _clockRate, _channelCount, (uint32_t) track._fileBytes);
+    }
+    fclose(track._file);
+    track._file = 0;
+    _dispatch(new PJSUARecordingFileEvent(_id, track._path, track._fileBytes, last));
+  }
+}
+
+// Write data to the track's files, rolling them at the size limit
+void
+Recording::writeBuffer(Track& track, const char* data, size_t length)
+{
+  while (length) {
+    if (!track._file) {
+      openFile(track);
+      if (!track._file) {
+        return;
+      }
+    }
+    size_t chunk = length;
+    if (_fileLimit) {
+      chunk = min((uint64_t) chunk, _fileLimit - track._fileBytes);
+    }
+    fwrite(data, 1, chunk, track._file);
+    track._fileBytes += chunk;
+    data += chunk;
+    length -= chunk;
+    if (_fileLimit && track._fileBytes >= _fileLimit) {
+      closeFile(track, false);
+    }
+  }
+}
+
+size_t
+Recording::write()
+{
+  const bool detached = _detached;
+  __sync_synchronize();
+
+  size_t written = 0;
+  for (unsigned i = 0; i < _trackCount; i++) {
+    Track& track = _tracks[i];
+    // At most the inactive buffer is full, and it holds older frames
+    // than the active one
+    unsigned inactive = 1 - track._active;
+    if (track._full[inactive]) {
+      size_t length = track._used[inactive] * track._frameSize;
+      writeBuffer(track, track._buffers[inactive], length);
+      written += length;
+      track._used[inactive] = 0;
+      __sync_synchronize();
+      track._full[inactive] = false;
+    }
+    if (detached) {
+      size_t length = track._used[track._active] * track._frameSize;
+      writeBuffer(track, track._buffers[track._active], length);
+      written += length;
+      track._used[track._active] = 0;
+    }
+  }
+  return written;
+}
+
+void
+Recording::close()
+{
+  for (unsigned i = 0; i < _trackCount; i++) {
+    closeFile(_tracks[i], true);
+  }
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// The RecordingWriter owns all recordings and the thread that writes
+// them.  Recordings are created and detached from Node's thread and
+// from the PJSIP thread that reports the disconnection of a call.
+
+class RecordingWriter
+{
+public:
+  RecordingWriter()
+    : _running(false),
+      _nextId(1),
+      _bytesWritten(0)
+  {}
+
+  // Creates and attaches the recording, returns its ID
+  uint32_t start(Recording::Dispatch dispatch, pjsua_call_id callId, const string& path,
+                 const Recording::Options& options);
+
+  // Returns false if the recording is unknown or already stopped
+  bool stop(uint32_t id);
+
+  // Stop the recordings of the call if it has been disconnected
+  void callState(pjsua_call_id callId);
+
+  Handle<Object> getStats();
+
+private:
+  static void* run(void* arg);
+
+  mutex _mutex;                                             // protects _recordings
+  vector<Recording*> _recordings;
+  bool _running;
+  pthread_t _thread;
+  pj_thread_desc _threadDesc;
+  uint32_t _nextId;
+  volatile uint64_t _bytesWritten;
+};
+
+static RecordingWriter recordingWriter;
+
+uint32_t
+RecordingWriter::start(Recording::Dispatch dispatch, pjsua_call_id callId, const string& path,
+                       const Recording::Options& options)
+{
+  if (!_running) {
+    if (pthread_create(&_thread, 0, run, this)) {
+      throw JSException("Could not start recording writer thread");
+    }
+    _running = true;
+  }
+
+  uint32_t id;
+  {
+    unique_lock<mutex> lock(_mutex);
+    id = _nextId++;
+  }
+
+  Recording* recording = new Recording(id, dispatch, callId, path, options);
+  try {
+    recording->attach();
+  }
+  catch (...) {
+    recording->detach();
+    delete recording;
+    throw;
+  }
+
+  unique_lock<mutex> lock(_mutex);
+  _recordings.push_back(recording);
+  return id;
+}
+
+bool
+RecordingWriter::stop(uint32_t id)
+{
+  unique_lock<mutex> lock(_mutex);
+  for (vector<Recording*>::iterator i = _recordings.begin(); i != _recordings.end(); i++) {
+    if ((*i)->id() == id && !(*i)->detached()) {
+      (*i)->detach();
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+RecordingWriter::callState(pjsua_call_id callId)
+{
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_recordings.empty()) {
+      return;
+    }
+  }
+
+  pjsua_call_info info;
+  if (pjsua_call_get_info(callId, &info) != PJ_SUCCESS || info.state != PJSIP_INV_STATE_DISCONNECTED) {
+    return;
+  }
+
+  unique_lock<mutex> lock(_mutex);
+  for (vector<Recording*>::iterator i = _recordings.begin(); i != _recordings.end(); i++) {
+    if ((*i)->callId() == callId && !(*i)->detached()) {
+      (*i)->detach();
+    }
+  }
+}
+
+void*
+RecordingWriter::run(void* arg)
+{
+  RecordingWriter* writer = (RecordingWriter*) arg;
+
+  // Deleting a recording releases its pools
+  pj_thread_t* thread;
+  pj_bzero(writer->_threadDesc, sizeof writer->_threadDesc);
+  if (pj_thread_register("recorder", writer->_threadDesc, &thread) != PJ_SUCCESS) {
+    cerr << "could not register recording writer thread with PJLIB" << endl;
+    abort();
+  }
+
+  for (;;) {
+    vector<Recording*> recordings;
+    {
+      unique_lock<mutex> lock(writer->_mutex);
+      recordings = writer->_recordings;
+    }
+
+    // Recordings are only deleted by this thread
+    for (vector<Recording*>::iterator i = recordings.begin(); i != recordings.end(); i++) {
+      bool detached = (*i)->detached();
+      writer->_bytesWritten += (*i)->write();
+      if (detached) {
+        {
+          unique_lock<mutex> lock(writer->_mutex);
+          writer->_recordings.erase(find(writer->_recordings.begin(), writer->_recordings.end(), *i));
+        }
+        delete *i;
+      }
+    }
+
+    usleep(20000);
+  }
+
+  return 0;
+}
+
+Handle<Object>
+RecordingWriter::getStats()
+{
+  HandleScope scope;
+  double overruns = 0;
+  unsigned active = 0;
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (vector<Recording*>::const_iterator i = _recordings.begin(); i != _recordings.end(); i++) {
+      overruns += (*i)->overruns();
+      active++;
+    }
+  }
+  Local<Object> stats = Object::New();
+  setKey(stats, "active", active);
+  setKey(stats, "overruns", overruns);
+  setKey(stats, "bytes_written", (double) _bytesWritten);
+  setKey(stats, "open_errors", (double) recordingOpenErrors);
+  return scope.Close(stats);
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// Prompts are loaded once by loadPrompt(), converted to the clock rate
+// and channel count of the conference bridge and kept in memory.  They
+// are played by a pool of player ports that stay in the bridge and
+// read the shared samples without copying them.  playPrompt()
+// connects an idle player to the call's slot.  When a player reaches
+// the end of its prompt, the clock thread only marks it finished; a
+// timer in Node's thread disconnects it, returns it to the pool and
+// delivers a prompt_done event.  The timer also ends the playbacks of
+// calls that on_call_state has seen disconnected, including looped
+// playbacks.
+
+class PJSUAPromptDoneEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUAPromptDoneEvent(uint32_t playbackId, pjsua_call_id callId, const string& promptId, const char* reason)
+    : _playbackId(playbackId),
+      _callId(callId),
+      _promptId(promptId),
+      _reason(reason)
+  {}
+  virtual const char* eventName() const { return "prompt_done"; }
+  virtual int orderingKey() const { return _callId; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = Integer::NewFromUnsigned(_playbackId);
+    argv[1] = Integer::New(_callId);
+    argv[2] = String::New(_promptId.c_str(), _promptId.length());
+    argv[3] = String::NewSymbol(_reason);
+    return 4;
+  }
+
+private:
+  uint32_t _playbackId;
+  pjsua_call_id _callId;
+  const string _promptId;
+  const char* _reason;
+};
+
+class PromptCache
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  PromptCache();
+
+  // Load a 16 bit PCM WAV file, returns its duration in seconds
+  double load(const string& promptId, const string& path);
+  // Returns false if the prompt is not loaded
+  bool unload(const string& promptId);
+
+  // Returns the playback ID
+  uint32_t play(Dispatch dispatch, pjsua_call_id callId, const string& promptId, bool loop);
+  // Returns false if the playback has already ended
+  bool stop(uint32_t playbackId);
+
+  Handle<Object> getStats() const;
+
+private:
+  struct Prompt
+  {
+    string id;
+    vector<int16_t> samples;
+    unsigned users;                                         // players using the prompt
+    bool unloaded;
+  };
+
+  class Player
+  {
+  public:
+    enum State { IDLE, PLAYING, FINISHED };
+
+    Player();
+
+    void initialize(unsigned clockRate, unsigned channelCount, unsigned samplesPerFrame);
+
+    static pj_status_t getFrame(pjmedia_port* port, pjmedia_frame* frame);
+    static pj_status_t putFrame(pjmedia_port* port, const pjmedia_frame* frame);
+
+    pjmedia_port _port;
+    pj_pool_t* _pool;
+    pjsua_conf_port_id _slot;
+
+    volatile State _state;
+    Prompt* _prompt;
+    size_t _position;                                       // next sample, used by the clock thread
+    bool _loop;
+
+    uint32_t _playbackId;
+    pjsua_call_id _callId;
+    uint32_t _callGeneration;
+    pjsua_conf_port_id _callSlot;
+  };
+
+  static vector<int16_t> resample(const vector<int16_t>& input, unsigned rateIn, unsigned rateOut);
+
+  Player* idlePlayer();
+  void finish(Player* player, const char* reason);
+  void release(Prompt* prompt);
+
+  static void timerCallback(EV_P_ ev_timer* w, int revents);
+  void reap();
+
+  Dispatch _dispatch;
+  map<string, Prompt*> _prompts;
+  vector<Player*> _players;
+  unsigned _playing;
+  uint32_t _nextPlaybackId;
+  size_t _cachedBytes;
+  ev_timer _timer;
+};
+
+PromptCache::Player::Player()
+  : _pool(0),
+    _slot(PJSUA_INVALID_ID),
+    _state(IDLE),
+    _prompt(0),
+    _position(0),
+    _loop(false),
+    _playbackId(0),
+    _callId(PJSUA_INVALID_ID),
+    _callGeneration(0),
+    _callSlot(PJSUA_INVALID_ID)
+{}
+
+void
+PromptCache::Player::initialize(unsigned clockRate, unsigned channelCount, unsigned samplesPerFrame)
+{
+  pj_str_t name = pj_str((char*) "prompt");
+  pj_bzero(&_port, sizeof _port);
+  pjmedia_port_info_init(&_port.info, &name, PJMEDIA_PORT_SIGNATURE('P', 'R', 'M', 'P'),
+                         clockRate, channelCount, 16, samplesPerFrame);
+  _port.port_data.pdata = this;
+  _port.put_frame = putFrame;
+  _port.get_frame = getFrame;
+
+  _pool = pjsua_pool_create("prompt", 512, 512);
+  pj_status_t status = pjsua_conf_add_port(_pool, &_port, &_slot);
+  if (status != PJ_SUCCESS) {
+    pj_pool_release(_pool);
+    _pool = 0;
+    throw PJJSException("Error adding prompt player to the conference bridge", status);
+  }
+}
+
+pj_status_t
+PromptCache::Player::getFrame(pjmedia_port* port, pjmedia_frame* frame)
+{
+  Player* player = reinterpret_cast<Player*>(port->port_data.pdata);
+
+  if (player->_state != PLAYING) {
+    frame->type = PJMEDIA_FRAME_TYPE_NONE;
+    frame->size = 0;
+    return PJ_SUCCESS;
+  }
+
+  const vector<int16_t>& samples = player->_prompt->samples;
+  const size_t count = port->info.samples_per_frame;
+  int16_t* target = (int16_t*) frame->buf;
+  size_t filled = 0;
+  while (filled < count) {
+    if (player->_position == samples.size()) {
+      if (!player->_loop || samples.empty()) {
+        break;
+      }
+      player->_position = 0;
+    }
+    size_t chunk = min(count - filled, samples.size() - player->_position);
+    memcpy(target + filled, &samples[player->_position], chunk * sizeof(int16_t));
+    filled += chunk;
+    player->_position += chunk;
+  }
+  if (filled < count) {
+    memset(target + filled, 0, (count - filled) * sizeof(int16_t));
+    player->_state = FINISHED;
+  }
+
+  frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+  frame->size = count * sizeof(int16_t);
+  return PJ_SUCCESS;
+}
+
+pj_status_t
+PromptCache::Player::putFrame(pjmedia_port* port, const pjmedia_frame* frame)
+{
+  return PJ_SUCCESS;
+}
+
+PromptCache::PromptCache()
+  : _dispatch(0),
+    _playing(0),
+    _nextPlaybackId(1),
+    _cachedBytes(0)
+{
+  ev_init(&_timer, timerCallback);
+  _timer.data = this;
+}
+
+static uint32_t
+readLittleEndian(const unsigned char* data, unsigned size)
+{
+  uint32_t value = 0;
+  for (unsigned i = size; i > 0; i--) {
+    value = (value << 8) | data[i - 1];
+  }
+  return value;
+}
+
+static unsigned
+greatestCommonDivisor(unsigned a, unsigned b)
+{
+  while (b) {
+    unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Resample mono samples with PJMEDIA's filtering resampler.  The
+// resampler works on frames whose input and output lengths are both
+// whole numbers of samples, the last frame is padded with silence.
+vector<int16_t>
+PromptCache::resample(const vector<int16_t>& input, unsigned rateIn, unsigned rateOut)
+{
+  if (rateIn == rateOut) {
+    return input;
+  }
+
+  const unsigned divisor = greatestCommonDivisor(rateIn, rateOut);
+  unsigned frameIn = rateIn / divisor;
+  unsigned frameOut = rateOut / divisor;
+  // Process at least 10 ms per frame
+  const unsigned multiple = max(1u, (rateIn / 100 + frameIn - 1) / frameIn);
+  frameIn *= multiple;
+  frameOut *= multiple;
+
+  pj_pool_t* pool = pjsua_pool_create("resample", 4096, 4096);
+  pjmedia_resample* resampler;
+  pj_status_t status = pjmedia_resample_create(pool, PJ_TRUE, PJ_TRUE, 1, rateIn, rateOut, frameIn, &resampler);
+  if (status != PJ_SUCCESS) {
+    pj_pool_release(pool);
+    throw PJJSException("Error creating resampler", status);
+  }
+
+  const size_t frameCount = (input.size() + frameIn - 1) / frameIn;
+  vector<int16_t> in(frameIn);
+  vector<int16_t> output(frameCount * frameOut);
+  for (size_t i = 0; i < frameCount; i++) {
+    size_t offset = i * frameIn;
+    size_t length = min((size_t) frameIn, input.size() - offset);
+    copy(input.begin() + offset, input.begin() + offset + length, in.begin());
+    fill(in.begin() + length, in.end(), 0);
+    pjmedia_resample_run(resampler, &in[0], &output[i * frameOut]);
+  }
+  pjmedia_resample_destroy(resampler);
+  pj_pool_release(pool);
+
+  output.resize((size_t) ((double) input.size() * rateOut / rateIn));
+  return output;
+}
+
+double
+PromptCache::load(const string& promptId, const string& path)
+{
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    throw JSException("Could not open prompt file " + path + ": " + strerror(errno));
+  }
+  vector<unsigned char> contents;
+  unsigned char block[65536];
+  size_t length;
+  while ((length = fread(block, 1, sizeof block, file)) > 0) {
+    contents.insert(contents.end(), block, block + length);
+  }
+  fclose(file);
+
+  if (contents.size() < 12 || memcmp(&contents[0], "RIFF", 4) || memcmp(&contents[8], "WAVE", 4)) {
+    throw JSException("Prompt file " + path + " is not a WAV file");
+  }
+
+  // Find the format and data chunks
+  unsigned formatTag = 0;
+  unsigned channels = 0;
+  unsigned sampleRate = 0;
+  unsigned bitsPerSample = 0;
+  const unsigned char* data = 0;
+  size_t dataLength = 0;
+  size_t offset = 12;
+  while (offset + 8 <= contents.size()) {
+    const unsigned char* chunk = &contents[offset];
+    size_t chunkLength = min((size_t) readLittleEndian(chunk + 4, 4), contents.size() - offset - 8);
+    if (!memcmp(chunk, "fmt ", 4) && chunkLength >= 16) {
+      formatTag = readLittleEndian(chunk + 8, 2);
+      channels = readLittleEndian(chunk + 10, 2);
+      sampleRate = readLittleEndian(chunk + 12, 4);
+      bitsPerSample = readLittleEndian(chunk + 22, 2);
+    } else if (!memcmp(chunk, "data", 4)) {
+      data = chunk + 8;
+      dataLength = chunkLength;
+    }
+    offset += 8 + chunkLength + (chunkLength & 1);
+  }
+  if (formatTag != 1 || bitsPerSample != 16 || !channels || !sampleRate || !data) {
+    throw JSException("Prompt file " + path + " is not 16 bit PCM");
+  }
+
+  // Mix down to mono
+  const size_t frames = dataLength / (2 * channels);
+  vector<int16_t> mono(frames);
+  for (size_t i = 0; i < frames; i++) {
+    int sum = 0;
+    for (unsigned channel = 0; channel < channels; channel++) {
+      sum += (int16_t) readLittleEndian(data + (i * channels + channel) * 2, 2);
+    }
+    mono[i] = sum / (int) channels;
+  }
+
+  const unsigned clockRate = pjmedia_conf_get_clock_rate(pjsua_var.mconf);
+  const unsigned channelCount = pjmedia_conf_get_channel_count(pjsua_var.mconf);
+  const vector<int16_t> resampled = resample(mono, sampleRate, clockRate);
+  const size_t outputFrames = resampled.size();
+
+  Prompt* prompt = new Prompt;
+  prompt->id = promptId;
+  prompt->users = 0;
+  prompt->unloaded = false;
+  prompt->samples.resize(outputFrames * channelCount);
+  for (size_t i = 0; i < outputFrames; i++) {
+    for (unsigned channel = 0; channel < channelCount; channel++) {
+      prompt->samples[i * channelCount + channel] = resampled[i];
+    }
+  }
+
+  unload(promptId);
+  _prompts[promptId] = prompt;
+  _cachedBytes += prompt->samples.size() * sizeof(int16_t);
+
+  return (double) outputFrames / clockRate;
+}
+
+// Prompts that are being played are freed when the last player has
+// finished
+bool
+PromptCache::unload(const string& promptId)
+{
+  map<string, Prompt*>::iterator i = _prompts.find(promptId);
+  if (i == _prompts.end()) {
+    return false;
+  }
+  Prompt* prompt = i->second;
+  _prompts.erase(i);
+  prompt->unloaded = true;
+  if (!prompt->users) {
+    release(prompt);
+  }
+  return true;
+}
+
+void
+PromptCache::release(Prompt* prompt)
+{
+  _cachedBytes -= prompt->samples.size() * sizeof(int16_t);
+  delete prompt;
+}
+
+PromptCache::Player*
+PromptCache::idlePlayer()
+{
+  for (vector<Player*>::iterator i = _players.begin(); i != _players.end(); i++) {
+    if ((*i)->_state == Player::IDLE && !(*i)->_prompt) {
+      return *i;
+    }
+  }
+
+  Player* player = new Player;
+  try {
+    player->initialize(pjmedia_conf_get_clock_rate(pjsua_var.mconf),
+                       pjmedia_conf_get_channel_count(pjsua_var.mconf),
+                       pjmedia_conf_get_samples_per_frame(pjsua_var.mconf));
+  }
+  catch (...) {
+    delete player;
+    throw;
+  }
+  _players.push_back(player);
+  return player;
+}
+
+uint32_t
+PromptCache::play(Dispatch dispatch, pjsua_call_id callId, const string& promptId, bool loop)
+{
+  _dispatch = dispatch;
+
+  map<string, Prompt*>::iterator i = _prompts.find(promptId);
+  if (i == _prompts.end()) {
+    throw JSException("Unknown prompt " + promptId);
+  }
+  if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    throw JSException("Invalid call ID");
+  }
+  uint32_t callGeneration = callGenerations.get(callId);
+  pjsua_conf_port_id callSlot = pjsua_call_get_conf_port(callId);
+  if (callSlot == PJSUA_INVALID_ID) {
+    throw JSException("Call has no active media");
+  }
+
+  Player* player = idlePlayer();
+  player->_prompt = i->second;
+  player->_prompt->users++;
+  player->_position = 0;
+  player->_loop = loop;
+  player->_playbackId = _nextPlaybackId++;
+  player->_callId = callId;
+  player->_callGeneration = callGeneration;
+  player->_callSlot = callSlot;
+  __sync_synchronize();
+  player->_state = Player::PLAYING;
+
+  pj_status_t status = pjsua_conf_connect(player->_slot, callSlot);
+  if (status != PJ_SUCCESS) {
+    player->_state = Player::IDLE;
+    player->_prompt->users--;
+    player->_prompt = 0;
+    throw PJJSException("Error connecting prompt player", status);
+  }
+
+  if (!_playing++) {
+    ev_timer_set(&_timer, 0.02, 0.02);
+    ev_timer_start(EV_DEFAULT_UC_ &_timer);
+  }
+  return player->_playbackId;
+}
+
+// Return the player to the pool
+void
+PromptCache::finish(Player* player, const char* reason)
+{
+  player->_state = Player::IDLE;
+  __sync_synchronize();
+  // Disconnecting waits for the current clock tick, after which the
+  // player's prompt is no longer accessed
+  pjsua_conf_disconnect(player->_slot, player->_callSlot);
+
+  Prompt* prompt = player->_prompt;
+  string promptId = prompt->id;
+  player->_prompt = 0;
+  if (!--prompt->users && prompt->unloaded) {
+    release(prompt);
+  }
+
+  _dispatch(new PJSUAPromptDoneEvent(player->_playbackId, player->_callId, promptId, reason));
+
+  if (!--_playing) {
+    ev_timer_stop(EV_DEFAULT_UC_ &_timer);
+  }
+}
+
+bool
+PromptCache::stop(uint32_t playbackId)
+{
+  for (vector<Player*>::iterator i = _players.begin(); i != _players.end(); i++) {
+    if ((*i)->_prompt && (*i)->_playbackId == playbackId) {
+      finish(*i, "stopped");
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return the players that have finished or whose call has ended.
+// The prompt_done callback may add players to the pool.
+void
+PromptCache::reap()
+{
+  for (size_t i = 0; i < _players.size(); i++) {
+    Player* player = _players[i];
+    if (!player->_prompt) {
+      continue;
+    }
+    if (player->_state == Player::FINISHED) {
+      finish(player, "completed");
+    } else if (callGenerations.ended(player->_callId, player->_callGeneration)) {
+      finish(player, "hangup");
+    }
+  }
+}
+
+void
+PromptCache::timerCallback(EV_P_ ev_timer* w, int revents)
+{
+  reinterpret_cast<PromptCache*>(w->data)->reap();
+}
+
+Handle<Object>
+PromptCache::getStats() const
+{
+  HandleScope scope;
+  Local<Object> stats = Object::New();
+  setKey(stats, "cached", (unsigned) _prompts.size());
+  setKey(stats, "cached_bytes", (double) _cachedBytes);
+  setKey(stats, "players", (unsigned) _players.size());
+  setKey(stats, "playing", _playing);
+  return scope.Close(stats);
+}
+
+static PromptCache promptCache;
+
+// //////////////////////////////////////////////////////////////////////
+
+// A DigitMap matches collected DTMF digits against alternatives in
+// the MGCP digit map syntax, e.g. "0|[1-8]xx|9x.T": x is any digit
+// 0-9, [...] a set of digits and ranges, . repeats the previous
+// element zero or more times, and a trailing T means that the
+// alternative only matches when the inter-digit timeout has expired.
+
+class DigitMap
+{
+public:
+  enum Result { NO_MATCH, PARTIAL, MATCH };
+
+  // Throws a JSException on syntax errors
+  void compile(const string& map);
+
+  bool empty() const { return _alternatives.empty(); }
+
+  // timedOut is set when the inter-digit timeout has expired.
+  // PARTIAL means that more digits may still produce a match.
+  Result match(const string& digits, bool timedOut) const;
+
+private:
+  struct Element
+  {
+    uint16_t digits;                                        // bit set of digitIndex() values
+    bool repeat;
+  };
+
+  struct Alternative
+  {
+    vector<Element> elements;
+    bool needsTimeout;
+  };
+
+  static int digitIndex(char digit);
+
+  vector<Alternative> _alternatives;
+};
+
+// 0-9, *, #, A-D
+int
+DigitMap::digitIndex(char digit)
+{
+  if (digit >= '0' && digit <= '9') {
+    return digit - '0';
+  }
+  switch (toupper(digit)) {
+  case '*': return 10;
+  case '#': return 11;
+  case 'A': return 12;
+  case 'B': return 13;
+  case 'C': return 14;
+  case 'D': return 15;
+  default: return -1;
+  }
+}
+
+void
+DigitMap::compile(const string& map)
+{
+  _alternatives.clear();
+  Alternative alternative;
+  alternative.needsTimeout = false;
+
+  for (size_t i = 0; i <= map.length(); i++) {
+    char c = (i < map.length()) ? map[i] : '|';
+    if (c == '|') {
+      if (alternative.elements.empty()) {
+        throw JSException("Empty alternative in digit map " + map);
+      }
+      _alternatives.push_back(alternative);
+      alternative.elements.clear();
+      alternative.needsTimeout = false;
+    } else if (alternative.needsTimeout) {
+      throw JSException("T must end an alternative in digit map " + map);
+    } else if (c == 'T' || c == 't') {
+      alternative.needsTimeout = true;
+    } else if (c == '.') {
+      if (alternative.elements.empty() || alternative.elements.back().repeat) {
+        throw JSException("Misplaced . in digit map " + map);
+      }
+      alternative.elements.back().repeat = true;
+    } else {
+      Element element;
+      element.repeat = false;
+      element.digits = 0;
+      if (c == 'x' || c == 'X') {
+        element.digits = 0x3ff;
+      } else if (c == '[') {
+        size_t end = map.find(']', i);
+        if (end == string::npos) {
+          throw JSException("Unterminated [ in digit map " + map);
+        }
+        for (size_t j = i + 1; j < end; j++) {
+          if (j + 2 < end && map[j + 1] == '-' && isdigit(map[j]) && isdigit(map[j + 2])) {
+            for (char digit = map[j]; digit <= map[j + 2]; digit++) {
+              element.digits |= 1 << digitIndex(digit);
+            }
+            j += 2;
+          } else if (digitIndex(map[j]) >= 0) {
+            element.digits |= 1 << digitIndex(map[j]);
+          } else {
+            throw JSException("Invalid digit in digit map " + map);
+          }
+        }
+        i = end;
+      } else if (digitIndex(c) >= 0) {
+        element.digits = 1 << digitIndex(c);
+      } else {
+        throw JSException("Invalid character in digit map " + map);
+      }
+      alternative.elements.push_back(element);
+    }
+  }
+
+  for (vector<Alternative>::const_iterator i = _alternatives.begin(); i != _alternatives.end(); i++) {
+    if (i->elements.size() >= 64) {
+      throw JSException("Digit map alternative too long: " + map);
+    }
+  }
+}
+
+// Each alternative is matched by tracking the set of element positions
+// that the digits so far can lead to
+DigitMap::Result
+DigitMap::match(const string& digits, bool timedOut) const
+{
+  bool partial = false;
+  bool matched = false;
+
+  for (vector<Alternative>::const_iterator alternative = _alternatives.begin();
+       alternative != _alternatives.end();
+       alternative++) {
+    const vector<Element>& elements = alternative->elements;
+    const size_t count = elements.size();
+
+    // Positions reachable by skipping repeated elements
+    uint64_t positions = 1;
+    for (size_t p = 0; p < count && (positions & (1ULL << p)) && elements[p].repeat; p++) {
+      positions |= 1ULL << (p + 1);
+    }
+
+    for (size_t i = 0; i < digits.length() && positions; i++) {
+      int index = digitIndex(digits[i]);
+      uint64_t next = 0;
+      for (size_t p = 0; p < count; p++) {
+        if ((positions & (1ULL << p)) && index >= 0 && (elements[p].digits & (1 << index))) {
+          next |= 1ULL << (elements[p].repeat ? p : p + 1);
+        }
+      }
+      for (size_t p = 0; p < count; p++) {
+        if ((next & (1ULL << p)) && elements[p].repeat) {
+          next |= 1ULL << (p + 1);
+        }
+      }
+      positions = next;
+    }
+
+    if ((positions & (1ULL << count)) && (timedOut || !alternative->needsTimeout)) {
+      matched = true;
+    }
+    if (positions & ((1ULL << count) - 1)) {
+      partial = true;
+    }
+    if ((positions & (1ULL << count)) && alternative->needsTimeout && !timedOut) {
+      partial = true;
+    }
+  }
+
+  // A complete match is only reported when no alternative can use
+  // more digits; otherwise it is taken when the inter-digit timeout
+  // expires.
+  if (matched && (!partial || timedOut)) {
+    return MATCH;
+  }
+  return partial ? PARTIAL : NO_MATCH;
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// The DtmfCollector collects the DTMF digits of calls natively, so
+// that only the completed sequence crosses into JavaScript as one
+// dtmf_collected event.  While a collection is active for a call, no
+// dtmf_digit events are delivered for it.  A collection ends when
+// the digit map or pattern matches or cannot match anymore, when the
+// terminator is pressed, when max_digits have been entered or when
+// the inter-digit or overall timeout expires.  Timeouts run on the
+// timer heap of the SIP endpoint.
+
+class PJSUADtmfCollectedEvent
+  : public PJSUAEvent
+{
+public:
+  PJSUADtmfCollectedEvent(pjsua_call_id callId, const string& digits, const char* reason)
+    : _callId(callId),
+      _digits(digits),
+      _reason(reason)
+  {}
+  virtual const char* eventName() const { return "dtmf_collected"; }
+  virtual int orderingKey() const { return _callId; }
+  virtual int arguments(Handle<Value> argv[], SnapshotArena* arena) const
+  {
+    argv[0] = Integer::New(_callId);
+    argv[1] = String::New(_digits.c_str(), _digits.length());
+    argv[2] = String::NewSymbol(_reason);
+    return 3;
+  }
+
+private:
+  pjsua_call_id _callId;
+  const string _digits;
+  const char* _reason;
+};
+
+class DtmfCollector
+{
+public:
+  typedef void (*Dispatch)(PJSUAEvent* event);
+
+  struct Options
+  {
+    unsigned maxDigits;                                     // 0 for no limit
+    char terminator;                                        // 0 for none
+    unsigned interDigitTimeout;                             // milliseconds, 0 for none
+    unsigned timeout;                                       // milliseconds, 0 for none
+    DigitMap digitMap;
+    string pattern;                                         // POSIX extended regular expression
+  };
+
+  DtmfCollector();
+
+  // Start collecting, replacing a running collection without an event
+  void start(Dispatch dispatch, pjsua_call_id callId, const Options& options);
+  // Returns false if no collection was running
+  bool cancel(pjsua_call_id callId);
+
+  // Called from on_dtmf_digit, returns true if the digit was consumed
+  bool digit(pjsua_call_id callId, int digit);
+  // Called from on_call_state, ends the collection if the call has
+  // been disconnected
+  void callState(pjsua_call_id callId);
+
+private:
+  enum TimerKind { INTER_DIGIT_TIMER = 1, OVERALL_TIMER };
+
+  struct Collection
+  {
+    DtmfCollector* collector;
+    pjsua_call_id callId;
+    bool active;
+    Options options;
+    bool hasPattern;
+    regex_t regex;
+    string digits;
+    pj_timer_entry interDigitTimer;
+    pj_timer_entry overallTimer;
+    uint64_t interDigitDeadline;                            // monotonic nanoseconds
+    uint64_t overallDeadline;
+  };
+
+  // The following are called with _mutex locked and return the reason
+  // if the collection is complete
+  const char* evaluate(Collection& collection, bool interDigitTimedOut);
+  void schedule(pj_timer_entry& timer, unsigned milliseconds);
+  void stop(Collection& collection);
+
+  static void timerCallback(pj_timer_heap_t* heap, pj_timer_entry* entry);
+
+  Dispatch _dispatch;
+  mutex _mutex;                                             // protects the collections
+  Collection _collections[PJSUA_MAX_CALLS];
+};
+
+DtmfCollector::DtmfCollector()
+  : _dispatch(0)
+{
+  for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+    Collection& collection = _collections[i];
+    collection.collector = this;
+    collection.callId = i;
+    collection.active = false;
+    collection.hasPattern = false;
+    pj_timer_entry_init(&collection.interDigitTimer, INTER_DIGIT_TIMER, &collection, timerCallback);
+    pj_timer_entry_init(&collection.overallTimer, OVERALL_TIMER, &collection, timerCallback);
+  }
+}
+
+void
+DtmfCollector::schedule(pj_timer_entry& timer, unsigned milliseconds)
+{
+  pjsip_endpt_cancel_timer(pjsua_get_pjsip_endpt(), &timer);
+  pj_time_val delay = { milliseconds / 1000, milliseconds % 1000 };
+  pjsip_endpt_schedule_timer(pjsua_get_pjsip_endpt(), &timer, &delay);
+}
+
+void
+DtmfCollector::stop(Collection& collection)
+{
+  pjsip_endpt_cancel_timer(pjsua_get_pjsip_endpt(), &collection.interDigitTimer);
+  pjsip_endpt_cancel_timer(pjsua_get_pjsip_endpt(), &collection.overallTimer);
+  if (collection.hasPattern) {
+    regfree(&collection.regex);
+    collection.hasPattern = false;
+  }
+  collection.active = false;
+}
+
+void
+DtmfCollector::start(Dispatch dispatch, pjsua_call_id callId, const Options& options)
+{
+  _dispatch = dispatch;
+
+  unique_lock<mutex> lock(_mutex);
+  Collection& collection = _collections[callId];
+  if (collection.active) {
+    stop(collection);
+  }
+
+  if (!options.pattern.empty()) {
+    const string anchored = "^(" + options.pattern + ")$";
+    if (regcomp(&collection.regex, anchored.c_str(), REG_EXTENDED | REG_NOSUB)) {
+      throw JSException("Invalid DTMF pattern " + options.pattern);
+    }
+    collection.hasPattern = true;
+  }
+
+  collection.options = options;
+  collection.digits.clear();
+  collection.active = true;
+  collection.interDigitDeadline = 0;
+  collection.overallDeadline = 0;
+  if (options.timeout) {
+    collection.overallDeadline = monotonicNanoseconds() + options.timeout * 1000000ULL;
+    schedule(collection.overallTimer, options.timeout);
+  }
+}
+
+bool
+DtmfCollector::cancel(pjsua_call_id callId)
+{
+  unique_lock<mutex> lock(_mutex);
+  Collection& collection = _collections[callId];
+  if (!collection.active) {
+    return false;
+  }
+  stop(collection);
+  return true;
+}
+
+const char*
+DtmfCollector::evaluate(Collection& collection, bool interDigitTimedOut)
+{
+  const Options& options = collection.options;
+
+  if (!options.digitMap.empty()) {
+    switch (options.digitMap.match(collection.digits, interDigitTimedOut)) {
+    case DigitMap::MATCH:
+      return "match";
+    case DigitMap::NO_MATCH:
+      return "no_match";
+    case DigitMap::PARTIAL:
+      break;
+    }
+  }
+  if (collection.hasPattern && !regexec(&collection.regex, collection.digits.c_str(), 0, 0, 0)) {
+    return "match";
+  }
+  if (options.maxDigits && collection.digits.length() >= options.maxDigits) {
+    return "max_digits";
+  }
+  return interDigitTimedOut ? "inter_digit_timeout" : 0;
+}
+
+bool
+DtmfCollector::digit(pjsua_call_id callId, int digit)
+{
+  if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    return false;
+  }
+
+  const char* reason = 0;
+  string digits;
+  {
+    unique_lock<mutex> lock(_mutex);
+    Collection& collection = _collections[callId];
+    if (!collection.active) {
+      return false;
+    }
+
+    if (collection.options.terminator && digit == collection.options.terminator) {
+      reason = "terminator";
+    } else {
+      collection.digits += (char) digit;
+      reason = evaluate(collection, false);
+    }
+
+    if (reason) {
+      digits = collection.digits;
+      stop(collection);
+    } else if (collection.options.interDigitTimeout) {
+      collection.interDigitDeadline = monotonicNanoseconds() + collection.options.interDigitTimeout * 1000000ULL;
+      schedule(collection.interDigitTimer, collection.options.interDigitTimeout);
+    }
+  }
+
+  if (reason) {
+    _dispatch(new PJSUADtmfCollectedEvent(callId, digits, reason));
+  }
+  return true;
+}
+
+// A timer may fire while it is being rescheduled, so the deadline
+// decides whether it has expired
+void
+DtmfCollector::timerCallback(pj_timer_heap_t* heap, pj_timer_entry* entry)
+{
+  Collection& collection = *reinterpret_cast<Collection*>(entry->user_data);
+  DtmfCollector* collector = collection.collector;
+
+  const char* reason = 0;
+  string digits;
+  {
+    unique_lock<mutex> lock(collector->_mutex);
+    if (!collection.active) {
+      return;
+    }
+    const uint64_t now = monotonicNanoseconds();
+    if (entry->id == OVERALL_TIMER && collection.overallDeadline && now >= collection.overallDeadline) {
+      reason = "timeout";
+    } else if (entry->id == INTER_DIGIT_TIMER && collection.interDigitDeadline
+               && now >= collection.interDigitDeadline) {
+      reason = collector->evaluate(collection, true);
+    }
+    if (!reason) {
+      return;
+    }
+    digits = collection.digits;
+    collector->stop(collection);
+  }
+
+  collector->_dispatch(new PJSUADtmfCollectedEvent(collection.callId, digits, reason));
+}
+
+void
+DtmfCollector::callState(pjsua_call_id callId)
+{
+  if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+    return;
+  }
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (!_collections[callId].active) {
+      return;
+    }
+  }
+
+  pjsua_call_info info;
+  if (pjsua_call_get_info(callId, &info) != PJ_SUCCESS || info.state != PJSIP_INV_STATE_DISCONNECTED) {
+    return;
+  }
+
+  string digits;
+  {
+    unique_lock<mutex> lock(_mutex);
+    Collection& collection = _collections[callId];
+    if (!collection.active) {
+      return;
+    }
+    digits = collection.digits;
+    stop(collection);
+  }
+  _dispatch(new PJSUADtmfCollectedEvent(callId, digits, "hangup"));
+}
+
+static DtmfCollector dtmfCollector;
+
+// //////////////////////////////////////////////////////////////////////
+
+// The LevelMeter measures the audio that a conference slot sends into
+// the bridge (rx) and the audio that the bridge sends to it (tx).
+// Metering a slot adds two meter ports to the bridge: one receives
+// the slot's audio, the other receives the mix of the slots that
+// transmit to it.  PJMEDIA has no hook into the bridge's own mixing,
+// so the bridge mixes the sources of a metered slot a second time
+// for the tx meter, and every metered slot takes two ports of
+// max_media_ports.  The clock thread computes RMS and peak of every
+// frame received by a meter port with SSE2 and a voice activity flag,
+// and stores them in float columns indexed by slot, which JavaScript
+// reads through pjsip.levels.  Levels are relative to full scale.
+
+// Sum of squares and peak magnitude of 16 bit samples
+static void
+measureFrame(const int16_t* samples, size_t count, uint64_t& sumOfSquares, int& peak)
+{
+  uint64_t sum = 0;
+  int maximum = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  __m128i sums = _mm_setzero_si128();
+  __m128i highest = _mm_set1_epi16(-32768);
+  __m128i lowest = _mm_set1_epi16(32767);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i values = _mm_loadu_si128((const __m128i*) (samples + i));
+    // Each lane holds the sum of two squares, which fits into 32 bits
+    // when treated as unsigned
+    __m128i squares = _mm_madd_epi16(values, values);
+    sums = _mm_add_epi64(sums, _mm_unpacklo_epi32(squares, zero));
+    sums = _mm_add_epi64(sums, _mm_unpackhi_epi32(squares, zero));
+    highest = _mm_max_epi16(highest, values);
+    lowest = _mm_min_epi16(lowest, values);
+  }
+  uint64_t sumLanes[2];
+  int16_t highestLanes[8];
+  int16_t lowestLanes[8];
+  _mm_storeu_si128((__m128i*) sumLanes, sums);
+  _mm_storeu_si128((__m128i*) highestLanes, highest);
+  _mm_storeu_si128((__m128i*) lowestLanes, lowest);
+  sum = sumLanes[0] + sumLanes[1];
+  for (int lane = 0; lane < 8 && i; lane++) {
+    maximum = max(maximum, max((int) highestLanes[lane], -(int) lowestLanes[lane]));
+  }
+#endif
+
+  for (; i < count; i++) {
+    int sample = samples[i];
+    sum += sample * sample;
+    maximum = max(maximum, abs(sample));
+  }
+
+  sumOfSquares = sum;
+  peak = maximum;
+}
+
+class LevelMeter
+{
+public:
+  enum Field { RX_RMS, RX_PEAK, RX_VAD, TX_RMS, TX_PEAK, TX_VAD, FIELD_COUNT };
+
+  struct Options
+  {
+    float vadThreshold;                                     // RMS above which voice is detected
+    unsigned vadHangover;                                   // frames that voice is held after it ends
+  };
+
+  LevelMeter();
+
+  void start(pjsua_conf_port_id slot, const Options& options);
+  // Returns false if the slot was not metered
+  bool stop(pjsua_conf_port_id slot);
+
+  // Called when the topology of the bridge changes so that the tx
+  // meter of the sink follows its sources
+  void connected(pjsua_conf_port_id source, pjsua_conf_port_id sink);
+  void disconnected(pjsua_conf_port_id source, pjsua_conf_port_id sink);
+
+  // Stops metering the slot of the call when the call is disconnected
+  void callState(pjsua_call_id callId);
+
+  // Create the JavaScript object that exposes the columns
+  Handle<Object> toObject();
+
+private:
+  class Meter
+  {
+  public:
+    Meter(LevelMeter* owner, pjsua_conf_port_id slot, Field rms, const Options& options);
+    ~Meter();
+
+    static pj_status_t putFrame(pjmedia_port* port, const pjmedia_frame* frame);
+    static pj_status_t getFrame(pjmedia_port* port, pjmedia_frame* frame);
+
+    LevelMeter* _owner;
+    pjsua_conf_port_id _meteredSlot;
+    Field _rms;                                             // first of the three fields written
+    Options _options;
+    unsigned _hangover;
+    pjmedia_port _port;
+    pj_pool_t* _pool;
+    pjsua_conf_port_id _slot;
+  };
+
+  struct Entry
+  {
+    pjsua_call_id callId;                                   // call owning the slot, if any
+    Meter* rx;
+    Meter* tx;
+  };
+
+  void destroy(pjsua_conf_port_id slot, const Entry& entry);
+  pjsua_conf_port_id txMeterSlot(pjsua_conf_port_id sink);
+
+  mutex _mutex;                                             // protects _entries, never held while calling PJSUA
+  map<pjsua_conf_port_id, Entry> _entries;
+  float _columns[FIELD_COUNT][PJSUA_MAX_CONF_PORTS];
+};
+
+static const char* const levelFieldNames[LevelMeter::FIELD_COUNT] = {
+  "rx_rms", "rx_peak", "rx_vad", "tx_rms", "tx_peak", "tx_vad"
+};
+
+LevelMeter::Meter::Meter(LevelMeter* owner, pjsua_conf_port_id slot, Field rms, const Options& options)
+  : _owner(owner),
+    _meteredSlot(slot),
+    _rms(rms),
+    _options(options),
+    _hangover(0),
+    _pool(0),
+    _slot(PJSUA_INVALID_ID)
+{
+  pj_str_t name = pj_str((char*) "meter");
+  pj_bzero(&_port, sizeof _port);
+  pjmedia_port_info_init(&_port.info, &name, PJMEDIA_PORT_SIGNATURE('M', 'T', 'R', 'P'),
+                         pjmedia_conf_get_clock_rate(pjsua_var.mconf),
+                         pjmedia_conf_get_channel_count(pjsua_var.mconf), 16,
+                         pjmedia_conf_get_samples_per_frame(pjsua_var.mconf));
+  _port.port_data.pdata = this;
+  _port.put_frame = putFrame;
+  _port.get_frame = getFrame;
+
+  _pool = pjsua_pool_create("meter", 512, 512);
+  pj_status_t status = pjsua_conf_add_port(_pool, &_port, &_slot);
+  if (status != PJ_SUCCESS) {
+    pj_pool_release(_pool);
+    throw PJJSException("Error adding meter port to the conference bridge", status);
+  }
+}
+
+LevelMeter::Meter::~Meter()
+{
+  // The bridge calls no port callbacks after the port has been removed
+  pjsua_conf_remove_port(_slot);
+  pj_pool_release(_pool);
+}
+
+pj_status_t
+LevelMeter::Meter::putFrame(pjmedia_port* port, const pjmedia_frame* frame)
+{
+  Meter* meter = reinterpret_cast<Meter*>(port->port_data.pdata);
+  float (*columns)[PJSUA_MAX_CONF_PORTS] = meter->_owner->_columns;
+  const pjsua_conf_port_id slot = meter->_meteredSlot;
+
+  float rms = 0;
+  float peak = 0;
+  if (frame->type == PJMEDIA_FRAME_TYPE_AUDIO && frame->size) {
+    const size_t count = frame->size / sizeof(int16_t);
+    uint64_t sumOfSquares;
+    int maximum;
+    measureFrame((const int16_t*) frame->buf, count, sumOfSquares, maximum);
+    rms = sqrtf((float) sumOfSquares / count) / 32768.0f;
+    peak = maximum / 32768.0f;
+  }
+
+  if (rms > meter->_options.vadThreshold) {
+    meter->_hangover = meter->_options.vadHangover + 1;
+  } else if (meter->_hangover) {
+    meter->_hangover--;
+  }
+
+  columns[meter->_rms][slot] = rms;
+  columns[meter->_rms + 1][slot] = peak;
+  columns[meter->_rms + 2][slot] = meter->_hangover ? 1.0f : 0.0f;
+  return PJ_SUCCESS;
+}
+
+pj_status_t
+LevelMeter::Meter::getFrame(pjmedia_port* port, pjmedia_frame* frame)
+{
+  frame->type = PJMEDIA_FRAME_TYPE_NONE;
+  frame->size = 0;
+  return PJ_SUCCESS;
+}
+
+LevelMeter::LevelMeter()
+{
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    for (unsigned j = 0; j < PJSUA_MAX_CONF_PORTS; j++) {
+      _columns[i][j] = 0;
+    }
+  }
+}
+
+void
+LevelMeter::start(pjsua_conf_port_id slot, const Options& options)
+{
+  if (slot < 0 || slot >= (pjsua_conf_port_id) PJSUA_MAX_CONF_PORTS) {
+    throw JSException("Invalid conference slot");
+  }
+  pjsua_conf_port_info slotInfo;
+  pj_status_t status = pjsua_conf_get_port_info(slot, &slotInfo);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error getting conference port info", status);
+  }
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_entries.count(slot)) {
+      return;
+    }
+  }
+
+  // PJSUA calls on_call_state with its lock held, which then takes
+  // _mutex, so no PJSUA function may be called with _mutex locked.
+  Entry entry;
+  entry.callId = PJSUA_INVALID_ID;
+  pjsua_call_id calls[PJSUA_MAX_CALLS];
+  unsigned callCount = PJSUA_MAX_CALLS;
+  pjsua_enum_calls(calls, &callCount);
+  for (unsigned i = 0; i < callCount; i++) {
+    if (pjsua_call_get_conf_port(calls[i]) == slot) {
+      entry.callId = calls[i];
+    }
+  }
+
+  vector<pjsua_conf_port_id> sources;
+  pjsua_conf_port_id ports[PJSUA_MAX_CONF_PORTS];
+  unsigned count = PJSUA_MAX_CONF_PORTS;
+  pjsua_enum_conf_ports(ports, &count);
+  for (unsigned i = 0; i < count; i++) {
+    pjsua_conf_port_info portInfo;
+    if (pjsua_conf_get_port_info(ports[i], &portInfo) != PJ_SUCCESS) {
+      continue;
+    }
+    for (unsigned j = 0; j < portInfo.listener_cnt; j++) {
+      if (portInfo.listeners[j] == slot) {
+        sources.push_back(ports[i]);
+        break;
+      }
+    }
+  }
+
+  entry.rx = new Meter(this, slot, RX_RMS, options);
+  try {
+    entry.tx = new Meter(this, slot, TX_RMS, options);
+  }
+  catch (...) {
+    delete entry.rx;
+    throw;
+  }
+  const pjsua_conf_port_id rxSlot = entry.rx->_slot;
+  const pjsua_conf_port_id txSlot = entry.tx->_slot;
+
+  bool inserted;
+  {
+    unique_lock<mutex> lock(_mutex);
+    inserted = _entries.insert(make_pair(slot, entry)).second;
+  }
+  if (!inserted) {
+    // Started concurrently
+    delete entry.rx;
+    delete entry.tx;
+    return;
+  }
+
+  pjsua_conf_connect(slot, rxSlot);
+  for (vector<pjsua_conf_port_id>::const_iterator i = sources.begin(); i != sources.end(); i++) {
+    pjsua_conf_connect(*i, txSlot);
+  }
+}
+
+// Remove the meter ports of an entry that has been taken out of
+// _entries.  Must be called without _mutex locked.
+void
+LevelMeter::destroy(pjsua_conf_port_id slot, const Entry& entry)
+{
+  delete entry.rx;
+  delete entry.tx;
+  for (int field = 0; field < FIELD_COUNT; field++) {
+    _columns[field][slot] = 0;
+  }
+}
+
+bool
+LevelMeter::stop(pjsua_conf_port_id slot)
+{
+  Entry entry;
+  {
+    unique_lock<mutex> lock(_mutex);
+    map<pjsua_conf_port_id, Entry>::iterator i = _entries.find(slot);
+    if (i == _entries.end()) {
+      return false;
+    }
+    entry = i->second;
+    _entries.erase(i);
+  }
+  destroy(slot, entry);
+  return true;
+}
+
+// Slot of the tx meter of sink, or PJSUA_INVALID_ID
+pjsua_conf_port_id
+LevelMeter::txMeterSlot(pjsua_conf_port_id sink)
+{
+  unique_lock<mutex> lock(_mutex);
+  map<pjsua_conf_port_id, Entry>::const_iterator i = _entries.find(sink);
+  return (i != _entries.end()) ? i->second.tx->_slot : PJSUA_INVALID_ID;
+}
+
+void
+LevelMeter::connected(pjsua_conf_port_id source, pjsua_conf_port_id sink)
+{
+  pjsua_conf_port_id txSlot = txMeterSlot(sink);
+  if (txSlot != PJSUA_INVALID_ID) {
+    pjsua_conf_connect(source, txSlot);
+  }
+}
+
+void
+LevelMeter::disconnected(pjsua_conf_port_id source, pjsua_conf_port_id sink)
+{
+  pjsua_conf_port_id txSlot = txMeterSlot(sink);
+  if (txSlot != PJSUA_INVALID_ID) {
+    pjsua_conf_disconnect(source, txSlot);
+  }
+}
+
+void
+LevelMeter::callState(pjsua_call_id callId)
+{
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_entries.empty()) {
+      return;
+    }
+  }
+
+  pjsua_call_info info;
+  if (pjsua_call_get_info(callId, &info) != PJ_SUCCESS || info.state != PJSIP_INV_STATE_DISCONNECTED) {
+    return;
+  }
+
+  // The call's slot may already have been released at this point
+  vector<pair<pjsua_conf_port_id, Entry> > owned;
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (map<pjsua_conf_port_id, Entry>::iterator i = _entries.begin(); i != _entries.end(); ) {
+      if (i->second.callId == callId) {
+        owned.push_back(*i);
+        _entries.erase(i++);
+      } else {
+        i++;
+      }
+    }
+  }
+  for (vector<pair<pjsua_conf_port_id, Entry> >::const_iterator i = owned.begin(); i != owned.end(); i++) {
+    destroy(i->first, i->second);
+  }
+}
+
+Handle<Object>
+LevelMeter::toObject()
+{
+  HandleScope scope;
+  Local<Object> levels = Object::New();
+
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    Local<Object> column = Object::New();
+    column->SetIndexedPropertiesToExternalArrayData(_columns[i], kExternalFloatArray, PJSUA_MAX_CONF_PORTS);
+    setKey(column, "length", PJSUA_MAX_CONF_PORTS);
+    setKey(levels, levelFieldNames[i], column);
+  }
+  setKey(levels, "size", PJSUA_MAX_CONF_PORTS);
+
+  return scope.Close(levels);
+}
+
+static LevelMeter levelMeter;
+
+// //////////////////////////////////////////////////////////////////////
+
+// The EventQueue decouples the PJSIP threads from Node's thread.
+// PJSIP callbacks push event records into a bounded lock-free queue
+// and signal Node's thread through an ev_async watcher.  The watcher
+// callback drains the queue and invokes the JavaScript callback.
+// Neither thread ever waits for the other.  If the queue is full, the
+// event is dropped and counted.
+//
+// In batch mode, the JavaScript callback is invoked once with an
+// array of events instead of once per event.  A batch is delivered
+// when it has reached the maximum batch size or when the oldest event
+// in it has waited for the maximum batch latency.
+//
+// Unless lazy conversion is disabled, the call and account snapshots
+// of the events delivered together share one SnapshotArena and are
+// exposed as accessor backed objects.
+//
+// With multiple PJSIP worker threads, the queue can be split into
+// shards selected by the ordering key of the event, i.e. the call or
+// account ID.  Workers handling different calls then rarely contend
+// for the same queue.  Node's thread takes events from the shards in
+// turn, so events of the same call are delivered in order while the
+// order of events of different calls is not preserved.
+
+class EventQueue
+{
+public:
+  // Note:  EventQueue instances must be created from within Node's thread.
+  EventQueue();
+  ~EventQueue();
+
+  // batchSize == 0 delivers every event with a separate callback
+  // invocation, batchLatency is in seconds.  size is divided between
+  // the shards.
+  void start(Local<Function> callback, size_t size, size_t shards, size_t batchSize, double batchLatency, bool lazy);
+  bool enabled() const { return _enabled; }
+
+  // Called from any thread, never blocks.  Takes ownership of the event.
+  void push(PJSUAEvent* event);
+
+  // Deliver all queued events.  Must be called from the thread that owns V8.
+  void drain();
+
+  Handle<Object> getStats() const;
+
+private:
+  static void eventCallback(EV_P_ ev_async* w, int revents);
+  static void timerCallback(EV_P_ ev_timer* w, int revents);
+
+  bool pop(PJSUAEvent*& event);
+  size_t size() const;
+
+  void deliverEvents(size_t count);
+  size_t deliverBatch(size_t count);
+  void deliverNextBatch();
+
+  BoundedQueue<PJSUAEvent*>* _shards;
+  size_t _shardCount;
+  size_t _nextShard;                                        // next shard to take an event from
+  volatile bool _enabled;
+  size_t _batchSize;
+  ev_tstamp _batchLatency;
+  bool _lazy;
+
+  ev_async _watcher;            // signalled by PJSIP threads when events have been queued
+  ev_timer _timer;              // limits the time that events wait for a batch to fill up
+
+  Persistent<Function> _callback;                           // JavaScript callback function
+  Persistent<Context> _callbackContext;                     // Global context to run callback in
+
+  // Statistics.  _dropped is written by PJSIP threads, the others
+  // only by the thread that delivers events.
+  volatile uint64_t _dropped;
+  uint64_t _delivered;
+  uint64_t _batches;
+  size_t _largestBatch;
+};
+
+// //////////////////////////////////////////////////////////////////////
+
+// Class PJSUA encapsulates the connection between Node and PJ
+
+class PJSUA
+{
+  static Persistent<Function> _callback;
+  static NodeMutex _nodeMutex;
+  static EventQueue _eventQueue;
+
+  static bool _deferredDecisions;
+  static ev_timer _decisionTimer;                           // applies default verdicts
+
+  // All PJSIP configuration is owned by the PJSUA class
+  static pjsua_config _pjsuaConfig;
+  static pjsua_logging_config _loggingConfig;
+  static pjsua_media_config _mediaConfig;
+  static pjsua_transport_config _transportConfig;
+  static pjsua_acc_config _accConfig;
+
+  // //////////////////////////////////////////////////////////////////////
+  //
+  // Callback functions to be called by PJ
+
+  static Handle<Object>
+  getCallInfo(pjsua_call_id call_id)
+  {
+    CallSnapshot callInfo;
+    callInfo.capture(call_id);
+
+    return callInfo.toObject();
+  }
+
+  static Handle<Object>
+  getAccInfo(pjsua_acc_id accId)
+  {
+    AccSnapshot accInfo;
+    accInfo.capture(accId);
+
+    return accInfo.toObject();
+  }
+
+  // Deliver an event to JavaScript, either by queueing it for Node's
+  // thread or by suspending Node's thread and invoking the callback
+  // directly.  Takes ownership of the event.
+  static void
+  dispatch(PJSUAEvent* event)
+  {
+    if (_eventQueue.enabled()) {
+      _eventQueue.push(event);
+      return;
+    }
+
+    NodeMutex::Lock lock(event->eventName(), _nodeMutex);
+    HandleScope handleScope;
+
+    Handle<Value> argv[PJSUAEvent::maxArguments];
+    int argc = event->arguments(argv, 0);
+    event->recordDeliveryLatency();
+    _nodeMutex.invokeCallback(event->eventName(), argc, argv);
+    delete event;
+  }
+
+  // Callbacks that need an answer from JavaScript are still invoked
+  // synchronously.  Events that were queued before must be delivered
+  // first so that JavaScript sees them in order.
+  static void
+  flushEventQueue()
+  {
+    if (_eventQueue.enabled()) {
+      NodeMutex::Unlock unlock("flushEventQueue", _nodeMutex);
+      _eventQueue.drain();
+    }
+  }
+
+  static void
+  on_call_state(pjsua_call_id call_id,
+                pjsip_event *e)
+  {
+    if (admissionControl.suppressCallState(call_id)) {
+      return;
+    }
+    callTable.update(call_id);
+    callGenerations.callState(call_id);
+    callOriginator.callState(call_id);
+    recordingWriter.callState(call_id);
+    dtmfCollector.callState(call_id);
+    levelMeter.callState(call_id);
+    dispatch(new PJSUACallStateEvent(call_id));
+  }
+
+  static void
+  on_incoming_call(pjsua_acc_id acc_id,
+                   pjsua_call_id call_id,
+                   pjsip_rx_data *rdata)
+  {
+    if (admissionControl.admit(acc_id, call_id) != AdmissionControl::ADMIT) {
+      return;
+    }
+    callTable.update(call_id);
+    dispatch(new PJSUAIncomingCallEvent(acc_id, call_id));
+  }
+
+  static void
+  on_call_tsx_state(pjsua_call_id call_id,
+                    pjsip_transaction *tsx,
+                    pjsip_event *e)
+  {
+    if (admissionControl.suppressEvents(call_id)) {
+      return;
+    }
+    callTable.update(call_id);
+    dispatch(new PJSUACallTsxStateEvent(call_id));
+  }
+
+  static void
+  on_call_media_state(pjsua_call_id call_id)
+  {
+    if (admissionControl.suppressEvents(call_id)) {
+      return;
+    }
+    callTable.update(call_id);
+    dispatch(new PJSUACallMediaStateEvent(call_id));
+  }
+
+  static void
+  on_stream_created(pjsua_call_id call_id,
+                    pjmedia_session *sess,
+                    unsigned stream_idx,
+                    pjmedia_port **p_port)
+  {
+    dispatch(new PJSUAStreamCreatedEvent(call_id, stream_idx));
+  }
+
+  static void
+  on_stream_destroyed(pjsua_call_id call_id,
+                      pjmedia_session *sess,
+                      unsigned stream_idx)
+  {
+    dispatch(new PJSUAStreamDestroyedEvent(call_id, stream_idx));
+  }
+
+  static void
+  on_dtmf_digit(pjsua_call_id call_id,
+                int digit)
+  {
+    if (dtmfCollector.digit(call_id, digit)) {
+      return;
+    }
+    dispatch(new PJSUADtmfDigitEvent(call_id, digit));
+  }
+
+  static void
+  on_call_transfer_request(pjsua_call_id call_id,
+                           const pj_str_t *dst,
+                           pjsip_status_code *code)
+  {
+    if (_deferredDecisions) {
+      *code = (pjsip_status_code) decisionTable.defaultVerdict(DecisionTable::TRANSFER_REQUEST);
+      dispatch(new PJSUACallTransferRequestEvent(call_id, dst, *code));
+      return;
+    }
+
+    NodeMutex::Lock lock("on_call_transfer_request", _nodeMutex);
+    HandleScope handleScope;
+    flushEventQueue();
+
+    Local<Value> result = _nodeMutex.invokeCallback("call_transfer_request", 3, getCallInfo(call_id), Undefined(), Undefined());
+    *code = (pjsip_status_code) result->ToInteger()->Value();
+  }
+
+  static void
+  on_call_transfer_status(pjsua_call_id call_id,
+                          int st_code,
+                          const pj_str_t *st_text,
+                          pj_bool_t final,
+                          pj_bool_t *p_cont)
+  {
+    if (_deferredDecisions) {
+      *p_cont = decisionTable.transferContinue(call_id);
+      uint32_t token = 0;
+      if (final) {
+        decisionTable.resetTransfer(call_id);
+      } else if (*p_cont) {
+        DecisionTable::Decision decision = { DecisionTable::TRANSFER_STATUS, 0, call_id, PJSUA_INVALID_ID, 0 };
+        token = decisionTable.add(decision);
+      }
+      dispatch(new PJSUACallTransferStatusEvent(call_id, st_code, st_text, final, token));
+      return;
+    }
+
+    NodeMutex::Lock lock("on_call_transfer_status", _nodeMutex);
+    HandleScope handleScope;
+    flushEventQueue();
+
+    Local<Value> result = _nodeMutex.invokeCallback("call_transfer_status", 4, getCallInfo(call_id), Integer::New(st_code),
+                                                    String::New(st_text->ptr, st_text->slen), Boolean::New(final));
+    *p_cont = result->ToBoolean()->Value();
+  }
+
+  static void
+  on_call_replace_request(pjsua_call_id call_id,
+                          pjsip_rx_data *rdata,
+                          int *st_code,
+                          pj_str_t *st_text)
+  {
+    if (_deferredDecisions) {
+      *st_code = decisionTable.defaultVerdict(DecisionTable::REPLACE_REQUEST);
+      dispatch(new PJSUACallReplaceRequestEvent(call_id, *st_code));
+      return;
+    }
+
+    NodeMutex::Lock lock("on_call_replace_request", _nodeMutex);
+    HandleScope handleScope;
+    flushEventQueue();
+
+    Local<Value> result = _nodeMutex.invokeCallback("call_replace_request", 2, getCallInfo(call_id), Undefined());
+    *st_code = result->ToInteger()->Value();
+    // FIXME: st_text not supported
+  }
+
+  static void
+  on_call_replaced(pjsua_call_id old_call_id,
+                   pjsua_call_id new_call_id)
+  {
+    dispatch(new PJSUACallReplacedEvent(old_call_id, new_call_id));
+  }
+
+  static void
+  on_reg_state2(pjsua_acc_id acc_id,
+                pjsua_reg_info* info)
+  {
+    bool coalesced = registrationTable.update(acc_id, info);
+    if (accountProvisioner.regState(acc_id, info) || coalesced) {
+      return;
+    }
+    int statusClass;
+    double nextRefresh;
+    registrationTable.summary(acc_id, statusClass, nextRefresh);
+    dispatch(new PJSUARegState2Event(acc_id, info, statusClass, nextRefresh));
+  }
+
+  static void
+  on_incoming_subscribe(pjsua_acc_id acc_id,
+                        pjsua_srv_pres *srv_pres,
+                        pjsua_buddy_id buddy_id,
+                        const pj_str_t *from,
+                        pjsip_rx_data *rdata,
+                        pjsip_status_code *code,
+                        pj_str_t *reason,
+                        pjsua_msg_data *msg_data)
+  {
+    if (_deferredDecisions) {
+      // Accept as pending, the subscription is activated or
+      // terminated when the verdict is known
+      *code = PJSIP_SC_ACCEPTED;
+      DecisionTable::Decision decision = { DecisionTable::INCOMING_SUBSCRIBE, 0, PJSUA_INVALID_ID, acc_id, srv_pres };
+      uint32_t token = decisionTable.add(decision);
+      dispatch(new PJSUAIncomingSubscribeEvent(acc_id, from, token));
+      return;
+    }
+
+    NodeMutex::Lock lock("on_incoming_subscribe", _nodeMutex);
+    HandleScope handleScope;
+    flushEventQueue();
+
+    Local<Value> result = _nodeMutex.invokeCallback("incoming_subscribe", 5, getAccInfo(acc_id), Undefined(), Undefined(),
+                                                    String::New(from->ptr, from->slen), Undefined());
+    *code = (pjsip_status_code) result->ToInteger()->Value();
+    // FIXME: reason, msg_data not supported
+  }
+
+  static void
+  on_srv_subscribe_state(pjsua_acc_id acc_id,
+                         pjsua_srv_pres *srv_pres,
+                         const pj_str_t *remote_uri,
+                         pjsip_evsub_state state,
+                         pjsip_event *event)
+  {
+    if (state == PJSIP_EVSUB_STATE_TERMINATED) {
+      decisionTable.forget(srv_pres);
+    }
+    dispatch(new PJSUASrvSubscribeStateEvent(acc_id, remote_uri, state));
+  }
+
+  static void
+  on_buddy_state(pjsua_buddy_id buddy_id)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_buddy_evsub_state(pjsua_buddy_id buddy_id,
+                       pjsip_evsub *sub,
+                       pjsip_event *event)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_pager(pjsua_call_id call_id,
+           const pj_str_t *from,
+           const pj_str_t *to,
+           const pj_str_t *contact,
+           const pj_str_t *mime_type,
+           const pj_str_t *body)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_pager2(pjsua_call_id call_id,
+            const pj_str_t *from,
+            const pj_str_t *to,
+            const pj_str_t *contact,
+            const pj_str_t *mime_type,
+            const pj_str_t *body,
+            pjsip_rx_data *rdata,
+            pjsua_acc_id acc_id)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_pager_status(pjsua_call_id call_id,
+                  const pj_str_t *to,
+                  const pj_str_t *body,
+                  void *user_data,
+                  pjsip_status_code status,
+                  const pj_str_t *reason)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_pager_status2(pjsua_call_id call_id,
+                   const pj_str_t *to,
+                   const pj_str_t *body,
+                   void *user_data,
+                   pjsip_status_code status,
+                   const pj_str_t *reason,
+                   pjsip_tx_data *tdata,
+                   pjsip_rx_data *rdata,
+                   pjsua_acc_id acc_id)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_typing(pjsua_call_id call_id,
+            const pj_str_t *from,
+            const pj_str_t *to,
+            const pj_str_t *contact,
+            pj_bool_t is_typing)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_typing2(pjsua_call_id call_id,
+             const pj_str_t *from,
+             const pj_str_t *to,
+             const pj_str_t *contact,
+             pj_bool_t is_typing,
+             pjsip_rx_data *rdata,
+             pjsua_acc_id acc_id)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_nat_detect(const pj_stun_nat_detect_result *res)
+  {
+    dispatch(new PJSUANatDetectEvent(res));
+    // FIXME: NYI
+  }
+
+  static void
+  on_mwi_info(pjsua_acc_id acc_id,
+              pjsua_mwi_info *mwi_info)
+  {
+    // FIXME: NYI
+  }
+
+  static void
+  on_transport_state(pjsip_transport *tp,
+                     pjsip_transport_state state,
+                     const pjsip_transport_state_info *info)
+  {
+    dispatch(new PJSUATransportStateEvent(tp, state, info));
+  }
+
+  static void
+  on_ice_transport_error(int index,
+                         pj_ice_strans_op op,
+                         pj_status_t status,
+                         void *param)
+  {
+    // FIXME: NYI
+  }
+
+public:
+  static void Initialize(Handle<Object> target);
+
+private:
+  static Handle<Value> start(const Arguments& args);
+  static Handle<Value> addAccount(const Arguments& args);
+  static Handle<Value> addLocalAccount(const Arguments& args);
+  static Handle<Value> addAccounts(const Arguments& args);
+  static Handle<Value> getAudioDevices(const Arguments& args);
+  static Handle<Value> setAudioDeviceIndex(const Arguments& args);
+  static Handle<Value> confConnect(const Arguments& args);
+  static Handle<Value> confApply(const Arguments& args);
+  static Handle<Value> confListPorts(const Arguments& args);
+  static Handle<Value> startMetering(const Arguments& args);
+  static Handle<Value> stopMetering(const Arguments& args);
+  static Handle<Value> createAudioTap(const Arguments& args);
+  static Handle<Value> destroyAudioTap(const Arguments& args);
+  static Handle<Value> recordCall(const Arguments& args);
+  static Handle<Value> stopRecording(const Arguments& args);
+  static Handle<Value> loadPrompt(const Arguments& args);
+  static Handle<Value> unloadPrompt(const Arguments& args);
+  static Handle<Value> playPrompt(const Arguments& args);
+  static Handle<Value> stopPrompt(const Arguments& args);
+  static Handle<Value> collectDigits(const Arguments& args);
+  static Handle<Value> cancelDigits(const Arguments& args);
+  static Handle<Value> callAnswer(const Arguments& args);
+  static Handle<Value> callMakeCall(const Arguments& args);
+  static Handle<Value> callMakeCallBatch(const Arguments& args);
+  static Handle<Value> callGetCorrelationId(const Arguments& args);
+  static Handle<Value> callHangup(const Arguments& args);
+  static Handle<Value> callGetInfo(const Arguments& args);
+  static Handle<Value> getCalls(const Arguments& args);
+  static Handle<Value> getRegistrations(const Arguments& args);
+  static Handle<Value> readCallTableRow(const Arguments& args);
+  static Handle<Value> hangupAll(const Arguments& args);
+  static Handle<Value> stop(const Arguments& args);
+  static Handle<Value> getStats(const Arguments& args);
+  static Handle<Value> respond(const Arguments& args);
+  static Handle<Value> setAdmissionRules(const Arguments& args);
+  static Handle<Value> setLogLevel(const Arguments& args);
+
+  static void createTransport(Handle<Object> options);
+  static pjsua_transport_id createReusePortUdpTransport(const string& address, unsigned port, const string& publicAddress);
+
+  static void expireDecisions(EV_P_ ev_timer* w, int revents);
+
+#ifdef PJSIP_BENCHMARK
+  static Handle<Value> benchmarkMarshaling(const Arguments& args);
+  static Handle<Value> runBenchmarks(const Arguments& args);
+#endif
+};
+
+// //////////////////////////////////////////////////////////////////////
+
+// Static member allocation
+
+NodeMutex PJSUA::_nodeMutex;
+EventQueue PJSUA::_eventQueue;
+bool PJSUA::_deferredDecisions;
+ev_timer PJSUA::_decisionTimer;
+pjsua_config PJSUA::_pjsuaConfig;
+pjsua_logging_config PJSUA::_loggingConfig;
+pjsua_media_config PJSUA::_mediaConfig;
+pjsua_transport_config PJSUA::_transportConfig;
+pjsua_acc_config PJSUA::_accConfig;
+
+// //////////////////////////////////////////////////////////////////////
+
+// PJSIP-Node-Thread synchronization
+
+// //////////////////////////////////////////////////////////////////////
+
+// NodeMutex::Lock is a scoped lock that locks out Node's thread,
+// i.e. when the instance has been constructed: Node's thread is
+// suspended during the life time of a NodeMutex::Lock instances.  In
+// addition to suspending Node's thread by the way of libev and
+// condition variables, the Lock instance also locks V8 using
+// v8::Locker and enters the context of the callback.
+
+NodeMutex::Lock::Lock(const char* name, NodeMutex& m)
+  : _name(name),
+    _mutex(m),
+    _stats(LockStats::get(name)),
+    _locker(0),
+    _scope(0),
+    _hasSuspendedNode(false),
+    _suspendedAt(0)
+{
+#ifdef DEBUG_LOCKS
+  cout << "Lock::Lock(): " << _name << endl;
+#endif // DEBUG_LOCKS
+
+  uint64_t start = monotonicNanoseconds();
+  _globalMutex.lock();
+  uint64_t locked = monotonicNanoseconds();
+  _stats.globalMutexWait.record(locked - start);
+
+  bool inNodeThread = pthread_equal(_mutex._nodeThreadId, pthread_self());
+
+  if (!_nodeSuspended && !inNodeThread) {
+    // suspendNodeThread() sets _mutex._callbackContext as a side effect
+    _mutex.suspendNodeThread();
+    _suspendedAt = monotonicNanoseconds();
+    _stats.suspendWait.record(_suspendedAt - locked);
+    _hasSuspendedNode = true;
+    _nodeSuspended = true;
+  } else {
+    _mutex._callbackContext = Persistent<Context>::New(Context::GetCurrent());
+  }
+
+  // The destructor does not run if the constructor throws, so undo
+  // the locking here
+  try {
+    if (!inNodeThread) {
+      _locker = new Locker();
+    }
+    _scope = new Context::Scope(_mutex._callbackContext);
+  }
+  catch (...) {
+    delete _locker;
+    if (_hasSuspendedNode) {
+      _mutex.resumeNodeThread();
+      _nodeSuspended = false;
+    }
+    _globalMutex.unlock();
+    throw;
+  }
+
+#ifdef DEBUG_LOCKS
+  cout << "Lock::Lock locked: " << _name << endl;
+#endif // DEBUG_LOCKS
+}
+
+NodeMutex::Lock::~Lock()
+{
+#ifdef DEBUG_LOCKS
+  cout << "Lock::~Lock(): " << _name << endl;
+#endif // DEBUG_LOCKS
+
+  delete _scope;
+  delete _locker;
+
+  if (_hasSuspendedNode) {
+    _mutex.resumeNodeThread();
+    _nodeSuspended = false;
+    _stats.nodeParked.record(monotonicNanoseconds() - _suspendedAt);
+  }
+
+  _globalMutex.unlock();
+
+#ifdef DEBUG_LOCKS
+  cout << "Lock::~Lock() unlocked: " << _name << endl;
+#endif // DEBUG_LOCKS
+}
+
+NodeMutex::Unlock::Unlock(const char* name, NodeMutex& m)
+  : _name(name),
+    _mutex(m)
+{
+#ifdef DEBUG_LOCKS
+  cout << "Unlock::Unlock(): " << _name << endl;
+#endif // DEBUG_LOCKS
+
+  _mutex._globalMutex.unlock();
+
+#ifdef DEBUG_LOCKS
+  cout << "Unlock::Unlock unlocked: " << _name << endl;
+#endif // DEBUG_LOCKS
+}
+
+NodeMutex::Unlock::~Unlock()
+{
+#ifdef DEBUG_LOCKS
+  cout << "Unlock::~Unlock(): " << _name << endl;
+#endif // DEBUG_LOCKS
+
+  uint64_t start = monotonicNanoseconds();
+  _mutex._globalMutex.lock();
+  LockStats::get(_name).globalMutexWait.record(monotonicNanoseconds() - start);
+
+#ifdef DEBUG_LOCKS
+  cout << "Unlock::~Unlock locked: " << _name << endl;
+#endif // DEBUG_LOCKS
+}
+
+NodeMutex::NodeMutex()
+  : _nodeThreadId(pthread_self())
+{
+  ev_init(&_watcher, eventCallback);
+  _watcher.data = this;
+  ev_async_start(EV_DEFAULT_UC_ &_watcher);
+}
+
+NodeMutex::~NodeMutex()
+{
+  ev_async_stop(EV_DEFAULT_UC_ &_watcher);
+}
+
+void
+NodeMutex::setCallback(Local<Function> callback)
+{
+  _callback = Persistent<Function>::New(callback);
+}
+
+Local<Value>
+NodeMutex::invokeCallback(const char* eventName, int argc, ...)
+{
+  Handle<Value> argv[argc];
+
+  va_list vl;
+  va_start(vl, argc);
+  for (int i = 0; i < argc; i++) {
+    argv[i] = va_arg(vl, Handle<Value>);
+  }
+  va_end(vl);
+
+  return invokeCallback(eventName, argc, argv);
+}
+
+Local<Value>
+NodeMutex::invokeCallback(const char* eventName, int argc, Handle<Value> argv[])
+{
+  Handle<Value> args[argc + 1];
+  args[0] = eventSymbol(eventName);
+  for (int i = 0; i < argc; i++) {
+    args[i + 1] = argv[i];
+  }
+
+  NodeMutex::Unlock unlock("invokeCallback", *this);
+  TryCatch tryCatch;
+  uint64_t start = monotonicNanoseconds();
+  Local<Value> retval = _callback->Call(_callbackContext->Global(), argc + 1, args);
+  LockStats::get(eventName).callback.record(monotonicNanoseconds() - start);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+
+  return retval;
+}
+
+void
+NodeMutex::eventCallback(EV_P_ ev_async* w, int revents)
+{
+  NodeMutex* nodeMutex = reinterpret_cast<NodeMutex*>(w->data);
+  nodeMutex->suspend();
+}
+
+void
+NodeMutex::suspend()
+{
+  // set context in mutex so that other thread can access it (see invokeCallback / Lock)
+  _callbackContext = Persistent<Context>::New(Context::GetCurrent());
+
+  Unlocker unlocker;            // relinquish control over v8
+
+  unique_lock<mutex> completeLock(_completeMutex);
+
+  {
+    unique_lock<mutex> proceedLock(_proceedMutex);
+    
+    _proceed.notify_one();      // tell the other thread to go ahead
+  }
+
+  _complete.wait(completeLock); // wait for the other thread to complete processing
+  // FIXME: _callbackContext needs to be released
+}
+
+void
+NodeMutex::suspendNodeThread()
+{
+  unique_lock<mutex> lock(_proceedMutex);
+
+  ev_async_send(EV_DEFAULT_ &_watcher);
+
+  _proceed.wait(lock);        // wait until Node's thread is suspended
+}
+
+void
+NodeMutex::resumeNodeThread()
+{
+  unique_lock<mutex> lock(_completeMutex);
+
+  _complete.notify_one();     // tell Node's that that we're done
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+// Event queue
+
+// //////////////////////////////////////////////////////////////////////
+
+EventQueue::EventQueue()
+  : _shards(0),
+    _shardCount(0),
+    _nextShard(0),
+    _enabled(false),
+    _batchSize(0),
+    _batchLatency(0),
+    _lazy(false),
+    _dropped(0),
+    _delivered(0),
+    _batches(0),
+    _largestBatch(0)
+{
+  ev_init(&_watcher, eventCallback);
+  _watcher.data = this;
+  ev_async_start(EV_DEFAULT_UC_ &_watcher);
+
+  ev_init(&_timer, timerCallback);
+  _timer.data = this;
+}
+
+EventQueue::~EventQueue()
+{
+  ev_timer_stop(EV_DEFAULT_UC_ &_timer);
+  ev_async_stop(EV_DEFAULT_UC_ &_watcher);
+
+  PJSUAEvent* event;
+  while (pop(event)) {
+    delete event;
+  }
+  delete[] _shards;
+}
+
+void
+EventQueue::start(Local<Function> callback, size_t size, size_t shards, size_t batchSize, double batchLatency, bool lazy)
+{
+  _callback = Persistent<Function>::New(callback);
+  _callbackContext = Persistent<Context>::New(Context::GetCurrent());
+  _batchSize = batchSize;
+  _batchLatency = batchLatency;
+  _lazy = lazy;
+  _shardCount = max((size_t) 1, shards);
+  _shards = new BoundedQueue<PJSUAEvent*>[_shardCount];
+  for (size_t i = 0; i < _shardCount; i++) {
+    _shards[i].allocate((size + _shardCount - 1) / _shardCount);
+  }
+  __sync_synchronize();
+  _enabled = true;
+}
+
+void
+EventQueue::push(PJSUAEvent* event)
+{
+  unsigned key = (unsigned) event->orderingKey();
+  if (!_shards[key % _shardCount].push(event)) {
+    __sync_fetch_and_add(&_dropped, 1);
+    delete event;
+    return;
+  }
+
+  ev_async_send(EV_DEFAULT_ &_watcher);
+}
+
+// Take the next event from the shards in turn.  Must only be called
+// from the thread that delivers events.
+bool
+EventQueue::pop(PJSUAEvent*& event)
+{
+  for (size_t i = 0; i < _shardCount; i++) {
+    size_t shard = _nextShard;
+    _nextShard = (_nextShard + 1) % _shardCount;
+    if (_shards[shard].pop(event)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Approximate number of queued events
+size_t
+EventQueue::size() const
+{
+  size_t size = 0;
+  for (size_t i = 0; i < _shardCount; i++) {
+    size += _shards[i].size();
+  }
+  return size;
+}
+
+void
+EventQueue::drain()
+{
+  HandleScope scope;
+  Context::Scope contextScope(_callbackContext);
+
+  size_t count = size();
+  if (_batchSize) {
+    while (count) {
+      size_t delivered = deliverBatch(min(count, _batchSize));
+      if (!delivered) {
+        break;
+      }
+      count -= min(count, delivered);
+    }
+  } else {
+    deliverEvents(count);
+  }
+}
+
+void
+EventQueue::deliverEvents(size_t count)
+{
+  SnapshotArena* arena = _lazy ? new SnapshotArena : 0;
+
+  PJSUAEvent* event;
+  while (count-- && pop(event)) {
+    HandleScope eventScope;
+
+    const char* eventName = event->eventName();
+    Handle<Value> argv[PJSUAEvent::maxArguments + 1];
+    argv[0] = eventSymbol(eventName);
+    int argc = event->arguments(argv + 1, arena);
+    event->recordDeliveryLatency();
+    delete event;
+
+    _delivered++;
+    _batches++;
+    _largestBatch = max(_largestBatch, (size_t) 1);
+
+    TryCatch tryCatch;
+    uint64_t start = monotonicNanoseconds();
+    _callback->Call(_callbackContext->Global(), argc + 1, argv);
+    LockStats::get(eventName).callback.record(monotonicNanoseconds() - start);
+
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+
+  if (arena) {
+    arena->release();
+  }
+}
+
+// Deliver up to count events as one array of [ eventName, args... ]
+// arrays, return the number of events delivered
+size_t
+EventQueue::deliverBatch(size_t count)
+{
+  HandleScope batchScope;
+
+  SnapshotArena* arena = _lazy ? new SnapshotArena : 0;
+
+  Local<Array> events = Array::New(count);
+  size_t i = 0;
+  PJSUAEvent* event;
+  while (i < count && pop(event)) {
+    Handle<Value> argv[PJSUAEvent::maxArguments];
+    int argc = event->arguments(argv, arena);
+    event->recordDeliveryLatency();
+
+    Local<Array> eventArgs = Array::New(argc + 1);
+    eventArgs->Set(0, eventSymbol(event->eventName()));
+    for (int j = 0; j < argc; j++) {
+      eventArgs->Set(j + 1, argv[j]);
+    }
+    delete event;
+
+    events->Set(i++, eventArgs);
+  }
+
+  if (arena) {
+    arena->release();
+  }
+
+  if (!i) {
+    return 0;
+  }
+  if (i < count) {
+    events->Set(String::NewSymbol("length"), Integer::New(i));
+  }
+
+  _delivered += i;
+  _batches++;
+  _largestBatch = max(_largestBatch, i);
+
+  Handle<Value> argv[2] = { String::NewSymbol("events"), events };
+
+  TryCatch tryCatch;
+  uint64_t start = monotonicNanoseconds();
+  _callback->Call(_callbackContext->Global(), 2, argv);
+  LockStats::get("events").callback.record(monotonicNanoseconds() - start);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+
+  return i;
+}
+
+// Deliver one batch and arrange for the remaining events to be
+// delivered, either in the next loop iteration if another full batch
+// is waiting or when the batch latency has expired.
+void
+EventQueue::deliverNextBatch()
+{
+  ev_timer_stop(EV_DEFAULT_UC_ &_timer);
+
+  {
+    HandleScope scope;
+    Context::Scope contextScope(_callbackContext);
+    deliverBatch(_batchSize);
+  }
+
+  size_t remaining = size();
+  if (remaining >= _batchSize || (remaining && _batchLatency == 0)) {
+    ev_async_send(EV_DEFAULT_ &_watcher);
+  } else if (remaining) {
+    ev_timer_set(&_timer, _batchLatency, 0.);
+    ev_timer_start(EV_DEFAULT_UC_ &_timer);
+  }
+}
+
+void
+EventQueue::eventCallback(EV_P_ ev_async* w, int revents)
+{
+  EventQueue* eventQueue = reinterpret_cast<EventQueue*>(w->data);
+  if (!eventQueue->enabled()) {
+    return;
+  }
+
+  if (!eventQueue->_batchSize) {
+    // Only deliver the events that are queued now so that a steady
+    // stream of events cannot starve Node's event loop.  Events that
+    // arrive meanwhile are picked up in the next loop iteration.
+    eventQueue->drain();
+    if (eventQueue->size()) {
+      ev_async_send(EV_DEFAULT_ &eventQueue->_watcher);
+    }
+  } else if (eventQueue->size() >= eventQueue->_batchSize || eventQueue->_batchLatency == 0) {
+    eventQueue->deliverNextBatch();
+  } else if (!ev_is_active(&eventQueue->_timer) && eventQueue->size()) {
+    ev_timer_set(&eventQueue->_timer, eventQueue->_batchLatency, 0.);
+    ev_timer_start(EV_DEFAULT_UC_ &eventQueue->_timer);
+  }
+}
+
+void
+EventQueue::timerCallback(EV_P_ ev_timer* w, int revents)
+{
+  EventQueue* eventQueue = reinterpret_cast<EventQueue*>(w->data);
+  eventQueue->deliverNextBatch();
+}
+
+Handle<Object>
+EventQueue::getStats() const
+{
+  Local<Object> stats = Object::New();
+  setKey(stats, "enabled", (bool) _enabled);
+  setKey(stats, "capacity", (double) (_shardCount * (_shardCount ? _shards[0].capacity() : 0)));
+  setKey(stats, "queued", (double) size());
+  setKey(stats, "shards", (double) _shardCount);
+  setKey(stats, "delivered", (double) _delivered);
+  setKey(stats, "dropped", (double) _dropped);
+  setKey(stats, "batches", (double) _batches);
+  setKey(stats, "average_batch_size", _batches ? ((double) _delivered / (double) _batches) : 0.0);
+  setKey(stats, "largest_batch", (double) _largestBatch);
+  return stats;
+}
+
+// //////////////////////////////////////////////////////////////////////
+
+void
+PJSUA::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  CallSnapshot::shape.initialize();
+  AccSnapshot::shape.initialize();
+  regInfoShape.initialize();
+  regEntryShape.initialize();
+  rpidShape.initialize();
+  deviceInfoShape.initialize();
+  callSummaryShape.initialize();
+  confPortShape.initialize();
+  mediaStatusNames.initialize();
+  natTypeNames.initialize();
+  callStateNames.initialize();
+  roleNames.initialize();
+  mediaDirNames.initialize();
+  transportStateNames.initialize();
+  evsubStateNames.initialize();
+  SnapshotArena::initialize();
+  seqSymbol = Persistent<String>::New(String::NewSymbol("seq"));
+
+  // Names of the enumeration values that are passed as numbers
+  Local<Object> enums = Object::New();
+  setKey(enums, mediaStatusNames.tableName(), mediaStatusNames.names());
+  setKey(enums, natTypeNames.tableName(), natTypeNames.names());
+  setKey(enums, callStateNames.tableName(), callStateNames.names());
+  setKey(enums, roleNames.tableName(), roleNames.names());
+  setKey(enums, mediaDirNames.tableName(), mediaDirNames.names());
+  setKey(enums, transportStateNames.tableName(), transportStateNames.names());
+  setKey(enums, evsubStateNames.tableName(), evsubStateNames.names());
+  target->Set(String::NewSymbol("enums"), enums);
+  target->Set(String::NewSymbol("callTable"), callTable.toObject());
+  target->Set(String::NewSymbol("levels"), levelMeter.toObject());
+
+  target->Set(String::NewSymbol("start"), FunctionTemplate::New(start)->GetFunction());
+  target->Set(String::NewSymbol("addAccount"), FunctionTemplate::New(addAccount)->GetFunction());
+  target->Set(String::NewSymbol("addLocalAccount"), FunctionTemplate::New(addLocalAccount)->GetFunction());
+  target->Set(String::NewSymbol("addAccounts"), FunctionTemplate::New(addAccounts)->GetFunction());
+  target->Set(String::NewSymbol("getAudioDevices"), FunctionTemplate::New(getAudioDevices)->GetFunction());
+  target->Set(String::NewSymbol("setAudioDeviceIndex"), FunctionTemplate::New(setAudioDeviceIndex)->GetFunction());
+  target->Set(String::NewSymbol("confConnect"), FunctionTemplate::New(confConnect)->GetFunction());
+  target->Set(String::NewSymbol("confApply"), FunctionTemplate::New(confApply)->GetFunction());
+  target->Set(String::NewSymbol("confListPorts"), FunctionTemplate::New(confListPorts)->GetFunction());
+  target->Set(String::NewSymbol("startMetering"), FunctionTemplate::New(startMetering)->GetFunction());
+  target->Set(String::NewSymbol("stopMetering"), FunctionTemplate::New(stopMetering)->GetFunction());
+  target->Set(String::NewSymbol("createAudioTap"), FunctionTemplate::New(createAudioTap)->GetFunction());
+  target->Set(String::NewSymbol("destroyAudioTap"), FunctionTemplate::New(destroyAudioTap)->GetFunction());
+  target->Set(String::NewSymbol("recordCall"), FunctionTemplate::New(recordCall)->GetFunction());
+  target->Set(String::NewSymbol("stopRecording"), FunctionTemplate::New(stopRecording)->GetFunction());
+  target->Set(String::NewSymbol("loadPrompt"), FunctionTemplate::New(loadPrompt)->GetFunction());
+  target->Set(String::NewSymbol("unloadPrompt"), FunctionTemplate::New(unloadPrompt)->GetFunction());
+  target->Set(String::NewSymbol("playPrompt"), FunctionTemplate::New(playPrompt)->GetFunction());
+  target->Set(String::NewSymbol("stopPrompt"), FunctionTemplate::New(stopPrompt)->GetFunction());
+  target->Set(String::NewSymbol("collectDigits"), FunctionTemplate::New(collectDigits)->GetFunction());
+  target->Set(String::NewSymbol("cancelDigits"), FunctionTemplate::New(cancelDigits)->GetFunction());
+  target->Set(String::NewSymbol("callAnswer"), FunctionTemplate::New(callAnswer)->GetFunction());
+  target->Set(String::NewSymbol("callMakeCall"), FunctionTemplate::New(callMakeCall)->GetFunction());
+  target->Set(String::NewSymbol("callMakeCallBatch"), FunctionTemplate::New(callMakeCallBatch)->GetFunction());
+  target->Set(String::NewSymbol("getCallCorrelationId"), FunctionTemplate::New(callGetCorrelationId)->GetFunction());
+  target->Set(String::NewSymbol("callHangup"), FunctionTemplate::New(callHangup)->GetFunction());
+  target->Set(String::NewSymbol("getCallInfo"), FunctionTemplate::New(callGetInfo)->GetFunction());
+  target->Set(String::NewSymbol("getCalls"), FunctionTemplate::New(getCalls)->GetFunction());
+  target->Set(String::NewSymbol("getRegistrations"), FunctionTemplate::New(getRegistrations)->GetFunction());
+  target->Set(String::NewSymbol("readCallTableRow"), FunctionTemplate::New(readCallTableRow)->GetFunction());
+  target->Set(String::NewSymbol("hangupAll"), FunctionTemplate::New(hangupAll)->GetFunction());
+  target->Set(String::NewSymbol("stop"), FunctionTemplate::New(stop)->GetFunction());
+  target->Set(String::NewSymbol("getStats"), FunctionTemplate::New(getStats)->GetFunction());
+  target->Set(String::NewSymbol("respond"), FunctionTemplate::New(respond)->GetFunction());
+  target->Set(String::NewSymbol("setAdmissionRules"), FunctionTemplate::New(setAdmissionRules)->GetFunction());
+  target->Set(String::NewSymbol("setLogLevel"), FunctionTemplate::New(setLogLevel)->GetFunction());
+#ifdef PJSIP_BENCHMARK
+  target->Set(String::NewSymbol("benchmarkMarshaling"), FunctionTemplate::New(benchmarkMarshaling)->GetFunction());
+  target->Set(String::NewSymbol("runBenchmarks"), FunctionTemplate::New(runBenchmarks)->GetFunction());
+#endif
+}
+
+Handle<Value>
+PJSUA::start(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    Local<Object> options = Object::New();
+
+    switch (args.Length()) {
+    case 2:
+      options = args[1]->ToObject();
+    case 1:
+      if (!args[0]->IsFunction()) {
+        throw JSException("need callback function as argument");
+      }
+      break;
+    default:
+      throw JSException("unexpected number of arguments to PJSUA::start");
+    }
+
+    _nodeMutex.setCallback(Local<Function>::Cast(args[0]));
+
+    // Deliver events through the event queue instead of suspending
+    // Node's thread for every PJSIP callback.  Batched delivery
+    // implies the event queue.
+    bool batch = options->Has(String::NewSymbol("batch"))
+      && options->Get(String::NewSymbol("batch"))->BooleanValue();
+    if (batch || (options->Has(String::NewSymbol("event_queue"))
+                  && options->Get(String::NewSymbol("event_queue"))->BooleanValue())) {
+      size_t eventQueueSize = 4096;
+      if (options->Has(String::NewSymbol("event_queue_size"))) {
+        eventQueueSize = options->Get(String::NewSymbol("event_queue_size"))->ToUint32()->Value();
+      }
+      size_t maxBatchSize = 0;
+      double maxBatchLatency = 0;
+      if (batch) {
+        maxBatchSize = 256;
+        if (options->Has(String::NewSymbol("max_batch_size"))) {
+          maxBatchSize = max(1u, options->Get(String::NewSymbol("max_batch_size"))->ToUint32()->Value());
+        }
+        if (options->Has(String::NewSymbol("max_batch_latency"))) {
+          // milliseconds
+          maxBatchLatency = options->Get(String::NewSymbol("max_batch_latency"))->NumberValue() / 1000.0;
+        }
+      }
+      // Split the queue into shards keyed by call ID, see EventQueue
+      size_t eventQueueShards = 1;
+      if (options->Has(String::NewSymbol("event_queue_shards"))) {
+        eventQueueShards = max(1u, options->Get(String::NewSymbol("event_queue_shards"))->ToUint32()->Value());
+      }
+      bool lazyInfo = true;
+      if (options->Has(String::NewSymbol("lazy_info"))) {
+        lazyInfo = options->Get(String::NewSymbol("lazy_info"))->BooleanValue();
+      }
+      _eventQueue.start(Local<Function>::Cast(args[0]), eventQueueSize, eventQueueShards, maxBatchSize, maxBatchLatency, lazyInfo);
+    }
+
+    // Replace reg_state2 events by coalesced reg_changed events,
+    // see RegistrationTable
+    if (options->Has(String::NewSymbol("reg_notify_interval"))) {
+      // milliseconds
+      double interval = options->Get(String::NewSymbol("reg_notify_interval"))->NumberValue() / 1000.0;
+      if (!(interval > 0)) {
+        throw JSException("reg_notify_interval must be positive");
+      }
+      registrationTable.startNotifications(dispatch, interval);
+    }
+
+    // Never wait for JavaScript in callbacks that need a decision
+    if (options->Has(String::NewSymbol("deferred_decisions"))
+        && options->Get(String::NewSymbol("deferred_decisions"))->BooleanValue()) {
+      if (!_eventQueue.enabled()) {
+        throw JSException("deferred_decisions requires event_queue or batch");
+      }
+
+      // decision_timeout is either a number of milliseconds for all
+      // decisions or an object keyed by event name
+      if (options->Has(String::NewSymbol("decision_timeout"))) {
+        Local<Value> timeouts = options->Get(String::NewSymbol("decision_timeout"));
+        for (int i = 0; i < DecisionTable::KIND_COUNT; i++) {
+          Local<String> key = String::NewSymbol(DecisionTable::kindNames[i]);
+          if (timeouts->IsNumber()) {
+            decisionTable.setTimeout((DecisionTable::Kind) i, (uint64_t) (timeouts->NumberValue() * 1000000.0));
+          } else if (timeouts->IsObject() && timeouts->ToObject()->Has(key)) {
+            decisionTable.setTimeout((DecisionTable::Kind) i,
+                                     (uint64_t) (timeouts->ToObject()->Get(key)->NumberValue() * 1000000.0));
+          }
+        }
+      }
+      if (options->Has(String::NewSymbol("decision_defaults"))) {
+        Local<Object> defaults = options->Get(String::NewSymbol("decision_defaults"))->ToObject();
+        for (int i = 0; i < DecisionTable::KIND_COUNT; i++) {
+          Local<String> key = String::NewSymbol(DecisionTable::kindNames[i]);
+          if (defaults->Has(key)) {
+            decisionTable.setDefaultVerdict((DecisionTable::Kind) i, defaults->Get(key)->Int32Value());
+          }
+        }
+      }
+      for (unsigned i = 0; i < PJSUA_MAX_CALLS; i++) {
+        decisionTable.resetTransfer(i);
+      }
+
+      ev_timer_init(&_decisionTimer, expireDecisions, 0.1, 0.1);
+      ev_timer_start(EV_DEFAULT_UC_ &_decisionTimer);
+      _deferredDecisions = true;
+    }
+
+    // Send only the changed fields in call_state and call_media_state events
+    if (options->Has(String::NewSymbol("call_state_delta"))
+        && options->Get(String::NewSymbol("call_state_delta"))->BooleanValue()) {
+      callStateCache.enable();
+    }
+
+    /* Init pjsua */
+    {
+      pjsua_config_default(&_pjsuaConfig);
+      _pjsuaConfig.cb.on_call_state = on_call_state;
+      _pjsuaConfig.cb.on_incoming_call = on_incoming_call;
+      _pjsuaConfig.cb.on_call_tsx_state = on_call_tsx_state;
+      _pjsuaConfig.cb.on_call_media_state = on_call_media_state;
+      _pjsuaConfig.cb.on_stream_created = on_stream_created;
+      _pjsuaConfig.cb.on_stream_destroyed = on_stream_destroyed;
+      _pjsuaConfig.cb.on_dtmf_digit = on_dtmf_digit;
+      _pjsuaConfig.cb.on_call_transfer_request = on_call_transfer_request;
+      _pjsuaConfig.cb.on_call_transfer_status = on_call_transfer_status;
+      _pjsuaConfig.cb.on_call_replace_request = on_call_replace_request;
+      _pjsuaConfig.cb.on_call_replaced = on_call_replaced;
+      _pjsuaConfig.cb.on_reg_state2 = on_reg_state2;
+      _pjsuaConfig.cb.on_incoming_subscribe = on_incoming_subscribe;
+      _pjsuaConfig.cb.on_srv_subscribe_state = on_srv_subscribe_state;
+      _pjsuaConfig.cb.on_buddy_state = on_buddy_state;
+      _pjsuaConfig.cb.on_buddy_evsub_state = on_buddy_evsub_state;
+      _pjsuaConfig.cb.on_pager = on_pager;
+      _pjsuaConfig.cb.on_pager2 = on_pager2;
+      _pjsuaConfig.cb.on_pager_status = on_pager_status;
+      _pjsuaConfig.cb.on_pager_status2 = on_pager_status2;
+      _pjsuaConfig.cb.on_typing = on_typing;
+      _pjsuaConfig.cb.on_typing2 = on_typing2;
+      _pjsuaConfig.cb.on_nat_detect = on_nat_detect;
+      _pjsuaConfig.cb.on_mwi_info = on_mwi_info;
+      _pjsuaConfig.cb.on_transport_state = on_transport_state;
+      _pjsuaConfig.cb.on_ice_transport_error = on_ice_transport_error;
+
+      pjsua_logging_config_default(&_loggingConfig);
+
+      _loggingConfig.console_level = 0;
+      if (options->Has(String::NewSymbol("console_level"))) {
+        _loggingConfig.console_level = options->Get(String::NewSymbol("console_level"))->ToUint32()->Value();
+      }
+      _loggingConfig.level = 1;
+      if (options->Has(String::NewSymbol("level"))) {
+        _loggingConfig.level = options->Get(String::NewSymbol("level"))->ToUint32()->Value();
+      }
+      string logFilename;
+      if (options->Has(String::NewSymbol("log_filename"))) {
+        logFilename = *String::Utf8Value(options->Get(String::NewSymbol("log_filename")));
+      }
+
+      // Asynchronous logging, see LogPipeline.  PJSUA only passes lines
+      // up to console_level to the writer callback, so console_level
+      // follows level.
+      if (options->Has(String::NewSymbol("log_queue_size"))) {
+        size_t logQueueSize = options->Get(String::NewSymbol("log_queue_size"))->ToUint32()->Value();
+        double logInterval = 0.1;
+        if (options->Has(String::NewSymbol("log_interval"))) {
+          // milliseconds
+          logInterval = options->Get(String::NewSymbol("log_interval"))->NumberValue() / 1000.0;
+        }
+        if (logFilename.empty()) {
+          logPipeline.start(Local<Function>::Cast(args[0]), logQueueSize, logInterval);
+        } else {
+          logPipeline.start(logFilename, logQueueSize, logInterval);
+        }
+        _loggingConfig.cb = LogPipeline::write;
+        _loggingConfig.console_level = _loggingConfig.level;
+      } else if (!logFilename.empty()) {
+        _loggingConfig.log_filename = pj_str((char*) logFilename.c_str());
+      }
+
+      string stunServer;
+      if (options->Has(String::NewSymbol("stun_server"))) {
+        stunServer = *String::Utf8Value(options->Get(String::NewSymbol("stun_server")));
+        _pjsuaConfig.stun_srv[0] = pj_str((char*) stunServer.c_str());
+        _pjsuaConfig.stun_srv_cnt = 1;
+      }
+
+      // Worker threads polling the SIP endpoint
+      if (options->Has(String::NewSymbol("thread_cnt"))) {
+        _pjsuaConfig.thread_cnt = options->Get(String::NewSymbol("thread_cnt"))->ToUint32()->Value();
+      }
+      if (options->Has(String::NewSymbol("max_calls"))) {
+        _pjsuaConfig.max_calls = options->Get(String::NewSymbol("max_calls"))->ToUint32()->Value();
+        if (_pjsuaConfig.max_calls < 1 || _pjsuaConfig.max_calls > PJSUA_MAX_CALLS) {
+          throw JSException("max_calls must be between 1 and PJSUA_MAX_CALLS");
+        }
+      }
+
+      pjsua_media_config_default(&_mediaConfig);
+      if (options->Has(String::NewSymbol("media_thread_cnt"))) {
+        _mediaConfig.thread_cnt = options->Get(String::NewSymbol("media_thread_cnt"))->ToUint32()->Value();
+      }
+      if (options->Has(String::NewSymbol("max_media_ports"))) {
+        _mediaConfig.max_media_ports = options->Get(String::NewSymbol("max_media_ports"))->ToUint32()->Value();
+      }
+
+      // Format of the conference bridge, which is also the format of
+      // the tap, recorder and prompt ports
+      if (options->Has(String::NewSymbol("clock_rate"))) {
+        _mediaConfig.clock_rate = options->Get(String::NewSymbol("clock_rate"))->ToUint32()->Value();
+        _mediaConfig.snd_clock_rate = _mediaConfig.clock_rate;
+      }
+      if (options->Has(String::NewSymbol("channel_count"))) {
+        _mediaConfig.channel_count = options->Get(String::NewSymbol("channel_count"))->ToUint32()->Value();
+        if (_mediaConfig.channel_count < 1 || _mediaConfig.channel_count > 2) {
+          throw JSException("channel_count must be 1 or 2");
+        }
+      }
+      if (options->Has(String::NewSymbol("ptime"))) {
+        _mediaConfig.audio_frame_ptime = options->Get(String::NewSymbol("ptime"))->ToUint32()->Value();
+        if (!_mediaConfig.audio_frame_ptime) {
+          throw JSException("ptime must be positive");
+        }
+      }
+
+      pj_status_t status = pjsua_init(&_pjsuaConfig, &_loggingConfig, &_mediaConfig);
+      if (status != PJ_SUCCESS) {
+        throw PJJSException("Error creating transport", status);
+      }
+    }
+
+    /* Add transports */
+    {
+      if (options->Has(String::NewSymbol("transports"))) {
+        Local<Value> transports = options->Get(String::NewSymbol("transports"));
+        if (!transports->IsArray()) {
+          throw JSException("transports option must be an array");
+        }
+        Local<Array> transportList = Local<Array>::Cast(transports);
+        for (unsigned i = 0; i < transportList->Length(); i++) {
+          if (!transportList->Get(i)->IsObject()) {
+            throw JSException("transports entries must be objects");
+          }
+          createTransport(transportList->Get(i)->ToObject());
+        }
+      } else {
+        // Single UDP transport
+        Local<Object> transport = Object::New();
+        setKey(transport, "type", "udp");
+        setKey(transport, "port", options->Has(String::NewSymbol("port"))
+               ? options->Get(String::NewSymbol("port"))->ToUint32()->Value()
+               : 5060u);
+        createTransport(transport);
+      }
+
+      // PJSIP's worker threads are already running, so only start
+      // looking up transports once the list is complete
+      transportStats.registerModule();
+    }
+
+    /* Set null sound device */
+    {
+      pj_status_t status = pjsua_set_null_snd_dev();
+      if (status != PJ_SUCCESS) {
+        throw PJJSException("Error setting null sound device", status);
+        abort();
+      }
+    }
+
+    /* Initialization is done, now start pjsua */
+    {
+      pj_status_t status = pjsua_start();
+      if (status != PJ_SUCCESS) {
+        throw PJJSException("Error starting pjsua", status);
+      }
+    }
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::addAccount(const Arguments& args)
+{
+  NodeMutex::Lock lock("addAccount", _nodeMutex);
+  HandleScope scope;
+  try {
+    if (args.Length() != 3) {
+      throw JSException("Invalid number of arguments to addAccount, need sipUser, sipDomain and sipPassword");
+    }
+
+    const string sipUser = *String::Utf8Value(args[0]);
+    const string sipDomain = *String::Utf8Value(args[1]);
+    const string sipPassword = *String::Utf8Value(args[2]);
+
+    const string id = "sip:" + sipUser + "@" + sipDomain;
+    const string regUri = "sip:" + sipDomain;
+  
+    /* Register to SIP server by creating SIP account. */
+    {
+      pjsua_acc_id acc_id;
+
+      pjsua_acc_config_default(&_accConfig);
+      _accConfig.id = pj_str((char*) id.c_str());
+      _accConfig.reg_uri = pj_str((char*) regUri.c_str());
+      _accConfig.cred_count = 1;
+      _accConfig.cred_info[0].realm = pj_str((char*) sipDomain.c_str());
+      _accConfig.cred_info[0].scheme = pj_str((char*) "digest");
+      _accConfig.cred_info[0].username = pj_str((char*) sipUser.c_str());
+      _accConfig.cred_info[0].data_type = PJSIP_CRED_DATA_PLAIN_PASSWD;
+      _accConfig.cred_info[0].data = pj_str((char*) sipPassword.c_str());
+      _accConfig.allow_contact_rewrite = 1;
+
+      {
+        NodeMutex::Unlock lock("addAccount", _nodeMutex);
+        pj_status_t status = pjsua_acc_add(&_accConfig, PJ_TRUE, &acc_id);
+        if (status != PJ_SUCCESS) {
+          throw PJJSException("Error adding account", status);
+        }
+      }
+      return Integer::New(acc_id);
+    }
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Add many accounts with staggered registrations, see
+// AccountProvisioner.  accounts is an array of objects with the
+// properties user, domain, password and optionally registrar (default:
+// domain) and reg_timeout (seconds).  Options:
+//
+// reg_rate           accounts to add per second (default: 10)
+// jitter             fraction by which the spacing of the additions and
+//                    the registration intervals vary (default: 0.1)
+// progress_interval  milliseconds between accounts_progress events
+//                    (default: 1000), applies to all running batches
+//
+// Returns the batch ID that identifies the accounts_progress events.
+Handle<Value>
+PJSUA::addAccounts(const Arguments& args)
+{
+  HandleScope scope;
+  vector<AccountProvisioner::Account*> accounts;
+  try {
+    if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsArray()) {
+      throw JSException("Invalid arguments to addAccounts (accounts[, options])");
+    }
+
+    double regRate = 10;
+    double jitter = 0.1;
+    double progressInterval = 1.0;
+    if (args.Length() == 2) {
+      Local<Object> options = args[1]->ToObject();
+      if (options->Has(String::NewSymbol("reg_rate"))) {
+        regRate = options->Get(String::NewSymbol("reg_rate"))->NumberValue();
+        if (!(regRate > 0)) {
+          throw JSException("reg_rate must be positive");
+        }
+      }
+      if (options->Has(String::NewSymbol("jitter"))) {
+        jitter = options->Get(String::NewSymbol("jitter"))->NumberValue();
+        if (!(jitter >= 0 && jitter <= 1)) {
+          throw JSException("jitter must be between 0 and 1");
+        }
+      }
+      if (options->Has(String::NewSymbol("progress_interval"))) {
+        progressInterval = max(0.01, options->Get(String::NewSymbol("progress_interval"))->NumberValue() / 1000.0);
+      }
+    }
+
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    for (unsigned i = 0; i < list->Length(); i++) {
+      if (!list->Get(i)->IsObject()) {
+        throw JSException("addAccounts list entries must be objects");
+      }
+      Local<Object> entry = list->Get(i)->ToObject();
+      if (!entry->Has(String::NewSymbol("user")) || !entry->Has(String::NewSymbol("domain"))) {
+        throw JSException("addAccounts list entry without user or domain");
+      }
+
+      AccountProvisioner::Account* account = new AccountProvisioner::Account;
+      accounts.push_back(account);
+      account->user = *String::Utf8Value(entry->Get(String::NewSymbol("user")));
+      account->domain = *String::Utf8Value(entry->Get(String::NewSymbol("domain")));
+      if (entry->Has(String::NewSymbol("password"))) {
+        account->password = *String::Utf8Value(entry->Get(String::NewSymbol("password")));
+      }
+      if (entry->Has(String::NewSymbol("registrar"))) {
+        account->registrar = *String::Utf8Value(entry->Get(String::NewSymbol("registrar")));
+      }
+      account->regTimeout = PJSUA_REG_INTERVAL;
+      if (entry->Has(String::NewSymbol("reg_timeout"))) {
+        account->regTimeout = entry->Get(String::NewSymbol("reg_timeout"))->Uint32Value();
+      }
+    }
+
+    uint32_t batch = accountProvisioner.enqueue(dispatch, accounts, regRate, jitter, progressInterval);
+
+    return scope.Close(Integer::NewFromUnsigned(batch));
+  }
+  catch (const JSException& e) {
+    for (vector<AccountProvisioner::Account*>::iterator i = accounts.begin(); i != accounts.end(); i++) {
+      delete *i;
+    }
+    return e.asV8Exception();
+  }
+}
+
+// Add an account that is not registered anywhere and uses the
+// address of a transport, to make and receive calls without a
+// registrar.
+Handle<Value>
+PJSUA::addLocalAccount(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() > 1) {
+      throw JSException("Invalid number of arguments to addLocalAccount ([transportId])");
+    }
+
+    pjsua_transport_id transportId = (args.Length() == 1) ? args[0]->Int32Value() : 0;
+
+    pjsua_acc_id acc_id;
+    pj_status_t status = pjsua_acc_add_local(transportId, PJ_TRUE, &acc_id);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error adding local account", status);
+    }
+
+    return Integer::New(acc_id);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::getAudioDevices(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    pjmedia_aud_dev_info deviceInfosBinary[64];
+    unsigned deviceCount = 64;
+
+    pj_status_t status = pjsua_enum_aud_devs(deviceInfosBinary, &deviceCount);
+
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error getting list of audio devices", status);
+    }
+
+    Local<Array> deviceInfos = Array::New();
+
+    for (unsigned i = 0; i < deviceCount; i++) {
+      pjmedia_aud_dev_info& deviceInfoBinary = deviceInfosBinary[i];
+      Local<Object> deviceInfo = deviceInfoShape.newObject();
+      setKey(deviceInfo, deviceInfoShape.key(DEVICE_NAME), deviceInfoBinary.name);
+      setKey(deviceInfo, deviceInfoShape.key(DEVICE_INPUT_COUNT), deviceInfoBinary.input_count);
+      setKey(deviceInfo, deviceInfoShape.key(DEVICE_OUTPUT_COUNT), deviceInfoBinary.output_count);
+      setKey(deviceInfo, deviceInfoShape.key(DEVICE_DEFAULT_SAMPLES_PER_SEC), deviceInfoBinary.default_samples_per_sec);
+      deviceInfos->Set(i, deviceInfo);
+    }
+
+    return deviceInfos;
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::callAnswer(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() < 1 || args.Length() > 4) {
+      throw JSException("Invalid number of arguments to callAnswer (callId[, status[, reason[, msg_data]]])");
+    }
+
+    pjsua_call_id call_id;
+    unsigned code = 200;
+    pj_str_t* reason = 0;
+    pjsua_msg_data* msg_data = 0;
+
+    switch (args.Length()) {
+      // FIXME: implement reason/msg_data
+    case 4:
+    case 3:
+      throw JSException("reason and msg_data arguments not implemented");
+    case 2:
+      code = args[1]->Int32Value();
+    case 1:
+      call_id = args[0]->Int32Value();
+    }
+
+    pj_status_t status = pjsua_call_answer(call_id, code, reason, msg_data);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error answering call", status);
+    }
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::callHangup(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() < 1 || args.Length() > 4) {
+      throw JSException("Invalid number of arguments to callHangup (callId[, status[, reason[, msg_data]]])");
+    }
+
+    pjsua_call_id call_id = args[0]->Int32Value();
+    unsigned code = 0;
+    pj_str_t* reason = 0;
+    pjsua_msg_data* msg_data = 0;
+
+    switch (args.Length()) {
+      // FIXME: implement reason/msg_data
+    case 4:
+    case 3:
+      throw JSException("reason and msg_data arguments not implemented");
+    case 2:
+      code = args[1]->Int32Value();
+    }
+
+    pj_status_t status = pjsua_call_hangup(call_id, code, reason, msg_data);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error hanging up", status);
+    }
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Return the full state of a call.  In delta mode, this is the state
+// that JavaScript has last been told about through events.
+Handle<Value>
+PJSUA::callGetInfo(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to getCallInfo (callId)");
+    }
+
+    pjsua_call_id call_id = args[0]->Int32Value();
+
+    if (callStateCache.enabled()) {
+      Handle<Object> callInfo = callStateCache.get(call_id);
+      if (!callInfo.IsEmpty()) {
+        return scope.Close(callInfo);
+      }
+    }
+
+    if (!pjsua_call_is_active(call_id)) {
+      throw JSException("Invalid or inactive call ID");
+    }
+
+    return scope.Close(getCallInfo(call_id));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Selects calls for getCalls() and hangupAll().  All criteria are
+// optional:
+//
+// acc_id      account ID of the call
+// state       call state, or an array of call states
+// older_than  minimum total duration of the call in seconds
+class CallFilter
+{
+public:
+  CallFilter(Handle<Value> filter)
+    : _accId(PJSUA_INVALID_ID),
+      _olderThan(0)
+  {
+    if (filter.IsEmpty() || filter->IsUndefined()) {
+      return;
+    }
+    if (!filter->IsObject()) {
+      throw JSException("call filter must be an object");
+    }
+    Local<Object> options = filter->ToObject();
+    if (options->Has(String::NewSymbol("acc_id"))) {
+      _accId = options->Get(String::NewSymbol("acc_id"))->Int32Value();
+    }
+    if (options->Has(String::NewSymbol("state"))) {
+      Local<Value> state = options->Get(String::NewSymbol("state"));
+      if (state->IsArray()) {
+        Local<Array> states = Local<Array>::Cast(state);
+        for (unsigned i = 0; i < states->Length(); i++) {
+          _states.push_back((pjsip_inv_state) states->Get(i)->Int32Value());
+        }
+      } else {
+        _states.push_back((pjsip_inv_state) state->Int32Value());
+      }
+    }
+    if (options->Has(String::NewSymbol("older_than"))) {
+      _olderThan = options->Get(String::NewSymbol("older_than"))->NumberValue();
+    }
+  }
+
+  bool matches(const pjsua_call_info& info) const
+  {
+    return (_accId == PJSUA_INVALID_ID || info.acc_id == _accId)
+      && (_states.empty() || find(_states.begin(), _states.end(), info.state) != _states.end())
+      && PJ_TIME_VAL_TO_DOUBLE(info.total_duration) >= _olderThan;
+  }
+
+private:
+  pjsua_acc_id _accId;
+  vector<pjsip_inv_state> _states;
+  double _olderThan;
+};
+
+// Return a summary of all calls, optionally filtered, in one pass
+// over the call table
+Handle<Value>
+PJSUA::getCalls(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() > 1) {
+      throw JSException("Invalid number of arguments to getCalls([filter])");
+    }
+    CallFilter filter(args[0]);
+
+    pjsua_call_id ids[PJSUA_MAX_CALLS];
+    unsigned count = PJSUA_MAX_CALLS;
+    pj_status_t status = pjsua_enum_calls(ids, &count);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error enumerating calls", status);
+    }
+
+    Local<Array> calls = Array::New();
+    unsigned matching = 0;
+    for (unsigned i = 0; i < count; i++) {
+      pjsua_call_info info;
+      if (pjsua_call_get_info(ids[i], &info) != PJ_SUCCESS || !filter.matches(info)) {
+        continue;                                           // disconnected in the meantime
+      }
+      Local<Object> call = callSummaryShape.newObject();
+      setKey(call, callSummaryShape.key(SUMMARY_ID), info.id);
+      setKey(call, callSummaryShape.key(SUMMARY_ACC_ID), info.acc_id);
+      setKey(call, callSummaryShape.key(SUMMARY_ROLE), roleNames.idToSymbol(info.role));
+      setKey(call, callSummaryShape.key(SUMMARY_STATE), (int) info.state);
+      setKey(call, callSummaryShape.key(SUMMARY_REMOTE_INFO), info.remote_info);
+      setKey(call, callSummaryShape.key(SUMMARY_CONNECT_DURATION), PJ_TIME_VAL_TO_DOUBLE(info.connect_duration));
+      setKey(call, callSummaryShape.key(SUMMARY_TOTAL_DURATION), PJ_TIME_VAL_TO_DOUBLE(info.total_duration));
+      calls->Set(matching++, call);
+    }
+
+    return scope.Close(calls);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Copy the row of the call from the CallTable into row with memory
+// fences, for CPUs on which pjsip.callTable cannot be read directly.
+// Returns row, or null if a writer held the row for too long.
+Handle<Value>
+PJSUA::readCallTableRow(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 2 || !args[1]->IsObject()) {
+      throw JSException("Invalid arguments to readCallTableRow(callId, row)");
+    }
+    int callId = args[0]->Int32Value();
+    if (callId < 0 || callId >= (int) PJSUA_MAX_CALLS) {
+      throw JSException("Invalid call ID passed to readCallTableRow");
+    }
+    Local<Object> row = args[1]->ToObject();
+    if (!callTable.readRow(callId, row)) {
+      return Null();
+    }
+    return scope.Close(row);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Return the registration state of the given accounts, or of all
+// accounts that have received a registration response, see
+// RegistrationTable.  Accounts without a response yield undefined.
+Handle<Value>
+PJSUA::getRegistrations(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() > 1 || (args.Length() == 1 && !args[0]->IsArray())) {
+      throw JSException("Invalid arguments to getRegistrations([accIds])");
+    }
+
+    Local<Array> registrations = Array::New();
+    if (args.Length() == 1) {
+      Local<Array> accIds = Local<Array>::Cast(args[0]);
+      for (unsigned i = 0; i < accIds->Length(); i++) {
+        int accId = accIds->Get(i)->Int32Value();
+        if (accId < 0 || accId >= (int) PJSUA_MAX_ACC) {
+          throw JSException("Invalid account ID passed to getRegistrations");
+        }
+        registrations->Set(i, registrationTable.get(accId));
+      }
+    } else {
+      unsigned count = 0;
+      for (pjsua_acc_id accId = 0; accId < (pjsua_acc_id) PJSUA_MAX_ACC; accId++) {
+        Handle<Value> registration = registrationTable.get(accId);
+        if (!registration->IsUndefined()) {
+          registrations->Set(count++, registration);
+        }
+      }
+    }
+
+    return scope.Close(registrations);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Hang up all calls matching the filter, which may also specify the
+// status code to use.  Returns the IDs of the calls hung up.
+Handle<Value>
+PJSUA::hangupAll(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() > 1) {
+      throw JSException("Invalid number of arguments to hangupAll([filter])");
+    }
+    CallFilter filter(args[0]);
+    unsigned code = 0;
+    if (args.Length() == 1 && args[0]->IsObject() && args[0]->ToObject()->Has(String::NewSymbol("code"))) {
+      code = args[0]->ToObject()->Get(String::NewSymbol("code"))->Uint32Value();
+    }
+
+    pjsua_call_id ids[PJSUA_MAX_CALLS];
+    unsigned count = PJSUA_MAX_CALLS;
+    pj_status_t status = pjsua_enum_calls(ids, &count);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error enumerating calls", status);
+    }
+
+    Local<Array> hungUp = Array::New();
+    unsigned hungUpCount = 0;
+    for (unsigned i = 0; i < count; i++) {
+      pjsua_call_info info;
+      if (pjsua_call_get_info(ids[i], &info) != PJ_SUCCESS || !filter.matches(info)) {
+        continue;
+      }
+      if (pjsua_call_hangup(ids[i], code, 0, 0) == PJ_SUCCESS) {
+        hungUp->Set(hungUpCount++, Integer::New(ids[i]));
+      }
+    }
+
+    return scope.Close(hungUp);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::callMakeCall(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() < 2 || args.Length() > 5) {
+      throw JSException("Invalid number of arguments to callMakeCall (accId, destUri[, options[, user_data[, msg_data]]])");
+    }
+
+    pjsua_acc_id acc_id = args[0]->Int32Value();
+    String::Utf8Value dest_uri(args[1]);
+    unsigned options = 0;
+    void* user_data = 0;
+    pjsua_msg_data* msg_data = 0;
+    pjsua_call_id call_id = 0;
+
+    switch (args.Length()) {
+      // FIXME: implement options/user_data/msg_data
+    case 5:
+    case 4:
+    case 3:
+      throw JSException("options, user_data and msg_data arguments not implemented");
+    }
+
+    pj_str_t pj_dest_uri;
+    pj_dest_uri.ptr = (char*) *dest_uri;
+    pj_dest_uri.slen = dest_uri.length();
+
+    pj_status_t status = pjsua_call_make_call(acc_id, &pj_dest_uri, options, user_data, msg_data, &call_id);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error making call", status);
+    }
+
+    return Integer::New(call_id);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Queue outgoing calls to be placed by the call origination thread.
+// list is an array of objects with the properties acc_id, dest_uri
+// and id, the correlation ID reported in the call_made and
+// call_failed events.  The options cps (default: 10, 0 for no
+// pacing) and max_in_flight (default: 0 for no limit) change the
+// pacing of all queued calls, so the call rate can be ramped up by
+// calling callMakeCallBatch([], { cps: ... }).  Returns the number of
+// calls queued.
+Handle<Value>
+PJSUA::callMakeCallBatch(const Arguments& args)
+{
+  HandleScope scope;
+  vector<CallOriginator::Request*> requests;
+  try {
+    if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsArray()) {
+      throw JSException("Invalid arguments to callMakeCallBatch (list[, options])");
+    }
+
+    if (args.Length() == 2) {
+      if (!args[1]->IsObject()) {
+        throw JSException("Invalid options argument to callMakeCallBatch");
+      }
+      Local<Object> options = args[1]->ToObject();
+      double cps = callOriginator.cps();
+      unsigned maxInFlight = callOriginator.maxInFlight();
+      if (options->Has(String::NewSymbol("cps"))) {
+        cps = options->Get(String::NewSymbol("cps"))->NumberValue();
+        if (!(cps >= 0)) {
+          throw JSException("cps must not be negative");
+        }
+      }
+      if (options->Has(String::NewSymbol("max_in_flight"))) {
+        maxInFlight = options->Get(String::NewSymbol("max_in_flight"))->Uint32Value();
+      }
+      callOriginator.configure(cps, maxInFlight);
+    }
+
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    for (unsigned i = 0; i < list->Length(); i++) {
+      if (!list->Get(i)->IsObject()) {
+        throw JSException("callMakeCallBatch list entries must be objects");
+      }
+      Local<Object> entry = list->Get(i)->ToObject();
+      if (!entry->Has(String::NewSymbol("dest_uri"))) {
+        throw JSException("callMakeCallBatch list entry without dest_uri");
+      }
+      pjsua_acc_id accId = entry->Get(String::NewSymbol("acc_id"))->Int32Value();
+      if (!pjsua_acc_is_valid(accId)) {
+        throw JSException("Invalid account ID in callMakeCallBatch list");
+      }
+      const string destUri = *String::Utf8Value(entry->Get(String::NewSymbol("dest_uri")));
+      const string correlationId = entry->Has(String::NewSymbol("id"))
+        ? *String::Utf8Value(entry->Get(String::NewSymbol("id")))
+        : "";
+      requests.push_back(new CallOriginator::Request(accId, destUri, correlationId));
+    }
+
+    if (!requests.empty()) {
+      callOriginator.start(dispatch);
+      callOriginator.enqueue(requests);
+    }
+
+    return scope.Close(Integer::NewFromUnsigned(requests.size()));
+  }
+  catch (const JSException& e) {
+    for (vector<CallOriginator::Request*>::iterator i = requests.begin(); i != requests.end(); i++) {
+      delete *i;
+    }
+    return e.asV8Exception();
+  }
+}
+
+// Return the correlation ID of a call placed by callMakeCallBatch(),
+// or undefined
+Handle<Value>
+PJSUA::callGetCorrelationId(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to getCallCorrelationId (callId)");
+    }
+
+    string correlationId;
+    if (!callOriginator.correlationId(args[0]->Int32Value(), correlationId)) {
+      return Undefined();
+    }
+
+    return scope.Close(String::New(correlationId.c_str(), correlationId.length()));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+PJSUA::stop(const Arguments& args)
+{
+  HandleScope scope;
+  logPipeline.stop();
+  return Undefined();
+}
+
+Handle<Value>
+PJSUA::getStats(const Arguments& args)
+{
+  HandleScope scope;
+
+  Local<Object> stats = Object::New();
+  setKey(stats, "event_queue", _eventQueue.getStats());
+  setKey(stats, "admission", admissionControl.getStats());
+  setKey(stats, "origination", callOriginator.getStats());
+  setKey(stats, "transports", transportStats.getStats());
+  setKey(stats, "locks", LockStats::getStats());
+  setKey(stats, "log", logPipeline.getStats());
+  setKey(stats, "delivery_latency", histogramToObject(deliveryLatency));
+
+  Local<Object> audio = Object::New();
+  double frames = 0;
+  double overruns = 0;
+  for (map<uint32_t, AudioTap*>::const_iterator i = audioTaps.begin(); i != audioTaps.end(); i++) {
+    frames += i->second->frames();
+    overruns += i->second->overruns();
+  }
+  setKey(audio, "taps", (unsigned) audioTaps.size());
+  setKey(audio, "frames", frames);
+  setKey(audio, "overruns", overruns);
+  setKey(audio, "slabs", slabPool.getStats());
+  setKey(stats, "audio", audio);
+  setKey(stats, "recording", recordingWriter.getStats());
+  setKey(stats, "prompts", promptCache.getStats());
+
+  return scope.Close(stats);
+}
+
+// Answer a deferred decision.  Returns false if the token is unknown,
+// i.e. if the decision has already timed out or cannot be changed
+// anymore.
+Handle<Value>
+PJSUA::respond(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 2) {
+      throw JSException("Invalid number of arguments to respond (token, verdict)");
+    }
+
+    uint32_t token = args[0]->Uint32Value();
+    int verdict = args[1]->IsBoolean() ? args[1]->BooleanValue() : args[1]->Int32Value();
+
+    return Boolean::New(decisionTable.respond(token, verdict));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// Create one entry of the transports option of start():
+//
+// type            "udp" (default) or "tcp".  The statistics of a TCP
+//                  transport only count connections to its port
+// port            local port (default: 5060)
+// address         local address to bind to (default: any)
+// public_address  address to publish in SIP messages
+// count           number of UDP sockets to bind to the same port with
+//                 SO_REUSEPORT so that the kernel spreads incoming
+//                 messages among them (default: 1)
+void
+PJSUA::createTransport(Handle<Object> options)
+{
+  string type = "udp";
+  if (options->Has(String::NewSymbol("type"))) {
+    type = *String::Utf8Value(options->Get(String::NewSymbol("type")));
+  }
+  unsigned port = 5060;
+  if (options->Has(String::NewSymbol("port"))) {
+    port = options->Get(String::NewSymbol("port"))->ToUint32()->Value();
+  }
+  string address;
+  if (options->Has(String::NewSymbol("address"))) {
+    address = *String::Utf8Value(options->Get(String::NewSymbol("address")));
+  }
+  string publicAddress;
+  if (options->Has(String::NewSymbol("public_address"))) {
+    publicAddress = *String::Utf8Value(options->Get(String::NewSymbol("public_address")));
+  }
+  unsigned count = 1;
+  if (options->Has(String::NewSymbol("count"))) {
+    count = max(1u, options->Get(String::NewSymbol("count"))->ToUint32()->Value());
+  }
+
+  if (type == "udp" && count > 1) {
+    for (unsigned i = 0; i < count; i++) {
+      pjsua_transport_id id = createReusePortUdpTransport(address, port, publicAddress);
+      transportStats.add(id, "udp", PJSIP_TRANSPORT_UDP, pjsua_var.tpdata[id].data.tp, port);
+    }
+    return;
+  }
+
+  pjsip_transport_type_e transportType;
+  if (type == "udp") {
+    transportType = PJSIP_TRANSPORT_UDP;
+  } else if (type == "tcp") {
+    transportType = PJSIP_TRANSPORT_TCP;
+  } else {
+    throw JSException("Unknown transport type " + type);
+  }
+
+  pjsua_transport_config_default(&_transportConfig);
+  _transportConfig.port = port;
+  _transportConfig.bound_addr = pj_str((char*) address.c_str());
+  _transportConfig.public_addr = pj_str((char*) publicAddress.c_str());
+
+  pjsua_transport_id id;
+  pj_status_t status = pjsua_transport_create(transportType, &_transportConfig, &id);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error creating transport", status);
+  }
+
+  transportStats.add(id, (transportType == PJSIP_TRANSPORT_UDP) ? "udp" : "tcp", transportType,
+                     (transportType == PJSIP_TRANSPORT_UDP) ? pjsua_var.tpdata[id].data.tp : 0,
+                     port);
+}
+
+// pjsua_transport_create() cannot share a port between sockets, so
+// the socket is created here and attached to a new UDP transport.
+// STUN is not used for these transports.
+pjsua_transport_id
+PJSUA::createReusePortUdpTransport(const string& address, unsigned port, const string& publicAddress)
+{
+  pj_sock_t sock;
+  pj_status_t status = pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &sock);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error creating UDP socket", status);
+  }
+
+  int one = 1;
+  status = pj_sock_setsockopt(sock, pj_SOL_SOCKET(), SO_REUSEPORT, &one, sizeof one);
+  if (status != PJ_SUCCESS) {
+    pj_sock_close(sock);
+    throw PJJSException("Error setting SO_REUSEPORT", status);
+  }
+
+  pj_sockaddr_in bindAddress;
+  pj_str_t bindHost = pj_str((char*) address.c_str());
+  status = pj_sockaddr_in_init(&bindAddress, address.empty() ? 0 : &bindHost, (pj_uint16_t) port);
+  if (status == PJ_SUCCESS) {
+    status = pj_sock_bind(sock, &bindAddress, sizeof bindAddress);
+  }
+  if (status != PJ_SUCCESS) {
+    pj_sock_close(sock);
+    throw PJJSException("Error binding UDP socket", status);
+  }
+
+  // Publish the configured address, the bound address or the address
+  // of the host, in that order
+  char hostBuffer[PJ_INET6_ADDRSTRLEN];
+  pjsip_host_port publishedName;
+  if (!publicAddress.empty()) {
+    publishedName.host = pj_str((char*) publicAddress.c_str());
+  } else if (!address.empty()) {
+    publishedName.host = pj_str((char*) address.c_str());
+  } else {
+    pj_sockaddr hostAddress;
+    status = pj_gethostip(pj_AF_INET(), &hostAddress);
+    if (status != PJ_SUCCESS) {
+      pj_sock_close(sock);
+      throw PJJSException("Error determining host address", status);
+    }
+    pj_sockaddr_print(&hostAddress, hostBuffer, sizeof hostBuffer, 0);
+    publishedName.host = pj_str(hostBuffer);
+  }
+  publishedName.port = port;
+
+  pjsip_transport* transport;
+  status = pjsip_udp_transport_attach(pjsua_get_pjsip_endpt(), sock, &publishedName, 1, &transport);
+  if (status != PJ_SUCCESS) {
+    pj_sock_close(sock);
+    throw PJJSException("Error attaching UDP transport", status);
+  }
+
+  pjsua_transport_id id;
+  status = pjsua_transport_register(transport, &id);
+  if (status != PJ_SUCCESS) {
+    throw PJJSException("Error registering UDP transport", status);
+  }
+
+  return id;
+}
+
+// Configure call admission control.  All rules are optional, calling
+// setAdmissionRules({}) admits all calls.
+//
+// max_calls              maximum number of concurrent calls
+// max_calls_per_account  maximum number of concurrent calls per account,
+//                        either a number or an object keyed by account ID
+// cps                    maximum rate of incoming calls per second
+// burst                  number of calls that may arrive at once (default: cps)
+// reject_code            status code for rejected calls (default: 503)
+// retry_after            Retry-After value in seconds, 0 for none (default: 5)
+Handle<Value>
+PJSUA::setAdmissionRules(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1 || !args[0]->IsObject()) {
+      throw JSException("Invalid arguments to setAdmissionRules (rules)");
+    }
+    Local<Object> rules = args[0]->ToObject();
+
+    unsigned maxCalls = 0;
+    if (rules->Has(String::NewSymbol("max_calls"))) {
+      maxCalls = rules->Get(String::NewSymbol("max_calls"))->Uint32Value();
+    }
+
+    unsigned maxCallsPerAccount = 0;
+    map<pjsua_acc_id, unsigned> accountLimits;
+    if (rules->Has(String::NewSymbol("max_calls_per_account"))) {
+      Local<Value> limits = rules->Get(String::NewSymbol("max_calls_per_account"));
+      if (limits->IsObject()) {
+        Local<Array> accIds = limits->ToObject()->GetPropertyNames();
+        for (unsigned i = 0; i < accIds->Length(); i++) {
+          Local<Value> accId = accIds->Get(i);
+          accountLimits[accId->Int32Value()] = limits->ToObject()->Get(accId)->Uint32Value();
+        }
+      } else {
+        maxCallsPerAccount = limits->Uint32Value();
+      }
+    }
+
+    double cps = 0;
+    if (rules->Has(String::NewSymbol("cps"))) {
+      cps = rules->Get(String::NewSymbol("cps"))->NumberValue();
+    }
+    double burst = max(1.0, cps);
+    if (rules->Has(String::NewSymbol("burst"))) {
+      burst = max(1.0, rules->Get(String::NewSymbol("burst"))->NumberValue());
+    }
+
+    int rejectCode = PJSIP_SC_SERVICE_UNAVAILABLE;
+    if (rules->Has(String::NewSymbol("reject_code"))) {
+      rejectCode = rules->Get(String::NewSymbol("reject_code"))->Int32Value();
+      if (rejectCode < 300 || rejectCode > 699) {
+        throw JSException("reject_code must be a final error status code");
+      }
+    }
+    unsigned retryAfter = 5;
+    if (rules->Has(String::NewSymbol("retry_after"))) {
+      retryAfter = rules->Get(String::NewSymbol("retry_after"))->Uint32Value();
+    }
 
-  delete _scope;
-  delete _locker;
+    admissionControl.configure(maxCalls, maxCallsPerAccount, accountLimits, cps, burst, rejectCode, retryAfter);
 
-  if (_hasSuspendedNode) {
-    _mutex.resumeNodeThread();
-    _nodeSuspended = false;
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
   }
-
-#ifdef DEBUG_LOCKS
-  cout << "Lock::~Lock() unlocked: " << _name << endl;
-#endif // DEBUG_LOCKS
 }
 
-NodeMutex::Unlock::Unlock(const string& name, NodeMutex& m)
-  : _name(name),
-    _mutex(m)
+// Change the log level at runtime.  console_level only applies when
+// the asynchronous log pipeline is not used, otherwise it follows
+// level.
+Handle<Value>
+PJSUA::setLogLevel(const Arguments& args)
 {
-#ifdef DEBUG_LOCKS
-  cout << "Unlock::Unlock(): " << _name << endl;
-#endif // DEBUG_LOCKS
-
-  _mutex._globalMutex.unlock();
+  HandleScope scope;
+  try {
+    if (args.Length() < 1 || args.Length() > 2) {
+      throw JSException("Invalid number of arguments to setLogLevel (level[, console_level])");
+    }
 
-#ifdef DEBUG_LOCKS
-  cout << "Unlock::Unlock unlocked: " << _name << endl;
-#endif // DEBUG_LOCKS
-}
+    int level = args[0]->Int32Value();
+    if (level < 0 || level > 6) {
+      throw JSException("log level must be between 0 and 6");
+    }
 
-NodeMutex::Unlock::~Unlock()
-{
-#ifdef DEBUG_LOCKS
-  cout << "Unlock::~Unlock(): " << _name << endl;
-#endif // DEBUG_LOCKS
+    _loggingConfig.level = level;
+    if (logPipeline.enabled()) {
+      _loggingConfig.console_level = level;
+    } else if (args.Length() == 2) {
+      _loggingConfig.console_level = args[1]->Uint32Value();
+    }
 
-  _mutex._globalMutex.lock();
+    // pjsua_reconfigure_logging() would reopen the log file, so only
+    // the levels are changed
+    pjsua_var.log_cfg.level = _loggingConfig.level;
+    pjsua_var.log_cfg.console_level = _loggingConfig.console_level;
+    pj_log_set_level(level);
 
-#ifdef DEBUG_LOCKS
-  cout << "Unlock::~Unlock locked: " << _name << endl;
-#endif // DEBUG_LOCKS
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
 }
 
-NodeMutex::NodeMutex()
-  : _nodeThreadId(pthread_self())
+void
+PJSUA::expireDecisions(EV_P_ ev_timer* w, int revents)
 {
-  ev_init(&_watcher, eventCallback);
-  _watcher.data = this;
-  ev_async_start(EV_DEFAULT_UC_ &_watcher);
+  decisionTable.expireAll();
 }
 
-NodeMutex::~NodeMutex()
+#ifdef PJSIP_BENCHMARK
+
+// //////////////////////////////////////////////////////////////////////
+
+// Microbenchmarks for the per event conversion helpers, built into
+// the separate pjsip_bench addon (node-waf configure --benchmark).
+// They run against synthetic info structures and need neither a
+// network nor a started PJSUA.
+
+static void
+syntheticCallInfo(pjsua_call_info& callInfoBinary)
 {
-  ev_async_stop(EV_DEFAULT_UC_ &_watcher);
+  pj_bzero(&callInfoBinary, sizeof callInfoBinary);
+  callInfoBinary.id = 1;
+  callInfoBinary.role = PJSIP_ROLE_UAS;
+  callInfoBinary.local_info = pj_str((char*) "<sip:2002@192.168.2.2>");
+  callInfoBinary.local_contact = pj_str((char*) "<sip:2002@192.168.2.10:5060>");
+  callInfoBinary.remote_info = pj_str((char*) "\"Alice\" <sip:2001@192.168.2.2>;tag=a7f3c9e1");
+  callInfoBinary.remote_contact = pj_str((char*) "<sip:2001@192.168.2.11:5060>");
+  callInfoBinary.call_id = pj_str((char*) "5b8e3f0a-7d41-4c2e-9a61-2f0c8d1e4b77");
+  callInfoBinary.state = PJSIP_INV_STATE_CONFIRMED;
+  callInfoBinary.state_text = pj_str((char*) "CONFIRMED");
+  callInfoBinary.last_status = PJSIP_SC_OK;
+  callInfoBinary.last_status_text = pj_str((char*) "OK");
+  callInfoBinary.media_status = PJSUA_CALL_MEDIA_ACTIVE;
+  callInfoBinary.media_dir = PJMEDIA_DIR_ENCODING_DECODING;
+  callInfoBinary.conf_slot = 1;
+  callInfoBinary.connect_duration.sec = 12;
+  callInfoBinary.total_duration.sec = 15;
 }
 
-void
-NodeMutex::setCallback(Local<Function> callback)
+static void
+syntheticAccInfo(pjsua_acc_info& accInfoBinary)
 {
-  _callback = Persistent<Function>::New(callback);
+  pj_bzero(&accInfoBinary, sizeof accInfoBinary);
+  accInfoBinary.id = 0;
+  accInfoBinary.is_default = PJ_TRUE;
+  accInfoBinary.acc_uri = pj_str((char*) "sip:2002@192.168.2.2");
+  accInfoBinary.has_registration = PJ_TRUE;
+  accInfoBinary.expires = 300;
+  accInfoBinary.status = PJSIP_SC_OK;
+  accInfoBinary.status_text = pj_str((char*) "OK");
+  accInfoBinary.online_status = PJ_TRUE;
+  accInfoBinary.online_status_text = pj_str((char*) "Online");
+  accInfoBinary.rpid.type = PJRPID_ELEMENT_TYPE_PERSON;
+  accInfoBinary.rpid.activity = PJRPID_ACTIVITY_UNKNOWN;
 }
 
-Local<Value>
-NodeMutex::invokeCallback(const char* eventName, int argc, ...)
+// Run op the given number of times and return the time and the V8
+// heap memory used per operation.  The loop runs in chunks that are
+// small enough to rarely trigger a scavenge, chunks during which the
+// heap shrank are not used for the memory figure.
+template <class Operation>
+static Handle<Object>
+measure(unsigned iterations, Operation& operation)
 {
-  Local<Value> args[argc + 1];
-  args[0] = String::New(eventName);
+  const unsigned chunkSize = 256;
 
-  va_list vl;
-  va_start(vl, argc);
-  for (int i = 0; i < argc; i++) {
-    args[i + 1] = *va_arg(vl, Handle<Value>);
-  }
+  uint64_t nanoseconds = 0;
+  double heapBytes = 0;
+  unsigned heapIterations = 0;
 
-  NodeMutex::Unlock unlock("invokeCallback", *this);
-  TryCatch tryCatch;
-  Local<Value> retval = _callback->Call(_callbackContext->Global(), argc + 1, args);
+  for (unsigned done = 0; done < iterations; done += chunkSize) {
+    unsigned count = min(chunkSize, iterations - done);
 
-  if (tryCatch.HasCaught()) {
-    FatalException(tryCatch);
+    HeapStatistics before;
+    V8::GetHeapStatistics(&before);
+    uint64_t start = monotonicNanoseconds();
+    {
+      HandleScope chunkScope;
+      for (unsigned i = 0; i < count; i++) {
+        HandleScope iterationScope;
+        operation();
+      }
+    }
+    nanoseconds += monotonicNanoseconds() - start;
+    HeapStatistics after;
+    V8::GetHeapStatistics(&after);
+
+    if (after.used_heap_size() >= before.used_heap_size()) {
+      heapBytes += after.used_heap_size() - before.used_heap_size();
+      heapIterations += count;
+    }
   }
 
-  return retval;
+  Local<Object> result = Object::New();
+  setKey(result, "ns_per_op", iterations ? (double) nanoseconds / iterations : 0.0);
+  setKey(result, "heap_bytes_per_op", heapIterations ? heapBytes / heapIterations : 0.0);
+  return result;
 }
 
-void
-NodeMutex::eventCallback(EV_P_ ev_async* w, int revents)
+struct SetKeyIntOperation
 {
-  NodeMutex* nodeMutex = reinterpret_cast<NodeMutex*>(w->data);
-  nodeMutex->suspend();
-}
+  SetKeyIntOperation() : target(Object::New()), key(String::NewSymbol("conf_slot")) {}
+  void operator()() { setKey(target, key, 42); }
+  Local<Object> target;
+  Local<String> key;
+};
 
-void
-NodeMutex::suspend()
+struct SetKeyStringOperation
 {
-  // set context in mutex so that other thread can access it (see invokeCallback / Lock)
-  _callbackContext = Persistent<Context>::New(Context::GetCurrent());
+  SetKeyStringOperation() : target(Object::New()), key(String::NewSymbol("remote_info")), value(pj_str((char*) "<sip:2001@192.168.2.2>")) {}
+  void operator()() { setKey(target, key, value); }
+  Local<Object> target;
+  Local<String> key;
+  pj_str_t value;
+};
 
-  Unlocker unlocker;            // relinquish control over v8
+template <class Snapshot>
+struct CaptureOperation
+{
+  CaptureOperation(const typename Snapshot::Info& info) : info(info) {}
+  void operator()() { snapshot.capture(info); }
+  Snapshot snapshot;
+  const typename Snapshot::Info& info;
+};
 
-  unique_lock<mutex> completeLock(_completeMutex);
+template <class Snapshot>
+struct ToObjectOperation
+{
+  ToObjectOperation(const Snapshot& snapshot) : snapshot(snapshot) {}
+  void operator()() { snapshot.toObject(); }
+  const Snapshot& snapshot;
+};
+
+struct WrapOperation
+{
+  WrapOperation(const CallSnapshot& snapshot) : snapshot(snapshot), arena(new SnapshotArena) {}
+  ~WrapOperation() { arena->release(); }
+  void operator()() { arena->wrap(snapshot); }
+  const CallSnapshot& snapshot;
+  SnapshotArena* arena;
+};
+
+struct IdToNameOperation
+{
+  IdToNameOperation() : id(0) {}
+  void operator()() { mediaStatusNames.idToSymbol((pjsua_call_media_status) (id++ & 3)); }
+  unsigned id;
+};
+
+struct NameToIdOperation
+{
+  void operator()() { mediaStatusNames.nameToId("MEDIA_ACTIVE"); }
+};
 
+// Pack the arguments of a call_state event the way NodeMutex and the
+// EventQueue do and invoke the callback, if one was given
+struct CallbackArgumentsOperation
+{
+  CallbackArgumentsOperation(const CallSnapshot& snapshot, Handle<Value> callback)
+    : snapshot(snapshot),
+      callback(callback)
+  {}
+  void operator()()
   {
-    unique_lock<mutex> proceedLock(_proceedMutex);
-    
-    _proceed.notify_one();      // tell the other thread to go ahead
+    Handle<Value> argv[PJSUAEvent::maxArguments + 1];
+    argv[0] = eventSymbol("call_state");
+    argv[1] = snapshot.toObject();
+    argv[2] = Undefined();
+    if (callback->IsFunction()) {
+      Handle<Function>::Cast(callback)->Call(Context::GetCurrent()->Global(), 3, argv);
+    }
   }
+  const CallSnapshot& snapshot;
+  Handle<Value> callback;
+};
 
-  _complete.wait(completeLock); // wait for the other thread to complete processing
-  // FIXME: _callbackContext needs to be released
-}
-
-void
-NodeMutex::suspendNodeThread()
+// Microbenchmark for the conversion of a call info structure to a
+// JavaScript object.  "legacy" builds the object the way it was done
+// before object shapes were introduced, using Object::New() and one
+// String::NewSymbol() lookup per field, "shaped" uses the interned
+// keys and the object template.  Times are in nanoseconds per object.
+Handle<Value>
+PJSUA::benchmarkMarshaling(const Arguments& args)
 {
-  unique_lock<mutex> lock(_proceedMutex);
+  HandleScope scope;
 
-  ev_async_send(EV_DEFAULT_ &_watcher);
+  const unsigned iterations = args.Length() ? args[0]->Uint32Value() : 100000;
 
-  _proceed.wait(lock);        // wait until Node's thread is suspended
-}
+  pjsua_call_info callInfoBinary;
+  syntheticCallInfo(callInfoBinary);
 
-void
-NodeMutex::resumeNodeThread()
-{
-  unique_lock<mutex> lock(_completeMutex);
+  CallSnapshot snapshot;
+  snapshot.capture(callInfoBinary);
 
-  _complete.notify_one();     // tell Node's that that we're done
-}
+  uint64_t start = monotonicNanoseconds();
+  for (unsigned i = 0; i < iterations; i++) {
+    HandleScope iterationScope;
+    Local<Object> callInfo = Object::New();
+    for (int j = 0; j < CallSnapshot::FIELD_COUNT; j++) {
+      callInfo->Set(String::NewSymbol(CallSnapshot::fieldNames[j]), snapshot.get(j));
+    }
+  }
+  const uint64_t legacy = monotonicNanoseconds() - start;
 
-// //////////////////////////////////////////////////////////////////////
+  start = monotonicNanoseconds();
+  for (unsigned i = 0; i < iterations; i++) {
+    HandleScope iterationScope;
+    snapshot.toObject();
+  }
+  const uint64_t shaped = monotonicNanoseconds() - start;
 
-void
-PJSUA::Initialize(Handle<Object> target)
-{
-  HandleScope scope;
+  Local<Object> result = Object::New();
+  setKey(result, "iterations", iterations);
+  setKey(result, "legacy", iterations ? (double) legacy / iterations : 0.0);
+  setKey(result, "shaped", iterations ? (double) shaped / iterations : 0.0);
 
-  target->Set(String::NewSymbol("start"), FunctionTemplate::New(start)->GetFunction());
-  target->Set(String::NewSymbol("addAccount"), FunctionTemplate::New(addAccount)->GetFunction());
-  target->Set(String::NewSymbol("getAudioDevices"), FunctionTemplate::New(getAudioDevices)->GetFunction());
-  target->Set(String::NewSymbol("setAudioDeviceIndex"), FunctionTemplate::New(setAudioDeviceIndex)->GetFunction());
-  target->Set(String::NewSymbol("confConnect"), FunctionTemplate::New(confConnect)->GetFunction());
-  target->Set(String::NewSymbol("callAnswer"), FunctionTemplate::New(callAnswer)->GetFunction());
-  target->Set(String::NewSymbol("callMakeCall"), FunctionTemplate::New(callMakeCall)->GetFunction());
-  target->Set(String::NewSymbol("callHangup"), FunctionTemplate::New(callHangup)->GetFunction());
-  target->Set(String::NewSymbol("stop"), FunctionTemplate::New(stop)->GetFunction());
+  return scope.Close(result);
 }
 
+// Run all microbenchmarks.  If a function is passed, it is invoked as
+// the event callback in the callback_arguments benchmark.
 Handle<Value>
-PJSUA::start(const Arguments& args)
+PJSUA::runBenchmarks(const Arguments& args)
 {
   HandleScope scope;
-  try {
-    Local<Object> options = Object::New();
 
-    switch (args.Length()) {
-    case 2:
-      options = args[1]->ToObject();
-    case 1:
-      if (!args[0]->IsFunction()) {
-        throw JSException("need callback function as argument");
-      }
-      break;
-    default:
-      throw JSException("unexpected number of arguments to PJSUA::start");
-    }
+  const unsigned iterations = args.Length() ? args[0]->Uint32Value() : 100000;
+  Handle<Value> callback = (args.Length() > 1) ? args[1] : Handle<Value>(Undefined());
 
-    _nodeMutex.setCallback(Local<Function>::Cast(args[0]));
+  pjsua_call_info callInfoBinary;
+  syntheticCallInfo(callInfoBinary);
+  CallSnapshot callSnapshot;
+  callSnapshot.capture(callInfoBinary);
 
-    /* Init pjsua */
-    {
-      pjsua_config_default(&_pjsuaConfig);
-      _pjsuaConfig.cb.on_call_state = on_call_state;
-      _pjsuaConfig.cb.on_incoming_call = on_incoming_call;
-      _pjsuaConfig.cb.on_call_tsx_state = on_call_tsx_state;
-      _pjsuaConfig.cb.on_call_media_state = on_call_media_state;
-      _pjsuaConfig.cb.on_stream_created = on_stream_created;
-      _pjsuaConfig.cb.on_stream_destroyed = on_stream_destroyed;
-      _pjsuaConfig.cb.on_dtmf_digit = on_dtmf_digit;
-      _pjsuaConfig.cb.on_call_transfer_request = on_call_transfer_request;
-      _pjsuaConfig.cb.on_call_transfer_status = on_call_transfer_status;
-      _pjsuaConfig.cb.on_call_replace_request = on_call_replace_request;
-      _pjsuaConfig.cb.on_call_replaced = on_call_replaced;
-      _pjsuaConfig.cb.on_reg_state2 = on_reg_state2;
-      _pjsuaConfig.cb.on_incoming_subscribe = on_incoming_subscribe;
-      _pjsuaConfig.cb.on_srv_subscribe_state = on_srv_subscribe_state;
-      _pjsuaConfig.cb.on_buddy_state = on_buddy_state;
-      _pjsuaConfig.cb.on_buddy_evsub_state = on_buddy_evsub_state;
-      _pjsuaConfig.cb.on_pager = on_pager;
-      _pjsuaConfig.cb.on_pager2 = on_pager2;
-      _pjsuaConfig.cb.on_pager_status = on_pager_status;
-      _pjsuaConfig.cb.on_pager_status2 = on_pager_status2;
-      _pjsuaConfig.cb.on_typing = on_typing;
-      _pjsuaConfig.cb.on_typing2 = on_typing2;
-      _pjsuaConfig.cb.on_nat_detect = on_nat_detect;
-      _pjsuaConfig.cb.on_mwi_info = on_mwi_info;
-      _pjsuaConfig.cb.on_transport_state = on_transport_state;
-      _pjsuaConfig.cb.on_ice_transport_error = on_ice_transport_error;
+  pjsua_acc_info accInfoBinary;
+  syntheticAccInfo(accInfoBinary);
+  AccSnapshot accSnapshot;
+  accSnapshot.capture(accInfoBinary);
 
-      pjsua_logging_config_default(&_loggingConfig);
+  Local<Object> result = Object::New();
+  setKey(result, "iterations", iterations);
+  {
+    SetKeyIntOperation operation;
+    setKey(result, "set_key_int", measure(iterations, operation));
+  }
+  {
+    SetKeyStringOperation operation;
+    setKey(result, "set_key_pj_str", measure(iterations, operation));
+  }
+  {
+    CaptureOperation<CallSnapshot> operation(callInfoBinary);
+    setKey(result, "call_info_capture", measure(iterations, operation));
+  }
+  {
+    ToObjectOperation<CallSnapshot> operation(callSnapshot);
+    setKey(result, "call_info_object", measure(iterations, operation));
+  }
+  {
+    WrapOperation operation(callSnapshot);
+    setKey(result, "call_info_lazy", measure(iterations, operation));
+  }
+  {
+    CaptureOperation<AccSnapshot> operation(accInfoBinary);
+    setKey(result, "acc_info_capture", measure(iterations, operation));
+  }
+  {
+    ToObjectOperation<AccSnapshot> operation(accSnapshot);
+    setKey(result, "acc_info_object", measure(iterations, operation));
+  }
+  {
+    IdToNameOperation operation;
+    setKey(result, "enum_id_to_name", measure(iterations, operation));
+  }
+  {
+    NameToIdOperation operation;
+    setKey(result, "enum_name_to_id", measure(iterations, operation));
+  }
+  {
+    CallbackArgumentsOperation operation(callSnapshot, callback);
+    setKey(result, "callback_arguments", measure(iterations, operation));
+  }
 
-      _loggingConfig.console_level = 0;
-      if (options->Has(String::NewSymbol("console_level"))) {
-        _loggingConfig.console_level = options->Get(String::NewSymbol("console_level"))->ToUint32()->Value();
-      }
-      _loggingConfig.level = 1;
-      if (options->Has(String::NewSymbol("level"))) {
-        _loggingConfig.level = options->Get(String::NewSymbol("level"))->ToUint32()->Value();
-      }
-      if (options->Has(String::NewSymbol("log_filename"))) {
-        const string log_filename = *String::Utf8Value(options->Get(String::NewSymbol("log_filename")));
-        _loggingConfig.log_filename = pj_str((char*) log_filename.c_str());
-      }
+  return scope.Close(result);
+}
 
-      string stunServer;
-      if (options->Has(String::NewSymbol("stun_server"))) {
-        stunServer = *String::Utf8Value(options->Get(String::NewSymbol("stun_server")));
-        _pjsuaConfig.stun_srv[0] = pj_str((char*) stunServer.c_str());
-        _pjsuaConfig.stun_srv_cnt = 1;
-      }
+#endif // PJSIP_BENCHMARK
 
-      pj_status_t status = pjsua_init(&_pjsuaConfig, &_loggingConfig, NULL);
-      if (status != PJ_SUCCESS) {
-        throw PJJSException("Error creating transport", status);
-      }
+Handle<Value>
+PJSUA::confConnect(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 2) {
+      throw JSException("Invalid number of arguments to confConnect(source, sink)");
+    }
+    const pjsua_conf_port_id source = args[0]->Int32Value();
+    const pjsua_conf_port_id sink = args[1]->Int32Value();
+    pj_status_t status = pjsua_conf_connect(source, sink);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error connecting media", status);
+    }
+    levelMeter.connected(source, sink);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+
+  return Undefined();
+}
+  
+// Apply a list of conference bridge changes in one call.  Each entry
+// is an object with op and the properties that the operation needs:
+//
+// connect, disconnect  src, sink
+// rx_level, tx_level   src, level (1.0 leaves the level unchanged,
+//                      0.0 mutes)
+//
+// Connections have no level of their own, a level on a connect or
+// disconnect entry is rejected.  The whole list is validated first
+// and then applied while holding the PJSUA lock, which keeps other
+// PJSUA API calls out.  The bridge takes its own mutex for each
+// operation, so the media clock may mix frames between two operations
+// of the list.  Application stops at the first operation that fails.
+// Returns the number of operations applied.
+Handle<Value>
+PJSUA::confApply(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1 || !args[0]->IsArray()) {
+      throw JSException("Invalid arguments to confApply(operations)");
     }
 
-    /* Add UDP transport. */
+    enum Op { CONNECT, DISCONNECT, RX_LEVEL, TX_LEVEL };
+    struct Operation
     {
-      pjsua_transport_config_default(&_transportConfig);
-
-      if (options->Has(String::NewSymbol("port"))) {
-        _transportConfig.port = options->Get(String::NewSymbol("port"))->ToUint32()->Value();
+      Op op;
+      pjsua_conf_port_id src;
+      pjsua_conf_port_id sink;
+      float level;
+    };
+
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    vector<Operation> operations(list->Length());
+    for (unsigned i = 0; i < list->Length(); i++) {
+      if (!list->Get(i)->IsObject()) {
+        throw JSException("confApply operations must be objects");
+      }
+      Local<Object> entry = list->Get(i)->ToObject();
+      Operation& operation = operations[i];
+
+      const string op = *String::Utf8Value(entry->Get(String::NewSymbol("op")));
+      if (op == "connect") {
+        operation.op = CONNECT;
+      } else if (op == "disconnect") {
+        operation.op = DISCONNECT;
+      } else if (op == "rx_level") {
+        operation.op = RX_LEVEL;
+      } else if (op == "tx_level") {
+        operation.op = TX_LEVEL;
       } else {
-        _transportConfig.port = 5060;
+        throw JSException("Unknown confApply operation " + op);
       }
 
-      pj_status_t status = pjsua_transport_create(PJSIP_TRANSPORT_UDP, &_transportConfig, NULL);
-      if (status != PJ_SUCCESS) {
-        throw PJJSException("Error creating transport", status);
+      if (!entry->Has(String::NewSymbol("src"))) {
+        throw JSException("confApply operation " + op + " needs src");
+      }
+      operation.src = entry->Get(String::NewSymbol("src"))->Int32Value();
+      if (operation.op == CONNECT || operation.op == DISCONNECT) {
+        if (!entry->Has(String::NewSymbol("sink"))) {
+          throw JSException("confApply operation " + op + " needs sink");
+        }
+        if (entry->Has(String::NewSymbol("level"))) {
+          throw JSException("confApply operation " + op + " does not take a level, use rx_level or tx_level");
+        }
+        operation.sink = entry->Get(String::NewSymbol("sink"))->Int32Value();
+      } else {
+        if (!entry->Has(String::NewSymbol("level"))) {
+          throw JSException("confApply operation " + op + " needs level");
+        }
+        operation.level = (float) entry->Get(String::NewSymbol("level"))->NumberValue();
       }
     }
 
-    /* Set null sound device */
-    {
-      pj_status_t status = pjsua_set_null_snd_dev();
-      if (status != PJ_SUCCESS) {
-        throw PJJSException("Error setting null sound device", status);
-        abort();
+    unsigned applied = 0;
+    pj_status_t status = PJ_SUCCESS;
+    PJSUA_LOCK();
+    for (; applied < operations.size() && status == PJ_SUCCESS; applied++) {
+      const Operation& operation = operations[applied];
+      switch (operation.op) {
+      case CONNECT:
+        status = pjsua_conf_connect(operation.src, operation.sink);
+        break;
+      case DISCONNECT:
+        status = pjsua_conf_disconnect(operation.src, operation.sink);
+        break;
+      case RX_LEVEL:
+        status = pjsua_conf_adjust_rx_level(operation.src, operation.level);
+        break;
+      case TX_LEVEL:
+        status = pjsua_conf_adjust_tx_level(operation.src, operation.level);
+        break;
       }
     }
-
-    /* Initialization is done, now start pjsua */
-    {
-      pj_status_t status = pjsua_start();
-      if (status != PJ_SUCCESS) {
-        throw PJJSException("Error starting pjsua", status);
+    PJSUA_UNLOCK();
+
+    // Let the tx meters follow the topology
+    for (unsigned i = 0; i < applied; i++) {
+      const Operation& operation = operations[i];
+      if (operation.op == CONNECT) {
+        levelMeter.connected(operation.src, operation.sink);
+      } else if (operation.op == DISCONNECT) {
+        levelMeter.disconnected(operation.src, operation.sink);
       }
     }
 
-    return Undefined();
+    if (status != PJ_SUCCESS) {
+      char index[16];
+      snprintf(index, sizeof index, "%u", applied - 1);
+      throw PJJSException(string("Error applying conference operation ") + index, status);
+    }
+
+    return scope.Close(Integer::NewFromUnsigned(applied));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
 }
 
+// List the ports of the conference bridge with the slots they
+// transmit to
 Handle<Value>
-PJSUA::addAccount(const Arguments& args)
+PJSUA::confListPorts(const Arguments& args)
 {
-  NodeMutex::Lock lock("addAccount", _nodeMutex);
   HandleScope scope;
   try {
-    if (args.Length() != 3) {
-      throw JSException("Invalid number of arguments to addAccount, need sipUser, sipDomain and sipPassword");
+    if (args.Length() != 0) {
+      throw JSException("confListPorts takes no arguments");
     }
 
-    const string sipUser = *String::Utf8Value(args[0]);
-    const string sipDomain = *String::Utf8Value(args[1]);
-    const string sipPassword = *String::Utf8Value(args[2]);
+    pjsua_conf_port_id ids[PJSUA_MAX_CONF_PORTS];
+    unsigned count = PJSUA_MAX_CONF_PORTS;
+    pj_status_t status = pjsua_enum_conf_ports(ids, &count);
+    if (status != PJ_SUCCESS) {
+      throw PJJSException("Error enumerating conference ports", status);
+    }
 
-    const string id = "sip:" + sipUser + "@" + sipDomain;
-    const string regUri = "sip:" + sipDomain;
-  
-    /* Register to SIP server by creating SIP account. */
-    {
-      pjsua_acc_id acc_id;
+    Local<Array> ports = Array::New();
+    unsigned listed = 0;
+    for (unsigned i = 0; i < count; i++) {
+      pjsua_conf_port_info info;
+      if (pjsua_conf_get_port_info(ids[i], &info) != PJ_SUCCESS) {
+        continue;                                           // removed in the meantime
+      }
+      Local<Array> listeners = Array::New(info.listener_cnt);
+      for (unsigned j = 0; j < info.listener_cnt; j++) {
+        listeners->Set(j, Integer::New(info.listeners[j]));
+      }
+      Local<Object> port = confPortShape.newObject();
+      setKey(port, confPortShape.key(CONF_PORT_SLOT), info.slot_id);
+      setKey(port, confPortShape.key(CONF_PORT_NAME), info.name);
+      setKey(port, confPortShape.key(CONF_PORT_CLOCK_RATE), info.clock_rate);
+      setKey(port, confPortShape.key(CONF_PORT_CHANNEL_COUNT), info.channel_count);
+      setKey(port, confPortShape.key(CONF_PORT_SAMPLES_PER_FRAME), info.samples_per_frame);
+      setKey(port, confPortShape.key(CONF_PORT_LISTENERS), listeners);
+      ports->Set(listed++, port);
+    }
 
-      pjsua_acc_config_default(&_accConfig);
-      _accConfig.id = pj_str((char*) id.c_str());
-      _accConfig.reg_uri = pj_str((char*) regUri.c_str());
-      _accConfig.cred_count = 1;
-      _accConfig.cred_info[0].realm = pj_str((char*) sipDomain.c_str());
-      _accConfig.cred_info[0].scheme = pj_str((char*) "digest");
-      _accConfig.cred_info[0].username = pj_str((char*) sipUser.c_str());
-      _accConfig.cred_info[0].data_type = PJSIP_CRED_DATA_PLAIN_PASSWD;
-      _accConfig.cred_info[0].data = pj_str((char*) sipPassword.c_str());
-      _accConfig.allow_contact_rewrite = 1;
+    return scope.Close(ports);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
 
-      {
-        NodeMutex::Unlock lock("addAccount", _nodeMutex);
-        pj_status_t status = pjsua_acc_add(&_accConfig, PJ_TRUE, &acc_id);
-        if (status != PJ_SUCCESS) {
-          throw PJJSException("Error adding account", status);
-        }
+// The media functions need the conference bridge that start() creates
+static void
+requireBridge(const char* function)
+{
+  if (!pjsua_var.mconf) {
+    throw JSException(string(function) + ": not started");
+  }
+}
+
+// Meter the given conference slots (a number or an array), see
+// LevelMeter.  The levels are read from pjsip.levels.  Every metered
+// slot uses two ports of the bridge, see max_media_ports.  Options:
+//
+// vad_threshold  RMS relative to full scale above which voice is
+//                detected (default: 0.01, i.e. -40 dBFS)
+// vad_hangover   milliseconds that voice activity is held after the
+//                level has dropped (default: 300)
+Handle<Value>
+PJSUA::startMetering(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() < 1 || args.Length() > 2) {
+      throw JSException("Invalid number of arguments to startMetering(slots[, options])");
+    }
+    requireBridge("startMetering");
+
+    double vadHangover = 0.3;
+    LevelMeter::Options meterOptions;
+    meterOptions.vadThreshold = 0.01f;
+    if (args.Length() == 2) {
+      Local<Object> options = args[1]->ToObject();
+      if (options->Has(String::NewSymbol("vad_threshold"))) {
+        meterOptions.vadThreshold = (float) options->Get(String::NewSymbol("vad_threshold"))->NumberValue();
       }
-      return Integer::New(acc_id);
+      if (options->Has(String::NewSymbol("vad_hangover"))) {
+        vadHangover = options->Get(String::NewSymbol("vad_hangover"))->NumberValue() / 1000.0;
+      }
+    }
+    const double frameDuration = (double) pjmedia_conf_get_samples_per_frame(pjsua_var.mconf)
+      / (pjmedia_conf_get_clock_rate(pjsua_var.mconf) * pjmedia_conf_get_channel_count(pjsua_var.mconf));
+    meterOptions.vadHangover = (unsigned) (vadHangover / frameDuration + 0.5);
+
+    if (args[0]->IsArray()) {
+      Local<Array> slots = Local<Array>::Cast(args[0]);
+      for (unsigned i = 0; i < slots->Length(); i++) {
+        levelMeter.start(slots->Get(i)->Int32Value(), meterOptions);
+      }
+    } else {
+      levelMeter.start(args[0]->Int32Value(), meterOptions);
     }
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
+
+  return Undefined();
 }
 
+// Stop metering the given slots (a number or an array).  Their levels
+// are reset to zero.
 Handle<Value>
-PJSUA::getAudioDevices(const Arguments& args)
+PJSUA::stopMetering(const Arguments& args)
 {
   HandleScope scope;
   try {
-    pjmedia_aud_dev_info deviceInfosBinary[64];
-    unsigned deviceCount = 64;
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to stopMetering(slots)");
+    }
+    if (args[0]->IsArray()) {
+      Local<Array> slots = Local<Array>::Cast(args[0]);
+      for (unsigned i = 0; i < slots->Length(); i++) {
+        levelMeter.stop(slots->Get(i)->Int32Value());
+      }
+    } else {
+      levelMeter.stop(args[0]->Int32Value());
+    }
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
 
-    pj_status_t status = pjsua_enum_aud_devs(deviceInfosBinary, &deviceCount);
+  return Undefined();
+}
 
-    if (status != PJ_SUCCESS) {
-      throw PJJSException("Error getting list of audio devices", status);
+// Tap the audio of a conference slot, see AudioTap.  Options:
+//
+// window       milliseconds of audio per audio event (default: 100)
+// ring_frames  frames buffered between the media clock and Node's
+//              thread (default and minimum: two windows)
+//
+// Returns the tap ID that identifies the audio events.  If the slot
+// belongs to a call, the tap is removed when the call is disconnected
+// and an audio_end event with the tap ID and call ID is delivered.
+Handle<Value>
+PJSUA::createAudioTap(const Arguments& args)
+{
+  HandleScope scope;
+  AudioTap* tap = 0;
+  try {
+    if (args.Length() < 1 || args.Length() > 2) {
+      throw JSException("Invalid number of arguments to createAudioTap(slot[, options])");
     }
+    requireBridge("createAudioTap");
+    const pjsua_conf_port_id source = args[0]->Int32Value();
 
-    Local<Array> deviceInfos = Array::New();
-
-    for (unsigned i = 0; i < deviceCount; i++) {
-      pjmedia_aud_dev_info& deviceInfoBinary = deviceInfosBinary[i];
-      Local<Object> deviceInfo = Object::New();
-      deviceInfo->Set(String::NewSymbol("name"), String::New(deviceInfoBinary.name));
-      deviceInfo->Set(String::NewSymbol("input_count"), Integer::New(deviceInfoBinary.input_count));
-      deviceInfo->Set(String::NewSymbol("output_count"), Integer::New(deviceInfoBinary.output_count));
-      deviceInfo->Set(String::NewSymbol("default_samples_per_sec"), Integer::New(deviceInfoBinary.default_samples_per_sec));
-      deviceInfos->Set(i, deviceInfo);
+    double window = 0.1;
+    unsigned ringFrames = 0;
+    if (args.Length() == 2) {
+      Local<Object> options = args[1]->ToObject();
+      if (options->Has(String::NewSymbol("window"))) {
+        window = options->Get(String::NewSymbol("window"))->NumberValue() / 1000.0;
+        if (!(window > 0)) {
+          throw JSException("window must be positive");
+        }
+      }
+      if (options->Has(String::NewSymbol("ring_frames"))) {
+        ringFrames = options->Get(String::NewSymbol("ring_frames"))->Uint32Value();
+      }
     }
 
-    return deviceInfos;
+    tap = new AudioTap(nextAudioTapId++, dispatch, window, ringFrames);
+    tap->attach(source);
+    audioTaps[tap->id()] = tap;
+
+    return scope.Close(Integer::NewFromUnsigned(tap->id()));
   }
   catch (const JSException& e) {
+    delete tap;
     return e.asV8Exception();
   }
 }
 
 Handle<Value>
-PJSUA::callAnswer(const Arguments& args)
+PJSUA::destroyAudioTap(const Arguments& args)
 {
   HandleScope scope;
   try {
-    if (args.Length() < 1 || args.Length() > 4) {
-      throw JSException("Invalid number of arguments to callAnswer (callId[, status[, reason[, msg_data]]])");
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to destroyAudioTap(tapId)");
     }
+    map<uint32_t, AudioTap*>::iterator i = audioTaps.find(args[0]->Uint32Value());
+    if (i == audioTaps.end()) {
+      throw JSException("Unknown audio tap");
+    }
+    delete i->second;
+    audioTaps.erase(i);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
 
-    pjsua_call_id call_id;
-    unsigned code = 200;
-    pj_str_t* reason = 0;
-    pjsua_msg_data* msg_data = 0;
+  return Undefined();
+}
 
-    switch (args.Length()) {
-      // FIXME: implement reason/msg_data
-    case 4:
-    case 3:
-      throw JSException("reason and msg_data arguments not implemented");
-    case 2:
-      code = args[1]->Int32Value();
-    case 1:
-      call_id = args[0]->Int32Value();
+// Record the call to path, see Recording.  Options:
+//
+// format           "wav" (default) or "raw"
+// split_channels   record received and sent audio to separate files
+// max_size         bytes per file before a new file is started, must
+//                  be larger than 44
+// max_duration     seconds per file before a new file is started
+// buffer_duration  milliseconds of audio per write (default: 500)
+//
+// Returns the recording ID that identifies the recording_file events.
+// The recording stops when the call is disconnected.
+Handle<Value>
+PJSUA::recordCall(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() < 2 || args.Length() > 3) {
+      throw JSException("Invalid number of arguments to recordCall(callId, path[, options])");
     }
-
-    pj_status_t status = pjsua_call_answer(call_id, code, reason, msg_data);
-    if (status != PJ_SUCCESS) {
-      throw PJJSException("Error answering call", status);
+    requireBridge("recordCall");
+    const pjsua_call_id callId = args[0]->Int32Value();
+    const string path = *String::Utf8Value(args[1]);
+
+    Recording::Options recordingOptions;
+    recordingOptions.format = Recording::WAV;
+    recordingOptions.splitChannels = false;
+    recordingOptions.maxBytes = 0;
+    recordingOptions.maxDuration = 0;
+    recordingOptions.bufferDuration = 0.5;
+    if (args.Length() == 3) {
+      Local<Object> options = args[2]->ToObject();
+      if (options->Has(String::NewSymbol("format"))) {
+        const string format = *String::Utf8Value(options->Get(String::NewSymbol("format")));
+        if (format == "wav") {
+          recordingOptions.format = Recording::WAV;
+        } else if (format == "raw") {
+          recordingOptions.format = Recording::RAW;
+        } else {
+          throw JSException("Unknown recording format " + format);
+        }
+      }
+      if (options->Has(String::NewSymbol("split_channels"))) {
+        recordingOptions.splitChannels = options->Get(String::NewSymbol("split_channels"))->BooleanValue();
+      }
+      if (options->Has(String::NewSymbol("max_size"))) {
+        recordingOptions.maxBytes = (uint64_t) options->Get(String::NewSymbol("max_size"))->NumberValue();
+      }
+      if (options->Has(String::NewSymbol("max_duration"))) {
+        recordingOptions.maxDuration = options->Get(String::NewSymbol("max_duration"))->NumberValue();
+      }
+      if (options->Has(String::NewSymbol("buffer_duration"))) {
+        recordingOptions.bufferDuration = options->Get(String::NewSymbol("buffer_duration"))->NumberValue() / 1000.0;
+      }
     }
 
-    return Undefined();
+    uint32_t id = recordingWriter.start(dispatch, callId, path, recordingOptions);
+    return scope.Close(Integer::NewFromUnsigned(id));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
 }
 
+// Stop a recording.  Returns false if it has already been stopped.
 Handle<Value>
-PJSUA::callHangup(const Arguments& args)
+PJSUA::stopRecording(const Arguments& args)
 {
   HandleScope scope;
   try {
-    if (args.Length() < 1 || args.Length() > 4) {
-      throw JSException("Invalid number of arguments to callHangup (callId[, status[, reason[, msg_data]]])");
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to stopRecording(recordingId)");
     }
+    return scope.Close(Boolean::New(recordingWriter.stop(args[0]->Uint32Value())));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
 
-    pjsua_call_id call_id = args[0]->Int32Value();
-    unsigned code = 0;
-    pj_str_t* reason = 0;
-    pjsua_msg_data* msg_data = 0;
-
-    switch (args.Length()) {
-      // FIXME: implement reason/msg_data
-    case 4:
-    case 3:
-      throw JSException("reason and msg_data arguments not implemented");
-    case 2:
-      code = args[1]->Int32Value();
+// Load a prompt from a 16 bit PCM WAV file, see PromptCache.  Loading
+// a prompt ID again replaces the prompt.  Returns the duration of the
+// prompt in seconds.
+Handle<Value>
+PJSUA::loadPrompt(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 2) {
+      throw JSException("Invalid number of arguments to loadPrompt(promptId, path)");
     }
+    requireBridge("loadPrompt");
+    const string promptId = *String::Utf8Value(args[0]);
+    const string path = *String::Utf8Value(args[1]);
+    return scope.Close(Number::New(promptCache.load(promptId, path)));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
 
-    pj_status_t status = pjsua_call_hangup(call_id, code, reason, msg_data);
-    if (status != PJ_SUCCESS) {
-      throw PJJSException("Error hanging up", status);
+Handle<Value>
+PJSUA::unloadPrompt(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to unloadPrompt(promptId)");
     }
-
-    return Undefined();
+    return scope.Close(Boolean::New(promptCache.unload(*String::Utf8Value(args[0]))));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
 }
 
+// Play a loaded prompt to the call.  With the loop option, the prompt
+// repeats until it is stopped or the call ends.  Returns the playback
+// ID that identifies the prompt_done event.
 Handle<Value>
-PJSUA::callMakeCall(const Arguments& args)
+PJSUA::playPrompt(const Arguments& args)
 {
   HandleScope scope;
   try {
-    if (args.Length() < 2 || args.Length() > 5) {
-      throw JSException("Invalid number of arguments to callMakeCall (accId, destUri[, options[, user_data[, msg_data]]])");
+    if (args.Length() < 2 || args.Length() > 3) {
+      throw JSException("Invalid number of arguments to playPrompt(callId, promptId[, options])");
     }
-
-    pjsua_acc_id acc_id = args[0]->Int32Value();
-    String::Utf8Value dest_uri(args[1]);
-    unsigned options = 0;
-    void* user_data = 0;
-    pjsua_msg_data* msg_data = 0;
-    pjsua_call_id call_id = 0;
-
-    switch (args.Length()) {
-      // FIXME: implement options/user_data/msg_data
-    case 5:
-    case 4:
-    case 3:
-      throw JSException("options, user_data and msg_data arguments not implemented");
+    const pjsua_call_id callId = args[0]->Int32Value();
+    const string promptId = *String::Utf8Value(args[1]);
+    bool loop = false;
+    if (args.Length() == 3 && args[2]->IsObject() && args[2]->ToObject()->Has(String::NewSymbol("loop"))) {
+      loop = args[2]->ToObject()->Get(String::NewSymbol("loop"))->BooleanValue();
     }
+    return scope.Close(Integer::NewFromUnsigned(promptCache.play(dispatch, callId, promptId, loop)));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
 
-    pj_str_t pj_dest_uri;
-    pj_dest_uri.ptr = (char*) *dest_uri;
-    pj_dest_uri.slen = dest_uri.length();
-
-    pj_status_t status = pjsua_call_make_call(acc_id, &pj_dest_uri, options, user_data, msg_data, &call_id);
-    if (status != PJ_SUCCESS) {
-      throw PJJSException("Error making call", status);
+// Stop a playback.  Returns false if it has already ended.
+Handle<Value>
+PJSUA::stopPrompt(const Arguments& args)
+{
+  HandleScope scope;
+  try {
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to stopPrompt(playbackId)");
     }
-
-    return Integer::New(call_id);
+    return scope.Close(Boolean::New(promptCache.stop(args[0]->Uint32Value())));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
 }
 
+// Collect DTMF digits of the call natively, see DtmfCollector.
+// Options:
+//
+// max_digits           end after this many digits
+// terminator           digit that ends the collection, e.g. "#"
+// inter_digit_timeout  milliseconds to wait for the next digit
+// timeout              milliseconds for the whole collection
+// digit_map            MGCP style digit map, see DigitMap
+// pattern              POSIX extended regular expression that the
+//                      digits must match completely
+//
+// The result is delivered as a dtmf_collected event with the call
+// ID, the digits and the reason why the collection ended.
 Handle<Value>
-PJSUA::stop(const Arguments& args)
+PJSUA::collectDigits(const Arguments& args)
 {
   HandleScope scope;
+  try {
+    if (args.Length() != 2 || !args[1]->IsObject()) {
+      throw JSException("Invalid arguments to collectDigits(callId, options)");
+    }
+    const pjsua_call_id callId = args[0]->Int32Value();
+    if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS || !pjsua_call_is_active(callId)) {
+      throw JSException("Call is not active");
+    }
+
+    Local<Object> options = args[1]->ToObject();
+    DtmfCollector::Options collectorOptions;
+    collectorOptions.maxDigits = 0;
+    collectorOptions.terminator = 0;
+    collectorOptions.interDigitTimeout = 0;
+    collectorOptions.timeout = 0;
+    if (options->Has(String::NewSymbol("max_digits"))) {
+      collectorOptions.maxDigits = options->Get(String::NewSymbol("max_digits"))->Uint32Value();
+    }
+    if (options->Has(String::NewSymbol("terminator"))) {
+      const string terminator = *String::Utf8Value(options->Get(String::NewSymbol("terminator")));
+      if (terminator.length() != 1) {
+        throw JSException("terminator must be a single digit");
+      }
+      collectorOptions.terminator = terminator[0];
+    }
+    if (options->Has(String::NewSymbol("inter_digit_timeout"))) {
+      collectorOptions.interDigitTimeout = options->Get(String::NewSymbol("inter_digit_timeout"))->Uint32Value();
+    }
+    if (options->Has(String::NewSymbol("timeout"))) {
+      collectorOptions.timeout = options->Get(String::NewSymbol("timeout"))->Uint32Value();
+    }
+    if (options->Has(String::NewSymbol("digit_map"))) {
+      collectorOptions.digitMap.compile(*String::Utf8Value(options->Get(String::NewSymbol("digit_map"))));
+    }
+    if (options->Has(String::NewSymbol("pattern"))) {
+      collectorOptions.pattern = *String::Utf8Value(options->Get(String::NewSymbol("pattern")));
+    }
+    if (!collectorOptions.maxDigits && !collectorOptions.terminator && !collectorOptions.interDigitTimeout
+        && !collectorOptions.timeout && collectorOptions.digitMap.empty() && collectorOptions.pattern.empty()) {
+      throw JSException("collectDigits needs at least one condition that ends the collection");
+    }
+
+    dtmfCollector.start(dispatch, callId, collectorOptions);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+
   return Undefined();
 }
 
+// Cancel the digit collection of the call without an event.  Returns
+// false if none was running.
 Handle<Value>
-PJSUA::confConnect(const Arguments& args)
+PJSUA::cancelDigits(const Arguments& args)
 {
   HandleScope scope;
   try {
-    if (args.Length() != 2) {
-      throw JSException("Invalid number of arguments to confConnect(source, sink)");
+    if (args.Length() != 1) {
+      throw JSException("Invalid number of arguments to cancelDigits(callId)");
     }
-    const pjsua_conf_port_id source = args[0]->Int32Value();
-    const pjsua_conf_port_id sink = args[1]->Int32Value();
-    pj_status_t status = pjsua_conf_connect(source, sink);
-    if (status != PJ_SUCCESS) {
-      throw PJJSException("Error connecting media", status);
+    const pjsua_call_id callId = args[0]->Int32Value();
+    if (callId < 0 || callId >= (pjsua_call_id) PJSUA_MAX_CALLS) {
+      throw JSException("Invalid call ID");
     }
+    return scope.Close(Boolean::New(dtmfCollector.cancel(callId)));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
-
-  return Undefined();
 }
-  
+
 Handle<Value>
 PJSUA::setAudioDeviceIndex(const Arguments& args)
 {
@@ -1286,5 +9189,9 @@ extern "C" {
     atexit(uninit);
   }
 
+#ifdef PJSIP_BENCHMARK
+  NODE_MODULE(pjsip_bench, init);
+#else
   NODE_MODULE(pjsip, init);
+#endif
 }
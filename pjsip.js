@@ -86,4 +86,48 @@ exports.CALL_STATE = {
 var nextCallInstanceId = 0x40000000;
 exports.generateCallInstanceId = function () {
     return nextCallInstanceId++;
-}
\ No newline at end of file
+}
+
+// Copy the row of the call from pjsip.callTable into row (an object
+// that is reused by the caller) and return it.  The row is copied
+// again if a PJSIP thread updated it meanwhile.  Returns null if the
+// row stayed locked by a writer for too long; the caller should try
+// again later instead of spinning on Node's thread.
+//
+// The durations are computed from the timestamps of the row, so they
+// keep counting between call events.
+//
+// Reading the columns directly relies on loads not being reordered,
+// which only x86 guarantees.  On other CPUs (pjsip.callTable.ordered
+// is false) the row is copied natively with memory fences.
+var callTableFields = [ 'state', 'media_status', 'conf_slot', 'acc_id', 'last_status',
+                        'start_time', 'connect_time', 'end_time' ];
+var callTableRetries = 1000;
+
+function addCallDurations(row) {
+    var end = row.end_time || Date.now();
+    row.total_duration = row.start_time ? end - row.start_time : 0;
+    row.connect_duration = row.connect_time ? end - row.connect_time : 0;
+    return row;
+}
+
+exports.readCallTable = function (callId, row) {
+    var table = pjsip.callTable;
+    row = row || {};
+    if (!table.ordered) {
+        return pjsip.readCallTableRow(callId, row) ? addCallDurations(row) : null;
+    }
+    for (var retry = 0; retry < callTableRetries; retry++) {
+        var seq = table.seq[callId];
+        if (seq & 1) {
+            continue;
+        }
+        for (var i = 0; i < callTableFields.length; i++) {
+            row[callTableFields[i]] = table[callTableFields[i]][callId];
+        }
+        if (table.seq[callId] == seq) {
+            return addCallDurations(row);
+        }
+    }
+    return null;
+}